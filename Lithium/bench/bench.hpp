@@ -0,0 +1,36 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <string>
+
+// Helpers shared by the benchmarks, and by the tests that compile
+// generated programs
+
+// Best wall time of runs calls of f, in seconds
+inline double best_of(const int runs, const std::function<void()>& f) {
+    double best = 1e300;
+    for (int i = 0; i < runs; i++) {
+        const auto start = std::chrono::steady_clock::now();
+        f();
+        const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::min(best, elapsed.count());
+    }
+    return best;
+}
+
+// A program of n chunks of lets, compound sets and if chains, each
+// depending on the one before. It starts with a trapping division, which
+// constant propagation leaves in place, so every chunk reaches codegen.
+inline std::string make_chunks(const size_t n) {
+    std::string src = "let z = 0;\nlet v0 = 7 / z;\n";
+    for (size_t i = 1; i <= n; i++) {
+        const std::string v = "v" + std::to_string(i);
+        const std::string prev = "v" + std::to_string(i - 1);
+        src += "let " + v + " = " + prev + " * 3 + " + std::to_string(i) + ";\n";
+        src += "if (" + v + " / 7) {\n    " + v + " -= 1;\n} else if (" + prev + ") {\n    " + v + " += 2;\n} else {\n    { let t = " + v + "; " + v + " = t * t; }\n}\n";
+    }
+    src += "exit(v" + std::to_string(n) + ");\n";
+    return src;
+}
@@ -0,0 +1,214 @@
+// Code generation throughput, and the assembly listing written through
+// OutputBuffer against the std::ostream path it replaced: the same text
+// formatted with operator<< into a std::ostringstream on the arena, copied
+// out with str() and written with an ofstream. The two listings are
+// compared byte for byte first.
+//
+//     bench_codegen [file.l] [-runs R]
+//
+// Without a file it compiles make_chunks(100000).
+// Every row is the best of R runs (default 5). Lexing, parsing and the IR
+// passes run once, untimed.
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <memory_resource>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+#include <utility>
+
+#include "arena.hpp"
+#include "bench.hpp"
+#include "dead_code.hpp"
+#include "encoder.hpp"
+#include "folding.hpp"
+#include "generation.hpp"
+#include "ir.hpp"
+#include "mapped_file.hpp"
+#include "output_buffer.hpp"
+#include "parser.hpp"
+#include "sccp.hpp"
+#include "tokenization.hpp"
+
+namespace reference {
+
+std::ostream& operator<<(std::ostream& out, const Operand& operand) {
+    switch (operand.kind) {
+        case Operand::Kind::none:
+            return out;
+        case Operand::Kind::reg:
+            return out << reg_name(operand.reg);
+        case Operand::Kind::stack:
+            if (operand.value < 0) {
+                return out << "QWORD [" << reg_name(operand.reg) << "-" << -operand.value << "]";
+            }
+            return out << "QWORD [" << reg_name(operand.reg) << "+" << operand.value << "]";
+        case Operand::Kind::imm:
+            return out << operand.value;
+        case Operand::Kind::label:
+            return out << "label" << operand.value;
+        case Operand::Kind::scaled:
+            return out << "[" << reg_name(operand.reg) << "+" << reg_name(operand.reg) << "*" << operand.value << "]";
+    }
+    return out;
+}
+
+std::ostream& operator<<(std::ostream& out, const Instr& instr) {
+    switch (instr.op) {
+        case Opcode::mov:
+            return out << "    mov " << instr.dst << ", " << instr.src << "\n";
+        case Opcode::add:
+            return out << "    add " << instr.dst << ", " << instr.src << "\n";
+        case Opcode::sub:
+            return out << "    sub " << instr.dst << ", " << instr.src << "\n";
+        case Opcode::imul:
+            if (instr.src.kind == Operand::Kind::imm) {
+                return out << "    imul " << instr.dst << ", " << instr.dst << ", " << instr.src << "\n";
+            }
+            return out << "    imul " << instr.dst << ", " << instr.src << "\n";
+        case Opcode::mul:
+            return out << "    mul " << instr.src << "\n";
+        case Opcode::div:
+            return out << "    div " << instr.src << "\n";
+        case Opcode::shl:
+            return out << "    shl " << instr.dst << ", " << instr.src << "\n";
+        case Opcode::shr:
+            return out << "    shr " << instr.dst << ", " << instr.src << "\n";
+        case Opcode::lea:
+            return out << "    lea " << instr.dst << ", " << instr.src << "\n";
+        case Opcode::clear:
+            return out << "    xor " << reg_name32(instr.dst.reg) << ", " << reg_name32(instr.dst.reg) << "\n";
+        case Opcode::test:
+            return out << "    test " << instr.dst << ", " << instr.src << "\n";
+        case Opcode::push:
+            return out << "    push " << instr.src << "\n";
+        case Opcode::pop:
+            return out << "    pop " << instr.dst << "\n";
+        case Opcode::jmp:
+            return out << "    jmp " << instr.dst << "\n";
+        case Opcode::jz:
+            return out << "    jz " << instr.dst << "\n";
+        case Opcode::label:
+            return out << instr.dst << ":\n";
+        case Opcode::syscall:
+            return out << "    syscall\n";
+        case Opcode::ret:
+            return out << "    ret\n";
+        case Opcode::comment:
+            return out << "    ;; bb" << instr.dst.value << "\n";
+    }
+    return out;
+}
+
+void write_asm(const std::pmr::vector<Instr>& code, const std::string& path, std::pmr::memory_resource* resource) {
+    std::basic_ostringstream<char, std::char_traits<char>, std::pmr::polymorphic_allocator<char>> text(std::ios_base::out, resource);
+    text << "global _start\n_start:\n";
+    for (const Instr& instr : code) {
+        text << instr;
+    }
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    const std::pmr::string str = std::move(text).str();
+    file.write(str.data(), static_cast<std::streamsize>(str.size()));
+}
+
+}
+
+static std::string read_file(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    return { std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+}
+
+int main(int argc, char** argv) {
+    int runs = 5;
+    std::optional<std::string> path;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "-runs") == 0 && i + 1 < argc && std::atoi(argv[i + 1]) > 0) {
+            runs = std::atoi(argv[++i]);
+        }
+        else {
+            path = argv[i];
+        }
+    }
+    std::string src;
+    if (path.has_value()) {
+        const std::optional<MappedFile> file = MappedFile::open(path.value());
+        if (!file.has_value()) {
+            std::cerr << "Error: could not open '" << path.value() << "'" << std::endl;
+            return EXIT_FAILURE;
+        }
+        src = file->view();
+    }
+    else {
+        src = make_chunks(100000);
+    }
+
+    ArenaAllocator arena(1024 * 1024);
+    Tokenizer tokenizer(src, "bench.l", &arena);
+    Parser parser(TokenStream(tokenizer), tokenizer.lines(), "bench.l", &arena);
+    std::optional<NodeProg> prog = parser.parse_prog();
+    if (!prog.has_value()) {
+        std::cerr << "Error: invalid program" << std::endl;
+        return EXIT_FAILURE;
+    }
+    Folder folder(prog.value(), tokenizer.symbols().size(), &arena);
+    folder.fold_prog();
+    IrBuilder builder(prog.value(), tokenizer.symbols(), "bench.l", &arena);
+    ConstantPropagator propagator(&arena);
+    DeadCodeEliminator eliminator(&arena);
+    const IrProg ir = eliminator.run(propagator.run(builder.build()));
+
+    const std::filesystem::path dir = std::filesystem::temp_directory_path();
+    const std::string after_path = (dir / ("bench_codegen_after" + std::to_string(getpid()) + ".asm")).string();
+    const std::string before_path = (dir / ("bench_codegen_before" + std::to_string(getpid()) + ".asm")).string();
+
+    Generator listing(ir, false, Generator::ExitMode::syscall, &arena);
+    const std::pmr::vector<Instr>& code = listing.gen_prog();
+    {
+        std::optional<OutputBuffer> out = OutputBuffer::create(after_path, OutputBuffer::default_capacity, &arena);
+        listing.write_asm(out.value());
+    }
+    reference::write_asm(code, before_path, &arena);
+    const std::string text = read_file(after_path);
+    if (text != read_file(before_path)) {
+        std::cerr << "Error: the OutputBuffer and ostream listings differ" << std::endl;
+        return EXIT_FAILURE;
+    }
+    const double mib = static_cast<double>(text.size()) / (1024 * 1024);
+
+    size_t code_bytes = 0;
+    const double gen = best_of(runs, [&] {
+        ArenaAllocator scratch(1024 * 1024);
+        Generator generator(ir, false, Generator::ExitMode::syscall, &scratch);
+        static_cast<void>(generator.gen_prog());
+    });
+    const double encode = best_of(runs, [&] {
+        ArenaAllocator scratch(1024 * 1024);
+        Encoder encoder(&scratch);
+        code_bytes = encoder.encode(code).size();
+    });
+    const double after = best_of(runs, [&] {
+        ArenaAllocator scratch(1024 * 1024);
+        std::optional<OutputBuffer> out = OutputBuffer::create(after_path, OutputBuffer::default_capacity, &scratch);
+        listing.write_asm(out.value());
+    });
+    const double before = best_of(runs, [&] {
+        ArenaAllocator scratch(1024 * 1024);
+        reference::write_asm(code, before_path, &scratch);
+    });
+    std::filesystem::remove(after_path);
+    std::filesystem::remove(before_path);
+
+    std::printf("%zu IR values, %zu instructions, %.1f MiB of assembly, %zu bytes of code\n", ir.values.size(), code.size(), mib, code_bytes);
+    std::printf("%-22s %9.1f ms\n", "gen_prog", gen * 1e3);
+    std::printf("%-22s %9.1f ms\n", "encode", encode * 1e3);
+    std::printf("%-22s %9.1f ms %8.1f MiB/s\n", "listing, ostringstream", before * 1e3, mib / before);
+    std::printf("%-22s %9.1f ms %8.1f MiB/s %6.2fx\n", "listing, OutputBuffer", after * 1e3, mib / after, before / after);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,89 @@
+// Thread scaling of Tokenizer::tokenize_parallel: lexes one source with 1
+// to N threads and prints the throughput and the speedup over tokenize().
+//
+//     bench_lex_threads [file.l] [-j N] [-runs R]
+//
+// Without a file it lexes a generated 64 MiB program. N defaults to the
+// number of cores; each count is the best of R runs (default 5). The
+// buffer and symbols come from an arena, as in the compiler.
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <thread>
+
+#include "arena.hpp"
+#include "bench.hpp"
+#include "mapped_file.hpp"
+#include "tokenization.hpp"
+
+// At least size bytes of lets and comments, to lex
+static std::string make_source(const size_t size) {
+    std::string src;
+    src.reserve(size + 256);
+    for (size_t i = 0; src.size() < size; i++) {
+        const std::string v = "value" + std::to_string(i % 4096);
+        src += "let " + v + "x" + std::to_string(i) + " = (" + v + " + 1234567) * 89 / 7; // the next one\n";
+        if (i % 16 == 0) {
+            src += "/* a block comment\n   over a few lines\n   to skip */\n";
+        }
+    }
+    return src;
+}
+
+int main(int argc, char** argv) {
+    unsigned max_threads = std::max(std::thread::hardware_concurrency(), 1u);
+    int runs = 5;
+    std::optional<std::string> path;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "-j") == 0 && i + 1 < argc && std::atoi(argv[i + 1]) > 0) {
+            max_threads = static_cast<unsigned>(std::atoi(argv[++i]));
+        }
+        else if (std::strcmp(argv[i], "-runs") == 0 && i + 1 < argc && std::atoi(argv[i + 1]) > 0) {
+            runs = std::atoi(argv[++i]);
+        }
+        else {
+            path = argv[i];
+        }
+    }
+
+    std::optional<MappedFile> file;
+    std::string generated;
+    std::string_view src;
+    if (path.has_value()) {
+        file = MappedFile::open(path.value());
+        if (!file.has_value()) {
+            std::cerr << "Error: could not open '" << path.value() << "'" << std::endl;
+            return EXIT_FAILURE;
+        }
+        src = file->view();
+    }
+    else {
+        generated = make_source(64 * 1024 * 1024);
+        src = generated;
+    }
+    const double mib = static_cast<double>(src.size()) / (1024 * 1024);
+
+    size_t tokens = 0;
+    const double serial = best_of(runs, [&] {
+        ArenaAllocator arena(1024 * 1024);
+        Tokenizer tokenizer(src, "bench.l", &arena);
+        tokens = tokenizer.tokenize().size();
+    });
+    std::printf("%.1f MiB, %zu tokens\n", mib, tokens);
+    std::printf("%-10s %10.1f MiB/s\n", "serial", mib / serial);
+
+    for (unsigned threads = 1; threads <= max_threads; threads++) {
+        const double seconds = best_of(runs, [&] {
+            ArenaAllocator arena(1024 * 1024);
+            Tokenizer tokenizer(src, "bench.l", &arena);
+            tokens = tokenizer.tokenize_parallel(threads).size();
+        });
+        std::printf("-j %-7u %10.1f MiB/s %6.2fx\n", threads, mib / seconds, serial / seconds);
+    }
+    return EXIT_SUCCESS;
+}
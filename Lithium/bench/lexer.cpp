@@ -0,0 +1,239 @@
+// Lexer throughput in MiB/s, for the table-driven Tokenizer against a
+// reference lexer in the style it replaced: one character at a time through
+// std::isalpha / std::isalnum and an if chain, keywords by string compare.
+//
+//     bench_lexer [file.l ...] [-runs R]
+//
+// Without files it lexes generated 32 MiB sources that each stress one part
+// of the lexer. Every row is the best of R runs (default 5); token counts
+// are compared so the two lexers are known to agree. The reference keeps
+// identifiers as views where the Tokenizer interns them, which favours it
+// on identifier-heavy sources.
+
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "arena.hpp"
+#include "bench.hpp"
+#include "mapped_file.hpp"
+#include "tokenization.hpp"
+
+namespace reference {
+
+struct Token {
+    TokenType type;
+    int line;
+    int col;
+    std::string_view value;
+};
+
+inline std::vector<Token> tokenize(const std::string_view src) {
+    std::vector<Token> tokens;
+    size_t i = 0;
+    int line = 1;
+    int col = 1;
+    const auto at = [&](const size_t offset) {
+        return i + offset < src.size() ? src[i + offset] : '\0';
+    };
+    const auto with_eq = [&](const TokenType plain, const TokenType eq) {
+        if (at(1) == '=') {
+            i += 2;
+            tokens.push_back({ .type = eq, .line = line, .col = col, .value = {} });
+        }
+        else {
+            i++;
+            tokens.push_back({ .type = plain, .line = line, .col = col, .value = {} });
+        }
+    };
+    while (i < src.size()) {
+        const char c = src[i];
+        if (std::isalpha(static_cast<unsigned char>(c))) {
+            const size_t start = i++;
+            while (i < src.size() && std::isalnum(static_cast<unsigned char>(src[i]))) {
+                i++;
+            }
+            const std::string_view word = src.substr(start, i - start);
+            TokenType type = TokenType::ident;
+            if (word == "exit") {
+                type = TokenType::_exit;
+            }
+            else if (word == "let") {
+                type = TokenType::let;
+            }
+            else if (word == "if") {
+                type = TokenType::if_;
+            }
+            else if (word == "else") {
+                type = TokenType::else_;
+            }
+            tokens.push_back({ .type = type, .line = line, .col = col, .value = type == TokenType::ident ? word : std::string_view {} });
+        }
+        else if (std::isdigit(static_cast<unsigned char>(c))) {
+            const size_t start = i++;
+            while (i < src.size() && std::isdigit(static_cast<unsigned char>(src[i]))) {
+                i++;
+            }
+            tokens.push_back({ .type = TokenType::int_lit, .line = line, .col = col, .value = src.substr(start, i - start) });
+        }
+        else if (c == '/' && at(1) == '/') {
+            while (i < src.size() && src[i] != '\n') {
+                i++;
+            }
+        }
+        else if (c == '/' && at(1) == '*') {
+            i += 2;
+            while (i < src.size() && !(src[i] == '*' && at(1) == '/')) {
+                i++;
+            }
+            i = std::min(i + 2, src.size());
+        }
+        else if (c == '(') {
+            i++;
+            tokens.push_back({ .type = TokenType::open_paren, .line = line, .col = col, .value = {} });
+        }
+        else if (c == ')') {
+            i++;
+            tokens.push_back({ .type = TokenType::close_paren, .line = line, .col = col, .value = {} });
+        }
+        else if (c == ';') {
+            i++;
+            tokens.push_back({ .type = TokenType::semi, .line = line, .col = col, .value = {} });
+        }
+        else if (c == '=') {
+            i++;
+            tokens.push_back({ .type = TokenType::eq, .line = line, .col = col, .value = {} });
+        }
+        else if (c == '+') {
+            with_eq(TokenType::plus, TokenType::pluseq);
+        }
+        else if (c == '*') {
+            with_eq(TokenType::star, TokenType::stareq);
+        }
+        else if (c == '-') {
+            with_eq(TokenType::minus, TokenType::minuseq);
+        }
+        else if (c == '/') {
+            with_eq(TokenType::fslash, TokenType::fslasheq);
+        }
+        else if (c == '{') {
+            i++;
+            tokens.push_back({ .type = TokenType::open_curly, .line = line, .col = col, .value = {} });
+        }
+        else if (c == '}') {
+            i++;
+            tokens.push_back({ .type = TokenType::close_curly, .line = line, .col = col, .value = {} });
+        }
+        else if (c == '\n') {
+            i++;
+            line++;
+            col = 0;
+        }
+        else if (std::isspace(static_cast<unsigned char>(c))) {
+            i++;
+        }
+        else {
+            std::cerr << "Error: unexpected character '" << c << "'" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        col++;
+    }
+    return tokens;
+}
+
+}
+
+struct Source {
+    std::string name;
+    std::string text;
+};
+
+static std::string repeat(const size_t size, const std::function<std::string(size_t)>& line) {
+    std::string text;
+    text.reserve(size + 256);
+    for (size_t i = 0; text.size() < size; i++) {
+        text += line(i);
+    }
+    return text;
+}
+
+static std::vector<Source> generated_sources() {
+    constexpr size_t size = 32 * 1024 * 1024;
+    return {
+        { "mixed", repeat(size, [](const size_t i) {
+            const std::string v = "v" + std::to_string(i % 1000);
+            return "let " + v + "x" + std::to_string(i) + " = (" + v + " + " + std::to_string(i * 7919) + ") * 3;\nif (" + v + ") { " + v + " -= 1; }\n";
+        }) },
+        { "long idents", repeat(size, [](const size_t i) {
+            return "let averyveryverylongidentifiernumber" + std::to_string(i) + " = anotherquitelongidentifiername" + std::to_string(i % 97) + ";\n";
+        }) },
+        { "literals", repeat(size, [](const size_t i) {
+            return "exit(" + std::to_string(i * 2654435761u) + " + 18446744073709551615 * " + std::to_string(i) + ");\n";
+        }) },
+        { "comments", repeat(size, [](const size_t i) {
+            return "// a line comment of some length, as code has them " + std::to_string(i) + "\n/* and a block\n   comment over\n   three lines */ let x" + std::to_string(i) + " = 1;\n";
+        }) },
+        { "whitespace", repeat(size, [](const size_t i) {
+            return "        \t    let    y" + std::to_string(i % 10) + "    =    2    ;        \n\n\n";
+        }) },
+    };
+}
+
+int main(int argc, char** argv) {
+    int runs = 5;
+    std::vector<Source> sources;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "-runs") == 0 && i + 1 < argc && std::atoi(argv[i + 1]) > 0) {
+            runs = std::atoi(argv[++i]);
+            continue;
+        }
+        const std::optional<MappedFile> file = MappedFile::open(argv[i]);
+        if (!file.has_value()) {
+            std::cerr << "Error: could not open '" << argv[i] << "'" << std::endl;
+            return EXIT_FAILURE;
+        }
+        sources.push_back({ argv[i], std::string(file->view()) });
+    }
+    if (sources.empty()) {
+        sources = generated_sources();
+    }
+
+    std::printf("%-14s %12s %12s %12s %8s\n", "source", "reference", "tokenize", "next", "speedup");
+    for (const Source& source : sources) {
+        const double mib = static_cast<double>(source.text.size()) / (1024 * 1024);
+        size_t reference_tokens = 0;
+        size_t buffer_tokens = 0;
+        size_t stream_tokens = 0;
+        const double reference = best_of(runs, [&] {
+            reference_tokens = reference::tokenize(source.text).size();
+        });
+        const double buffer = best_of(runs, [&] {
+            ArenaAllocator arena(1024 * 1024);
+            Tokenizer tokenizer(source.text, "bench.l", &arena);
+            buffer_tokens = tokenizer.tokenize().size();
+        });
+        // As the parser pulls them, without storing the stream
+        const double stream = best_of(runs, [&] {
+            ArenaAllocator arena(1024 * 1024);
+            Tokenizer tokenizer(source.text, "bench.l", &arena);
+            stream_tokens = 0;
+            while (tokenizer.next().has_value()) {
+                stream_tokens++;
+            }
+        });
+        if (buffer_tokens != reference_tokens || stream_tokens != reference_tokens) {
+            std::cerr << "Error: " << source.name << ": " << reference_tokens << " tokens from the reference lexer, "
+                      << buffer_tokens << " from tokenize, " << stream_tokens << " from next" << std::endl;
+            return EXIT_FAILURE;
+        }
+        std::printf("%-14s %7.1f MiB/s %7.1f MiB/s %7.1f MiB/s %7.2fx\n", source.name.c_str(), mib / reference, mib / buffer, mib / stream, reference / buffer);
+    }
+    return EXIT_SUCCESS;
+}
@@ -1,16 +1,32 @@
 #pragma once
 
+#include <algorithm>
 #include <cstddef>
 #include <cstdlib>
 #include <memory>
+#include <memory_resource>
+#include <new>
+#include <type_traits>
 #include <utility>
 
-class ArenaAllocator final {
+#include <sys/mman.h>
+
+// Bump allocator over a list of chunks. When the current chunk is full a new
+// one twice the size is added, so the arena grows with the program instead
+// of throwing. Chunks of huge_page_size and up come straight from mmap and
+// are advised as transparent huge pages.
+//
+// The arena is also a std::pmr::memory_resource, so std::pmr containers can
+// draw from it. Deallocation is a no-op; memory comes back on reset() or
+// destruction. Not thread-safe.
+class ArenaAllocator final : public std::pmr::memory_resource {
 public:
-    explicit ArenaAllocator(const std::size_t max_num_bytes)
-        : m_size { max_num_bytes }
-        , m_buffer { new std::byte[max_num_bytes] }
-        , m_offset { m_buffer }
+    static constexpr std::size_t huge_page_size = 2 * 1024 * 1024;
+    static constexpr std::size_t max_chunk_size = 256 * 1024 * 1024;
+
+    explicit ArenaAllocator(const std::size_t initial_chunk_size, const bool huge_pages = true)
+        : m_next_chunk_size { std::max(initial_chunk_size, sizeof(Chunk) * 2) }
+        , m_huge_pages { huge_pages }
     {
     }
 
@@ -18,52 +34,195 @@ public:
     ArenaAllocator& operator=(const ArenaAllocator&) = delete;
 
     ArenaAllocator(ArenaAllocator&& other) noexcept
-        : m_size { std::exchange(other.m_size, 0) }
-        , m_buffer { std::exchange(other.m_buffer, nullptr) }
+        : m_chunk { std::exchange(other.m_chunk, nullptr) }
         , m_offset { std::exchange(other.m_offset, nullptr) }
+        , m_end { std::exchange(other.m_end, nullptr) }
+        , m_destructors { std::exchange(other.m_destructors, nullptr) }
+        , m_next_chunk_size { other.m_next_chunk_size }
+        , m_huge_pages { other.m_huge_pages }
+        , m_bytes_used { std::exchange(other.m_bytes_used, 0) }
+        , m_bytes_reserved { std::exchange(other.m_bytes_reserved, 0) }
+        , m_high_water { std::exchange(other.m_high_water, 0) }
     {
     }
 
     ArenaAllocator& operator=(ArenaAllocator&& other) noexcept
     {
-        std::swap(m_size, other.m_size);
-        std::swap(m_buffer, other.m_buffer);
+        std::swap(m_chunk, other.m_chunk);
         std::swap(m_offset, other.m_offset);
+        std::swap(m_end, other.m_end);
+        std::swap(m_destructors, other.m_destructors);
+        std::swap(m_next_chunk_size, other.m_next_chunk_size);
+        std::swap(m_huge_pages, other.m_huge_pages);
+        std::swap(m_bytes_used, other.m_bytes_used);
+        std::swap(m_bytes_reserved, other.m_bytes_reserved);
+        std::swap(m_high_water, other.m_high_water);
         return *this;
     }
 
+    [[nodiscard]] void* alloc_bytes(const std::size_t num_bytes, const std::size_t alignment)
+    {
+        void* pointer = m_offset;
+        std::size_t remaining_num_bytes = static_cast<std::size_t>(m_end - m_offset);
+        if (m_offset == nullptr || std::align(alignment, num_bytes, pointer, remaining_num_bytes) == nullptr) {
+            add_chunk(num_bytes + alignment);
+            pointer = m_offset;
+            remaining_num_bytes = static_cast<std::size_t>(m_end - m_offset);
+            pointer = std::align(alignment, num_bytes, pointer, remaining_num_bytes);
+        }
+        const auto aligned_address = static_cast<std::byte*>(pointer);
+        m_bytes_used += static_cast<std::size_t>(aligned_address + num_bytes - m_offset);
+        m_high_water = std::max(m_high_water, m_bytes_used);
+        m_offset = aligned_address + num_bytes;
+        return aligned_address;
+    }
+
     template <typename T>
     [[nodiscard]] T* alloc()
     {
-        std::size_t remaining_num_bytes = m_size - static_cast<std::size_t>(m_offset - m_buffer);
-        auto pointer = static_cast<void*>(m_offset);
-        const auto aligned_address = std::align(alignof(T), sizeof(T), pointer, remaining_num_bytes);
-        if (aligned_address == nullptr) {
-            throw std::bad_alloc {};
-        }
-        m_offset = static_cast<std::byte*>(aligned_address) + sizeof(T);
-        return static_cast<T*>(aligned_address);
+        return static_cast<T*>(alloc_bytes(sizeof(T), alignof(T)));
     }
 
+    // Non-trivially destructible objects (e.g. NodeScope and its std::vector)
+    // are recorded so the arena can destroy them on reset() or destruction.
     template <typename T, typename... Args>
     [[nodiscard]] T* emplace(Args&&... args)
     {
         const auto allocated_memory = alloc<T>();
-        return new (allocated_memory) T { std::forward<Args>(args)... };
+        const auto object = new (allocated_memory) T { std::forward<Args>(args)... };
+        if constexpr (!std::is_trivially_destructible_v<T>) {
+            m_destructors = new (alloc<Destructor>()) Destructor {
+                .destroy = [](void* p) { static_cast<T*>(p)->~T(); },
+                .object = object,
+                .next = m_destructors,
+            };
+        }
+        return object;
+    }
+
+    // Destroys everything allocated so far and keeps only the newest (largest)
+    // chunk, so the arena can be reused for another compilation.
+    void reset()
+    {
+        run_destructors();
+        if (m_chunk == nullptr) {
+            return;
+        }
+        Chunk* const kept = m_chunk;
+        free_chunks(std::exchange(kept->prev, nullptr));
+        m_bytes_reserved = kept->size;
+        m_offset = reinterpret_cast<std::byte*>(kept + 1);
+        m_bytes_used = 0;
     }
 
-    ~ArenaAllocator()
+    // Bytes handed out since construction or the last reset(), alignment padding included
+    [[nodiscard]] std::size_t bytes_used() const
     {
-        // No destructors are called for the stored objects. Thus, memory
-        // leaks are possible (e.g. when storing std::vector objects or
-        // other non-trivially destructable objects in the allocator).
-        // Although this could be changed, it would come with additional
-        // runtime overhead and therefore is not implemented.
-        delete[] m_buffer;
+        return m_bytes_used;
+    }
+
+    // Largest bytes_used() ever reached, across resets
+    [[nodiscard]] std::size_t high_water() const
+    {
+        return m_high_water;
+    }
+
+    [[nodiscard]] std::size_t bytes_reserved() const
+    {
+        return m_bytes_reserved;
+    }
+
+    ~ArenaAllocator() override
+    {
+        run_destructors();
+        free_chunks(m_chunk);
     }
 
 private:
-    std::size_t m_size;
-    std::byte* m_buffer;
-    std::byte* m_offset;
-};
\ No newline at end of file
+    void* do_allocate(const std::size_t num_bytes, const std::size_t alignment) override
+    {
+        return alloc_bytes(num_bytes, alignment);
+    }
+
+    void do_deallocate(void*, std::size_t, std::size_t) override
+    {
+    }
+
+    [[nodiscard]] bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override
+    {
+        return this == &other;
+    }
+
+    struct Chunk {
+        Chunk* prev;
+        std::size_t size;
+        bool mapped;
+    };
+
+    struct Destructor {
+        void (*destroy)(void*);
+        void* object;
+        Destructor* next;
+    };
+
+    void add_chunk(const std::size_t min_num_bytes)
+    {
+        std::size_t size = m_next_chunk_size;
+        while (size < min_num_bytes + sizeof(Chunk)) {
+            size *= 2;
+        }
+        m_next_chunk_size = std::min(size * 2, std::max(max_chunk_size, size));
+
+        void* memory = nullptr;
+        bool mapped = false;
+        if (m_huge_pages && size >= huge_page_size) {
+            size = (size + huge_page_size - 1) / huge_page_size * huge_page_size;
+            memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (memory == MAP_FAILED) {
+                throw std::bad_alloc {};
+            }
+            madvise(memory, size, MADV_HUGEPAGE);
+            mapped = true;
+        }
+        else {
+            memory = ::operator new(size);
+        }
+
+        m_chunk = new (memory) Chunk { .prev = m_chunk, .size = size, .mapped = mapped };
+        m_offset = reinterpret_cast<std::byte*>(m_chunk + 1);
+        m_end = static_cast<std::byte*>(memory) + size;
+        m_bytes_reserved += size;
+    }
+
+    void run_destructors()
+    {
+        for (Destructor* destructor = m_destructors; destructor != nullptr; destructor = destructor->next) {
+            destructor->destroy(destructor->object);
+        }
+        m_destructors = nullptr;
+    }
+
+    static void free_chunks(Chunk* chunk)
+    {
+        while (chunk != nullptr) {
+            Chunk* const prev = chunk->prev;
+            if (chunk->mapped) {
+                munmap(chunk, chunk->size);
+            }
+            else {
+                ::operator delete(chunk);
+            }
+            chunk = prev;
+        }
+    }
+
+    Chunk* m_chunk = nullptr;
+    std::byte* m_offset = nullptr;
+    std::byte* m_end = nullptr;
+    Destructor* m_destructors = nullptr;
+    std::size_t m_next_chunk_size;
+    bool m_huge_pages;
+    std::size_t m_bytes_used = 0;
+    std::size_t m_bytes_reserved = 0;
+    std::size_t m_high_water = 0;
+};
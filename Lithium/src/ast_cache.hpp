@@ -0,0 +1,525 @@
+#pragma once
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#include <unistd.h>
+
+#include "mapped_file.hpp"
+#include "parser.hpp"
+
+// XXH64 of data
+inline std::uint64_t xxh64(const std::string_view data, const std::uint64_t seed = 0) {
+    constexpr std::uint64_t prime1 = 0x9E3779B185EBCA87ULL;
+    constexpr std::uint64_t prime2 = 0xC2B2AE3D27D4EB4FULL;
+    constexpr std::uint64_t prime3 = 0x165667B19E3779F9ULL;
+    constexpr std::uint64_t prime4 = 0x85EBCA77C2B2AE63ULL;
+    constexpr std::uint64_t prime5 = 0x27D4EB2F165667C5ULL;
+
+    const auto read64 = [](const char* p) {
+        std::uint64_t value;
+        std::memcpy(&value, p, sizeof(value));
+        return value;
+    };
+    const auto read32 = [](const char* p) {
+        std::uint32_t value;
+        std::memcpy(&value, p, sizeof(value));
+        return value;
+    };
+    const auto round = [](std::uint64_t acc, const std::uint64_t input) {
+        acc += input * prime2;
+        return std::rotl(acc, 31) * prime1;
+    };
+    const auto merge = [&](const std::uint64_t acc, const std::uint64_t lane) {
+        return (acc ^ round(0, lane)) * prime1 + prime4;
+    };
+
+    const char* p = data.data();
+    const char* const end = p + data.size();
+    std::uint64_t hash;
+    if (data.size() >= 32) {
+        std::uint64_t v1 = seed + prime1 + prime2;
+        std::uint64_t v2 = seed + prime2;
+        std::uint64_t v3 = seed;
+        std::uint64_t v4 = seed - prime1;
+        for (; p + 32 <= end; p += 32) {
+            v1 = round(v1, read64(p));
+            v2 = round(v2, read64(p + 8));
+            v3 = round(v3, read64(p + 16));
+            v4 = round(v4, read64(p + 24));
+        }
+        hash = std::rotl(v1, 1) + std::rotl(v2, 7) + std::rotl(v3, 12) + std::rotl(v4, 18);
+        hash = merge(hash, v1);
+        hash = merge(hash, v2);
+        hash = merge(hash, v3);
+        hash = merge(hash, v4);
+    }
+    else {
+        hash = seed + prime5;
+    }
+    hash += data.size();
+    for (; p + 8 <= end; p += 8) {
+        hash = std::rotl(hash ^ round(0, read64(p)), 27) * prime1 + prime4;
+    }
+    if (p + 4 <= end) {
+        hash = std::rotl(hash ^ read32(p) * prime1, 23) * prime2 + prime3;
+        p += 4;
+    }
+    for (; p < end; p++) {
+        hash = std::rotl(hash ^ static_cast<unsigned char>(*p) * prime5, 11) * prime1;
+    }
+    hash ^= hash >> 33;
+    hash *= prime2;
+    hash ^= hash >> 29;
+    hash *= prime3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// On-disk cache of parsed programs, so an unchanged source skips lexing and
+// parsing. Entries are keyed by a hash of the source bytes and of the
+// compiler build, since node layouts and parser behaviour can change with
+// either.
+//
+// An entry is a header followed by the symbol table and the NodeProg pools,
+// each an 8-byte aligned array of fixed-width records: a node's fields,
+// packed. The AST refers to nodes by index only, so loading is a mapping
+// plus a copy of each node, with nothing to fix up. Symbols are stored as spans of the source, which has to
+// be mapped anyway to hash it.
+//
+// The header holds an XXH64 of the whole entry, and a loaded program is
+// checked to be one the parser could have built: every index in range and
+// every reference to a node created before it. A damaged or forged entry is
+// then a miss, never an AST the later passes could index out of bounds or
+// loop on.
+class AstCache final {
+public:
+    // Bump when the entry layout or the meaning of any node field changes
+    static constexpr std::uint32_t format_version = 3;
+
+    AstCache(std::filesystem::path dir, const std::string_view src)
+        : m_dir(std::move(dir)), m_src(src), m_source_hash(xxh64(src)) {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%016llx.ast", static_cast<unsigned long long>(xxh64({ reinterpret_cast<const char*>(&m_source_hash), sizeof(m_source_hash) }, compiler_key())));
+        m_path = m_dir / name;
+    }
+
+    // Interns the cached program's symbols into symbols, which must be empty,
+    // and returns its AST. Returns nothing on a miss or a damaged entry.
+    [[nodiscard]] std::optional<NodeProg> load(Interner& symbols, std::pmr::memory_resource* resource) const {
+        const std::optional<MappedFile> file = MappedFile::open(m_path.string());
+        if (!file.has_value()) {
+            return {};
+        }
+        const std::string_view bytes = file->view();
+        Header header;
+        if (bytes.size() < sizeof(header)) {
+            return {};
+        }
+        std::memcpy(&header, bytes.data(), sizeof(header));
+        if (std::memcmp(header.magic, magic, sizeof(magic)) != 0 || header.compiler != compiler_key()
+            || header.source_hash != m_source_hash || header.source_size != m_src.size() || bytes.size() != entry_size(header)
+            || entry_hash(header, bytes.substr(sizeof(header))) != header.entry_hash) {
+            return {};
+        }
+
+        Reader reader { .data = bytes.data() + sizeof(header) };
+        for (std::uint32_t i = 0; i < header.counts[0]; i++) {
+            SymbolSpan span;
+            reader.read(&span, 1);
+            if (span.offset > m_src.size() || span.size > m_src.size() - span.offset) {
+                return {};
+            }
+            // A repeated name would shift the ids of the ones after it
+            if (symbols.intern(m_src.substr(span.offset, span.size)) != i) {
+                return {};
+            }
+        }
+        reader.align();
+
+        NodeProg prog(resource);
+        size_t pool = 1;
+        for_each_pool(prog, [&](auto& vec) {
+            vec.resize(header.counts[pool++]);
+            for (auto& node : vec) {
+                fields(node, reader);
+            }
+            reader.align();
+        });
+        prog.body = header.body;
+        if (!well_formed(prog, symbols.size())) {
+            return {};
+        }
+        return prog;
+    }
+
+    // Writes the entry for prog. Best effort: a cache that can't be written
+    // only costs the next run a parse. The entry is renamed into place so
+    // that concurrent compiles never see half of one.
+    void store(const NodeProg& prog, const Interner& symbols) const {
+        Header header;
+        std::memset(&header, 0, sizeof(header)); // padding too; the nodes are written without theirs
+        std::memcpy(header.magic, magic, sizeof(magic));
+        header.compiler = compiler_key();
+        header.source_hash = m_source_hash;
+        header.source_size = m_src.size();
+        header.counts[0] = static_cast<std::uint32_t>(symbols.size());
+        header.body = prog.body;
+        size_t pool = 1;
+        for_each_pool(prog, [&](const auto& vec) {
+            header.counts[pool++] = static_cast<std::uint32_t>(vec.size());
+        });
+
+        Writer writer;
+        for (Symbol symbol = 0; symbol < symbols.size(); symbol++) {
+            const std::string_view name = symbols.name(symbol);
+            const SymbolSpan span {
+                .offset = static_cast<std::uint32_t>(name.data() - m_src.data()),
+                .size = static_cast<std::uint32_t>(name.size()),
+            };
+            writer.write(&span, 1);
+        }
+        writer.align();
+        for_each_pool(prog, [&](const auto& vec) {
+            for (const auto& node : vec) {
+                fields(node, writer);
+            }
+            writer.align();
+        });
+        header.entry_hash = entry_hash(header, writer.payload);
+
+        std::error_code ec;
+        std::filesystem::create_directories(m_dir, ec);
+        const std::filesystem::path tmp_path = m_path.string() + ".tmp" + std::to_string(getpid());
+        {
+            std::ofstream file(tmp_path, std::ios::binary | std::ios::trunc);
+            if (!file) {
+                return;
+            }
+            file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+            file.write(writer.payload.data(), static_cast<std::streamsize>(writer.payload.size()));
+            if (!file) {
+                file.close();
+                std::filesystem::remove(tmp_path, ec);
+                return;
+            }
+        }
+        std::filesystem::rename(tmp_path, m_path, ec);
+        if (ec) {
+            std::filesystem::remove(tmp_path, ec);
+        }
+    }
+
+private:
+    static constexpr char magic[8] = { 'L', 'I', 'T', 'H', 'A', 'S', 'T', '\0' };
+    static constexpr size_t pool_count = 9; // symbols, then the NodeProg pools in for_each_pool order
+
+    struct Header {
+        char magic[8];
+        std::uint64_t compiler;
+        std::uint64_t source_hash;
+        std::uint64_t source_size;
+        std::uint64_t entry_hash; // see entry_hash()
+        std::uint32_t counts[pool_count];
+        NodeScope body;
+    };
+
+    struct SymbolSpan {
+        std::uint32_t offset;
+        std::uint32_t size;
+    };
+
+    struct Reader {
+        const char* data;
+        size_t pos = 0;
+
+        template <typename T>
+        void read(T* out, const size_t count) {
+            std::memcpy(static_cast<void*>(out), data + pos, sizeof(T) * count);
+            pos += sizeof(T) * count;
+        }
+
+        template <typename T>
+        void field(T& value) {
+            read(&value, 1);
+        }
+
+        void field(std::optional<NodeIndex>& value) {
+            std::uint8_t engaged = 0;
+            NodeIndex index = 0;
+            field(engaged);
+            field(index);
+            value = engaged != 0 ? std::optional(index) : std::nullopt;
+        }
+
+        void align() {
+            pos = aligned(pos);
+        }
+    };
+
+    // Builds the entry after the header, which needs its hash
+    struct Writer {
+        std::string payload;
+
+        template <typename T>
+        void write(const T* values, const size_t count) {
+            payload.append(reinterpret_cast<const char*>(values), sizeof(T) * count);
+        }
+
+        template <typename T>
+        void field(const T& value) {
+            write(&value, 1);
+        }
+
+        void field(const std::optional<NodeIndex>& value) {
+            field(static_cast<std::uint8_t>(value.has_value()));
+            field(value.value_or(0));
+        }
+
+        void align() {
+            payload.resize(aligned(payload.size()), '\0');
+        }
+    };
+
+    static constexpr size_t aligned(const size_t pos) {
+        return (pos + 7) & ~size_t { 7 };
+    }
+
+    // Counts the bytes fields() stores for a node
+    struct Sizer {
+        size_t size = 0;
+
+        template <typename T>
+        void field(const T&) {
+            size += sizeof(T);
+        }
+
+        void field(const std::optional<NodeIndex>&) {
+            size += sizeof(std::uint8_t) + sizeof(NodeIndex);
+        }
+    };
+
+    // The stored fields of each node, in order. Nodes are stored as these
+    // rather than as their bytes, so no padding, or the unused value of an
+    // empty optional, carries whatever the arena held into an entry.
+    template <typename Node, typename Io>
+    static void fields(Node& node, Io& io) {
+        using T = std::remove_const_t<Node>;
+        if constexpr (std::is_same_v<T, NodeExpr>) {
+            io.field(node.kind);
+            io.field(node.op);
+            io.field(node.lhs);
+            io.field(node.rhs);
+        }
+        else if constexpr (std::is_same_v<T, NodeStmtExit>) {
+            io.field(node.expr);
+        }
+        else if constexpr (std::is_same_v<T, NodeStmtLet>) {
+            io.field(node.ident);
+            io.field(node.expr);
+        }
+        else if constexpr (std::is_same_v<T, NodeStmtSet>) {
+            io.field(node.op);
+            io.field(node.ident);
+            io.field(node.expr);
+        }
+        else if constexpr (std::is_same_v<T, NodeScope>) {
+            io.field(node.first);
+            io.field(node.count);
+        }
+        else if constexpr (std::is_same_v<T, NodeStmtIf>) {
+            io.field(node.expr);
+            io.field(node.scope);
+            io.field(node.pred);
+        }
+        else if constexpr (std::is_same_v<T, NodeIfPred>) {
+            io.field(node.kind);
+            io.field(node.expr);
+            io.field(node.scope);
+            io.field(node.pred);
+        }
+        else {
+            static_assert(std::is_same_v<T, NodeStmt>);
+            io.field(node.kind);
+            io.field(node.index);
+        }
+    }
+
+    template <typename Prog, typename F>
+    static void for_each_pool(Prog& prog, F&& f) {
+        f(prog.exprs);
+        f(prog.exits);
+        f(prog.lets);
+        f(prog.sets);
+        f(prog.scopes);
+        f(prog.ifs);
+        f(prog.preds);
+        f(prog.stmts);
+    }
+
+    static size_t entry_size(const Header& header) {
+        NodeProg prog;
+        size_t size = sizeof(Header) + aligned(sizeof(SymbolSpan) * header.counts[0]);
+        size_t pool = 1;
+        for_each_pool(prog, [&](const auto& vec) {
+            const typename std::remove_cvref_t<decltype(vec)>::value_type node {};
+            Sizer sizer;
+            fields(node, sizer);
+            size += aligned(sizer.size * header.counts[pool++]);
+        });
+        return size;
+    }
+
+    // XXH64 of the payload, seeded with that of the header with this field
+    // zeroed, so a change anywhere in the entry shows
+    static std::uint64_t entry_hash(const Header& header, const std::string_view payload) {
+        char bytes[sizeof(Header)];
+        std::memcpy(bytes, &header, sizeof(header));
+        std::memset(bytes + offsetof(Header, entry_hash), 0, sizeof(header.entry_hash));
+        return xxh64(payload, xxh64({ bytes, sizeof(bytes) }));
+    }
+
+    // Whether prog could have come from the parser: node kinds and operators
+    // are enumerators, indices are in range, and expressions, scopes and
+    // else-if chains only refer to nodes created before them, which is what
+    // keeps the passes over the AST from looping
+    static bool well_formed(const NodeProg& prog, const size_t symbol_count) {
+        const auto in = [](const auto& pool, const std::uint64_t index) {
+            return index < pool.size();
+        };
+        const auto range = [&](const NodeScope& scope) {
+            return std::uint64_t { scope.first } + scope.count <= prog.stmts.size();
+        };
+
+        for (size_t i = 0; i < prog.exprs.size(); i++) {
+            const NodeExpr& expr = prog.exprs[i];
+            switch (expr.kind) {
+                case ExprKind::int_lit:
+                    break;
+                case ExprKind::ident:
+                    if (expr.ident() >= symbol_count) {
+                        return false;
+                    }
+                    break;
+                case ExprKind::bin:
+                    if (expr.op > BinOp::div || expr.lhs >= i || expr.rhs >= i) {
+                        return false;
+                    }
+                    break;
+                default:
+                    return false;
+            }
+        }
+        for (const NodeStmtExit& stmt : prog.exits) {
+            if (!in(prog.exprs, stmt.expr)) {
+                return false;
+            }
+        }
+        for (const NodeStmtLet& stmt : prog.lets) {
+            if (stmt.ident >= symbol_count || !in(prog.exprs, stmt.expr)) {
+                return false;
+            }
+        }
+        for (const NodeStmtSet& stmt : prog.sets) {
+            if (stmt.op > SetOp::div || stmt.ident >= symbol_count || !in(prog.exprs, stmt.expr)) {
+                return false;
+            }
+        }
+        for (const NodeStmtIf& stmt : prog.ifs) {
+            if (!in(prog.exprs, stmt.expr) || !in(prog.scopes, stmt.scope) || (stmt.pred.has_value() && !in(prog.preds, stmt.pred.value()))) {
+                return false;
+            }
+        }
+        for (size_t i = 0; i < prog.preds.size(); i++) {
+            const NodeIfPred& pred = prog.preds[i];
+            if (pred.kind > IfPredKind::else_ || (pred.kind == IfPredKind::elif && !in(prog.exprs, pred.expr)) || !in(prog.scopes, pred.scope)
+                || (pred.pred.has_value() && (pred.pred.value() <= i || !in(prog.preds, pred.pred.value())))) {
+                return false;
+            }
+        }
+        for (const NodeStmt& stmt : prog.stmts) {
+            switch (stmt.kind) {
+                case StmtKind::exit:
+                    if (!in(prog.exits, stmt.index)) {
+                        return false;
+                    }
+                    break;
+                case StmtKind::let:
+                    if (!in(prog.lets, stmt.index)) {
+                        return false;
+                    }
+                    break;
+                case StmtKind::set:
+                    if (!in(prog.sets, stmt.index)) {
+                        return false;
+                    }
+                    break;
+                case StmtKind::scope:
+                    if (!in(prog.scopes, stmt.index)) {
+                        return false;
+                    }
+                    break;
+                case StmtKind::if_:
+                    if (!in(prog.ifs, stmt.index)) {
+                        return false;
+                    }
+                    break;
+                default:
+                    return false;
+            }
+        }
+        if (!range(prog.body)) {
+            return false;
+        }
+
+        // A scope closes after every scope inside it, so the scopes its
+        // statements open, directly or as the arms of an if, come before it
+        for (size_t i = 0; i < prog.scopes.size(); i++) {
+            const NodeScope& scope = prog.scopes[i];
+            if (!range(scope)) {
+                return false;
+            }
+            for (std::uint32_t s = scope.first; s < scope.first + scope.count; s++) {
+                const NodeStmt& stmt = prog.stmts[s];
+                if (stmt.kind == StmtKind::scope && stmt.index >= i) {
+                    return false;
+                }
+                if (stmt.kind != StmtKind::if_) {
+                    continue;
+                }
+                const NodeStmtIf& stmt_if = prog.ifs[stmt.index];
+                if (stmt_if.scope >= i) {
+                    return false;
+                }
+                for (std::optional<NodeIndex> pred = stmt_if.pred; pred.has_value(); pred = prog.preds[pred.value()].pred) {
+                    if (prog.preds[pred.value()].scope >= i) {
+                        return false;
+                    }
+                }
+            }
+        }
+        return true;
+    }
+
+    // Identifies this build of the compiler. Any rebuild invalidates old
+    // entries, which is coarse but never serves an AST from different code.
+    static std::uint64_t compiler_key() {
+        static constexpr std::string_view build = __VERSION__ " " __DATE__ " " __TIME__;
+        return xxh64(build, format_version);
+    }
+
+    std::filesystem::path m_dir;
+    std::filesystem::path m_path;
+    std::string_view m_src;
+    std::uint64_t m_source_hash;
+};
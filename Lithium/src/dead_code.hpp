@@ -0,0 +1,315 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <memory_resource>
+#include <ostream>
+#include <string_view>
+
+#include "ir.hpp"
+
+// Removes code from the IR that can't affect the exit code: branches on a
+// constant become jumps, blocks no path from the entry reaches are dropped
+// (code after an exit, arms of such branches), and so are values nothing
+// reads (a let that is never used). A division stays unless its divisor is
+// a nonzero constant, since it may trap.
+//
+// Every value refers only to lower ids and every edge goes to a later block,
+// so reachability is one pass forward over the blocks and liveness one pass
+// backward over the values. The result is a new program with the survivors
+// renumbered in the same order. Phis lose the arguments of removed edges,
+// and a phi left with a single distinct argument is replaced by it.
+//
+// A block left with nothing but a jump is merged into its target: its
+// predecessors jump, or branch, straight to where it went, so chains of
+// them (the joins of nested ifs whose arms computed nothing) are never
+// emitted. Into a block with phis that's only done for a block reached
+// from a single block ending in a jump, which then carries the phi
+// arguments, so no branch gets a target with phis.
+class DeadCodeEliminator {
+public:
+    enum class Stat : std::uint8_t {
+        branches, // branches on a constant turned into jumps
+        blocks, // unreachable blocks
+        block_values, // values in them, constants aside
+        values, // unused values in reachable blocks, constants aside
+        phis, // phis replaced by their one argument
+        jumps // blocks with only a jump, merged into their target
+    };
+
+    static constexpr size_t stat_count = 6;
+
+    // The new program is allocated from resource
+    explicit DeadCodeEliminator(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : m_resource(resource), m_terms(resource), m_reachable(resource), m_live(resource), m_folded(resource),
+          m_single_pred(resource), m_final(resource), m_block_map(resource), m_value_map(resource), m_pred_stamp(resource),
+          m_stack(resource), m_args(resource) {
+    }
+
+    [[nodiscard]] IrProg run(const IrProg& ir) {
+        find_reachable(ir);
+        find_live(ir);
+        find_jump_only(ir);
+        return rebuild(ir);
+    }
+
+    [[nodiscard]] size_t removed(const Stat stat) const {
+        return m_counts[static_cast<size_t>(stat)];
+    }
+
+    void report(std::ostream& out) const {
+        static constexpr std::array<std::string_view, stat_count> names {
+            "constant branches", "unreachable blocks", "values in unreachable blocks", "unused values", "single-value phis", "jump-only blocks",
+        };
+        out << "dead code:\n";
+        for (size_t i = 0; i < stat_count; i++) {
+            out << "  " << names[i] << ": " << m_counts[i] << "\n";
+        }
+    }
+
+private:
+    void find_reachable(const IrProg& ir) {
+        m_terms.clear();
+        m_reachable.assign(ir.blocks.size(), false);
+        m_reachable[0] = true;
+        for (BlockId b = 0; b < ir.blocks.size(); b++) {
+            IrTerm term = ir.blocks[b].term;
+            if (!m_reachable[b]) {
+                m_terms.push_back(term);
+                count(Stat::blocks, 1);
+                const IrBlock& block = ir.blocks[b];
+                count(Stat::block_values, static_cast<size_t>(std::count_if(ir.values.begin() + block.first, ir.values.begin() + block.end(), [](const IrValue& value) {
+                    return value.op != IrOp::const_;
+                })));
+                continue;
+            }
+            if (term.kind == TermKind::branch && ir.values[term.value].op == IrOp::const_) {
+                term = { .kind = TermKind::jump, .value = 0, .target = ir.values[term.value].constant() != 0 ? term.target : term.alt, .alt = 0 };
+                count(Stat::branches, 1);
+            }
+            if (term.kind != TermKind::exit) {
+                m_reachable[term.target] = true;
+            }
+            if (term.kind == TermKind::branch) {
+                m_reachable[term.alt] = true;
+            }
+            m_terms.push_back(term);
+        }
+    }
+
+    // Whether control still flows from pred to block
+    [[nodiscard]] bool has_edge(const BlockId pred, const BlockId block) const {
+        const IrTerm& term = m_terms[pred];
+        return m_reachable[pred] && term.kind != TermKind::exit && (term.target == block || (term.kind == TermKind::branch && term.alt == block));
+    }
+
+    [[nodiscard]] static bool may_trap(const IrProg& ir, const IrValue& value) {
+        if (value.op != IrOp::div) {
+            return false;
+        }
+        const IrValue& divisor = ir.values[value.b];
+        return divisor.op != IrOp::const_ || divisor.constant() == 0;
+    }
+
+    void find_live(const IrProg& ir) {
+        m_live.assign(ir.values.size(), false);
+        for (BlockId b = static_cast<BlockId>(ir.blocks.size()); b-- > 0;) {
+            if (!m_reachable[b]) {
+                continue;
+            }
+            const IrBlock& block = ir.blocks[b];
+            if (m_terms[b].kind != TermKind::jump) {
+                m_live[m_terms[b].value] = true;
+            }
+            for (ValueId v = block.end(); v-- > block.first;) {
+                const IrValue& value = ir.values[v];
+                if (!m_live[v] && !may_trap(ir, value)) {
+                    if (value.op != IrOp::const_) {
+                        count(Stat::values, 1);
+                    }
+                    continue;
+                }
+                m_live[v] = true;
+                if (value.is_bin()) {
+                    m_live[value.a] = true;
+                    m_live[value.b] = true;
+                }
+                else if (value.op == IrOp::phi) {
+                    for (std::uint32_t i = 0; i < block.pred_count; i++) {
+                        if (has_edge(ir.preds[block.first_pred + i], b)) {
+                            m_live[ir.phi_args[value.a + i]] = true;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    [[nodiscard]] bool has_live_phis(const IrProg& ir, const BlockId b) const {
+        const IrBlock& block = ir.blocks[b];
+        for (ValueId v = block.first; v < block.end() && ir.values[v].op == IrOp::phi; v++) {
+            if (m_live[v]) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // Picks the blocks to merge into their targets, in block order so that a
+    // block's predecessors are decided first, then where each one's jumps
+    // end up, backward so that its target's is known
+    void find_jump_only(const IrProg& ir) {
+        m_folded.assign(ir.blocks.size(), false);
+        m_single_pred.assign(ir.blocks.size(), no_block);
+        for (BlockId b = 1; b < ir.blocks.size(); b++) {
+            if (!m_reachable[b]) {
+                continue;
+            }
+            const IrBlock& block = ir.blocks[b];
+            std::uint32_t edges = 0;
+            BlockId single = no_block;
+            for (std::uint32_t i = 0; i < block.pred_count; i++) {
+                const BlockId pred = ir.preds[block.first_pred + i];
+                if (has_edge(pred, b)) {
+                    edges++;
+                    single = m_folded[pred] ? m_single_pred[pred] : pred;
+                }
+            }
+            m_single_pred[b] = edges == 1 ? single : no_block;
+
+            const IrTerm& term = m_terms[b];
+            if (term.kind != TermKind::jump || std::any_of(m_live.begin() + block.first, m_live.begin() + block.end(), [](const bool live) { return live; })) {
+                continue;
+            }
+            if (has_live_phis(ir, term.target) && (m_single_pred[b] == no_block || m_terms[m_single_pred[b]].kind != TermKind::jump)) {
+                continue;
+            }
+            m_folded[b] = true;
+            count(Stat::jumps, 1);
+        }
+        m_final.resize(ir.blocks.size());
+        for (BlockId b = static_cast<BlockId>(ir.blocks.size()); b-- > 0;) {
+            m_final[b] = m_folded[b] ? m_final[m_terms[b].target] : b;
+        }
+    }
+
+    IrProg rebuild(const IrProg& ir) {
+        IrProg out(m_resource);
+        m_block_map.assign(ir.blocks.size(), 0);
+        BlockId next = 0;
+        for (BlockId b = 0; b < ir.blocks.size(); b++) {
+            if (m_reachable[b] && !m_folded[b]) {
+                m_block_map[b] = next++;
+            }
+        }
+        m_value_map.assign(ir.values.size(), 0);
+        m_pred_stamp.assign(ir.blocks.size(), no_block);
+
+        for (BlockId b = 0; b < ir.blocks.size(); b++) {
+            if (!m_reachable[b] || m_folded[b]) {
+                continue;
+            }
+            const IrBlock& block = ir.blocks[b];
+            IrBlock& copy = out.blocks.emplace_back(IrBlock {
+                .first = static_cast<std::uint32_t>(out.values.size()),
+                .count = 0,
+                .first_pred = static_cast<std::uint32_t>(out.preds.size()),
+                .pred_count = 0,
+                .term = {},
+            });
+            // A merged predecessor stands for its own, and a branch whose
+            // arms both ended up here counts once. Into a block with phis
+            // each edge still brings exactly one, in the same order.
+            for (std::uint32_t i = 0; i < block.pred_count; i++) {
+                const BlockId first = ir.preds[block.first_pred + i];
+                if (!has_edge(first, b)) {
+                    continue;
+                }
+                m_stack.push_back(first);
+                while (!m_stack.empty()) {
+                    const BlockId pred = m_stack.back();
+                    m_stack.pop_back();
+                    if (m_folded[pred]) {
+                        const IrBlock& folded = ir.blocks[pred];
+                        for (std::uint32_t j = folded.pred_count; j-- > 0;) {
+                            if (has_edge(ir.preds[folded.first_pred + j], pred)) {
+                                m_stack.push_back(ir.preds[folded.first_pred + j]);
+                            }
+                        }
+                    }
+                    else if (m_pred_stamp[pred] != b) {
+                        m_pred_stamp[pred] = b;
+                        out.preds.push_back(m_block_map[pred]);
+                        copy.pred_count++;
+                    }
+                }
+            }
+
+            for (ValueId v = block.first; v < block.end(); v++) {
+                if (!m_live[v]) {
+                    continue;
+                }
+                IrValue value = ir.values[v];
+                if (value.op == IrOp::phi) {
+                    m_args.clear();
+                    for (std::uint32_t i = 0; i < block.pred_count; i++) {
+                        if (has_edge(ir.preds[block.first_pred + i], b)) {
+                            m_args.push_back(m_value_map[ir.phi_args[value.a + i]]);
+                        }
+                    }
+                    if (std::all_of(m_args.begin(), m_args.end(), [&](const ValueId arg) { return arg == m_args[0]; })) {
+                        m_value_map[v] = m_args[0];
+                        count(Stat::phis, 1);
+                        continue;
+                    }
+                    value.a = static_cast<std::uint32_t>(out.phi_args.size());
+                    out.phi_args.insert(out.phi_args.end(), m_args.begin(), m_args.end());
+                }
+                else if (value.is_bin()) {
+                    value.a = m_value_map[value.a];
+                    value.b = m_value_map[value.b];
+                }
+                m_value_map[v] = static_cast<ValueId>(out.values.size());
+                out.values.push_back(value);
+                copy.count++;
+            }
+
+            IrTerm term = m_terms[b];
+            if (term.kind != TermKind::jump) {
+                term.value = m_value_map[term.value];
+            }
+            if (term.kind != TermKind::exit) {
+                term.target = m_block_map[m_final[term.target]];
+            }
+            if (term.kind == TermKind::branch) {
+                term.alt = m_block_map[m_final[term.alt]];
+                if (term.alt == term.target) {
+                    term = { .kind = TermKind::jump, .value = 0, .target = term.target, .alt = 0 };
+                }
+            }
+            copy.term = term;
+        }
+        return out;
+    }
+
+    static constexpr BlockId no_block = UINT32_MAX;
+
+    void count(const Stat stat, const size_t n) {
+        m_counts[static_cast<size_t>(stat)] += n;
+    }
+
+    std::pmr::memory_resource* m_resource;
+    std::pmr::vector<IrTerm> m_terms; // by block, with constant branches folded where reachable
+    std::pmr::vector<bool> m_reachable; // by block
+    std::pmr::vector<bool> m_live; // by value
+    std::pmr::vector<bool> m_folded; // by block: merged into its target
+    std::pmr::vector<BlockId> m_single_pred; // by block: the one unmerged block reaching it, if just one does
+    std::pmr::vector<BlockId> m_final; // by block: where a jump to it ends up
+    std::pmr::vector<BlockId> m_block_map; // old block to new
+    std::pmr::vector<ValueId> m_value_map; // old value to new
+    std::pmr::vector<BlockId> m_pred_stamp; // by block: the block whose predecessors last listed it
+    std::pmr::vector<BlockId> m_stack;
+    std::pmr::vector<ValueId> m_args;
+    std::array<size_t, stat_count> m_counts {};
+};
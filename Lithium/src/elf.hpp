@@ -0,0 +1,55 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory_resource>
+#include <string_view>
+#include <vector>
+
+#include "output_buffer.hpp"
+
+// Writes a minimal static ELF64 executable for x86-64 Linux: the ELF header,
+// one program header that maps the whole file readable and executable, and
+// the code right after them, where execution starts. There are no sections
+// or symbols; the kernel's loader is all that reads it.
+inline void write_elf(OutputBuffer& out, const std::pmr::vector<std::uint8_t>& code) {
+    static constexpr std::uint64_t base = 0x400000;
+    static constexpr size_t ehdr_size = 64;
+    static constexpr size_t phdr_size = 56;
+    static constexpr size_t headers_size = ehdr_size + phdr_size;
+
+    std::array<std::uint8_t, headers_size> headers {};
+    const auto put = [&headers](const size_t offset, const std::uint64_t value, const size_t bytes) {
+        for (size_t i = 0; i < bytes; i++) {
+            headers[offset + i] = static_cast<std::uint8_t>(value >> (8 * i));
+        }
+    };
+    const std::uint64_t file_size = headers_size + code.size();
+
+    // ELF header
+    put(0, 0x464C457F, 4); // \x7fELF
+    put(4, 2, 1); // 64-bit
+    put(5, 1, 1); // little endian
+    put(6, 1, 1); // version
+    put(16, 2, 2); // ET_EXEC
+    put(18, 62, 2); // EM_X86_64
+    put(20, 1, 4); // version
+    put(24, base + headers_size, 8); // entry
+    put(32, ehdr_size, 8); // program headers
+    put(52, ehdr_size, 2);
+    put(54, phdr_size, 2);
+    put(56, 1, 2); // one program header
+
+    // Program header
+    put(ehdr_size + 0, 1, 4); // PT_LOAD
+    put(ehdr_size + 4, 5, 4); // PF_R | PF_X
+    put(ehdr_size + 8, 0, 8); // from the start of the file
+    put(ehdr_size + 16, base, 8); // vaddr
+    put(ehdr_size + 24, base, 8); // paddr
+    put(ehdr_size + 32, file_size, 8);
+    put(ehdr_size + 40, file_size, 8);
+    put(ehdr_size + 48, 0x1000, 8); // page aligned
+
+    out.append(std::string_view(reinterpret_cast<const char*>(headers.data()), headers.size()));
+    out.append(std::string_view(reinterpret_cast<const char*>(code.data()), code.size()));
+}
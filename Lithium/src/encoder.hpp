@@ -0,0 +1,328 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <initializer_list>
+#include <memory_resource>
+#include <vector>
+
+#include "instruction.hpp"
+
+// Encodes the generator's instructions as x86-64 machine code, so the linux
+// backend can write an executable without an assembler or a linker.
+//
+// Everything but the jumps is encoded in one pass into m_body. Jumps are
+// then laid out by branch relaxation: each starts as a rel8 and the ones
+// whose label is out of its reach are widened to rel32 until all of them
+// fit. Widening a jump only moves labels further apart, so this ends, in
+// a few rounds at most. The code is assembled from m_body and the jumps.
+class Encoder {
+public:
+    explicit Encoder(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : m_body(resource), m_spans(resource), m_wide(resource), m_offsets(resource), m_label_pos(resource), m_code(resource) {
+    }
+
+    // Machine code for code, whose first instruction is at offset 0. It
+    // contains no absolute addresses, so it runs wherever it is loaded.
+    [[nodiscard]] const std::pmr::vector<std::uint8_t>& encode(const std::pmr::vector<Instr>& code) {
+        m_body.clear();
+        m_spans.clear();
+        for (const Instr& instr : code) {
+            const auto start = static_cast<std::uint32_t>(m_body.size());
+            if (!instr.is_jump()) {
+                encode_instr(instr);
+            }
+            m_spans.push_back({ .start = start, .size = static_cast<std::uint32_t>(m_body.size() - start) });
+        }
+
+        m_wide.assign(code.size(), false);
+        while (widen(code)) {
+        }
+
+        m_code.clear();
+        for (size_t i = 0; i < code.size(); i++) {
+            const Instr& instr = code[i];
+            if (instr.is_jump()) {
+                encode_jump(instr, i);
+            }
+            else {
+                const Span span = m_spans[i];
+                m_code.insert(m_code.end(), m_body.begin() + span.start, m_body.begin() + span.start + span.size);
+            }
+        }
+        return m_code;
+    }
+
+private:
+    struct Span {
+        std::uint32_t start; // in m_body
+        std::uint32_t size;
+    };
+
+    // Lays the code out with the current jump widths and widens the jumps
+    // that can't reach their label. Returns whether any was widened.
+    bool widen(const std::pmr::vector<Instr>& code) {
+        m_offsets.clear();
+        m_label_pos.clear();
+        std::int64_t offset = 0;
+        for (size_t i = 0; i < code.size(); i++) {
+            m_offsets.push_back(offset);
+            if (code[i].op == Opcode::label) {
+                const auto label = static_cast<size_t>(code[i].dst.value);
+                if (label >= m_label_pos.size()) {
+                    m_label_pos.resize(label + 1, 0);
+                }
+                m_label_pos[label] = offset;
+            }
+            offset += code[i].is_jump() ? jump_size(code[i], m_wide[i]) : m_spans[i].size;
+        }
+
+        bool widened = false;
+        for (size_t i = 0; i < code.size(); i++) {
+            if (code[i].is_jump() && !m_wide[i] && !is_int8(displacement(code[i], i))) {
+                m_wide[i] = true;
+                widened = true;
+            }
+        }
+        return widened;
+    }
+
+    [[nodiscard]] static std::int64_t jump_size(const Instr& jump, const bool wide) {
+        if (!wide) {
+            return 2;
+        }
+        return jump.op == Opcode::jmp ? 5 : 6;
+    }
+
+    // From the end of the jump at index to its label
+    [[nodiscard]] std::int64_t displacement(const Instr& jump, const size_t index) const {
+        return m_label_pos[static_cast<size_t>(jump.dst.value)] - (m_offsets[index] + jump_size(jump, m_wide[index]));
+    }
+
+    void encode_jump(const Instr& jump, const size_t index) {
+        const std::int64_t disp = displacement(jump, index);
+        if (!m_wide[index]) {
+            m_code.push_back(jump.op == Opcode::jmp ? 0xEB : 0x74);
+            m_code.push_back(static_cast<std::uint8_t>(disp));
+            return;
+        }
+        if (jump.op == Opcode::jmp) {
+            m_code.push_back(0xE9);
+        }
+        else {
+            m_code.push_back(0x0F);
+            m_code.push_back(0x84);
+        }
+        for (int i = 0; i < 4; i++) {
+            m_code.push_back(static_cast<std::uint8_t>(static_cast<std::uint64_t>(disp) >> (8 * i)));
+        }
+    }
+
+    void encode_instr(const Instr& instr) {
+        const Operand& dst = instr.dst;
+        const Operand& src = instr.src;
+        switch (instr.op) {
+            case Opcode::mov:
+                if (src.kind == Operand::Kind::imm) {
+                    mov_imm(dst, src.value);
+                }
+                else if (src.kind == Operand::Kind::reg) {
+                    op_rm({ 0x89 }, src.reg, dst);
+                }
+                else {
+                    op_rm({ 0x8B }, dst.reg, src);
+                }
+                break;
+            case Opcode::add:
+                arith(0x01, 0x03, 0, dst, src);
+                break;
+            case Opcode::sub:
+                arith(0x29, 0x2B, 5, dst, src);
+                break;
+            case Opcode::imul:
+                if (src.kind == Operand::Kind::imm) {
+                    op_rm({ is_int8(src.value) ? std::uint8_t { 0x6B } : std::uint8_t { 0x69 } }, dst.reg, dst);
+                    imm(src.value, is_int8(src.value) ? 1 : 4);
+                }
+                else {
+                    op_rm({ 0x0F, 0xAF }, dst.reg, src);
+                }
+                break;
+            case Opcode::mul:
+                op_rm({ 0xF7 }, 4, src);
+                break;
+            case Opcode::div:
+                op_rm({ 0xF7 }, 6, src);
+                break;
+            case Opcode::shl:
+                shift(4, dst, src.value);
+                break;
+            case Opcode::shr:
+                shift(5, dst, src.value);
+                break;
+            case Opcode::lea:
+                op_rm({ 0x8D }, dst.reg, src);
+                break;
+            case Opcode::clear:
+                op_rm({ 0x31 }, dst.reg, dst, false);
+                break;
+            case Opcode::test:
+                assert(src.kind == Operand::Kind::reg);
+                op_rm({ 0x85 }, src.reg, dst);
+                break;
+            case Opcode::push:
+                assert(src.kind == Operand::Kind::reg);
+                short_reg(0x50, src.reg);
+                break;
+            case Opcode::pop:
+                assert(dst.kind == Operand::Kind::reg);
+                short_reg(0x58, dst.reg);
+                break;
+            case Opcode::syscall:
+                m_body.push_back(0x0F);
+                m_body.push_back(0x05);
+                break;
+            case Opcode::ret:
+                m_body.push_back(0xC3);
+                break;
+            case Opcode::jmp:
+            case Opcode::jz:
+            case Opcode::label:
+            case Opcode::comment:
+                break;
+        }
+    }
+
+    // add and sub: r/m op= reg, reg op= r/m, or r/m op= imm with the
+    // sign-extended imm8 form when it fits
+    void arith(const std::uint8_t to_rm, const std::uint8_t from_rm, const unsigned ext, const Operand& dst, const Operand& src) {
+        switch (src.kind) {
+            case Operand::Kind::imm:
+                assert(src.is_imm32());
+                op_rm({ is_int8(src.value) ? std::uint8_t { 0x83 } : std::uint8_t { 0x81 } }, ext, dst);
+                imm(src.value, is_int8(src.value) ? 1 : 4);
+                break;
+            case Operand::Kind::reg:
+                op_rm({ to_rm }, src.reg, dst);
+                break;
+            default:
+                op_rm({ from_rm }, dst.reg, src);
+                break;
+        }
+    }
+
+    // Shifts by an immediate, with the form without one for a count of 1
+    void shift(const unsigned ext, const Operand& dst, const std::int64_t count) {
+        if (count == 1) {
+            op_rm({ 0xD1 }, ext, dst);
+            return;
+        }
+        op_rm({ 0xC1 }, ext, dst);
+        imm(count, 1);
+    }
+
+    // The shortest mov of value: a zero-extending 32-bit mov, a
+    // sign-extended imm32 or, into a register only, a full imm64
+    void mov_imm(const Operand& dst, const std::int64_t value) {
+        if (dst.kind == Operand::Kind::reg && value >= 0 && value <= UINT32_MAX) {
+            rex(false, 0, 0, number(dst.reg));
+            m_body.push_back(static_cast<std::uint8_t>(0xB8 + (number(dst.reg) & 7)));
+            imm(value, 4);
+        }
+        else if (value >= INT32_MIN && value <= INT32_MAX) {
+            op_rm({ 0xC7 }, 0, dst);
+            imm(value, 4);
+        }
+        else {
+            assert(dst.kind == Operand::Kind::reg);
+            rex(true, 0, 0, number(dst.reg));
+            m_body.push_back(static_cast<std::uint8_t>(0xB8 + (number(dst.reg) & 7)));
+            imm(value, 8);
+        }
+    }
+
+    // push and pop, which have the register in the opcode
+    void short_reg(const std::uint8_t opcode, const Reg reg) {
+        rex(false, 0, 0, number(reg));
+        m_body.push_back(static_cast<std::uint8_t>(opcode + (number(reg) & 7)));
+    }
+
+    void op_rm(const std::initializer_list<std::uint8_t> opcode, const Reg reg, const Operand& rm, const bool wide = true) {
+        op_rm(opcode, number(reg), rm, wide);
+    }
+
+    // An instruction with a ModRM byte: reg is a register number or an
+    // opcode extension, rm a register, a stack slot or a scaled address
+    void op_rm(const std::initializer_list<std::uint8_t> opcode, const unsigned reg, const Operand& rm, const bool wide = true) {
+        const unsigned base = number(rm.reg);
+        rex(wide, reg, rm.kind == Operand::Kind::scaled ? base : 0, base);
+        m_body.insert(m_body.end(), opcode.begin(), opcode.end());
+        const unsigned reg_bits = (reg & 7) << 3;
+        switch (rm.kind) {
+            case Operand::Kind::reg:
+                m_body.push_back(static_cast<std::uint8_t>(0xC0 | reg_bits | (base & 7)));
+                break;
+            case Operand::Kind::stack: {
+                // rbp and r13 as a base always take a displacement, and rsp and
+                // r12 need a SIB byte
+                const std::int64_t disp = rm.value;
+                const unsigned mod = disp == 0 && (base & 7) != 5 ? 0 : is_int8(disp) ? 1 : 2;
+                m_body.push_back(static_cast<std::uint8_t>(mod << 6 | reg_bits | (base & 7)));
+                if ((base & 7) == 4) {
+                    m_body.push_back(0x24);
+                }
+                if (mod == 1) {
+                    imm(disp, 1);
+                }
+                else if (mod == 2) {
+                    imm(disp, 4);
+                }
+                break;
+            }
+            case Operand::Kind::scaled: {
+                assert(rm.reg != Reg::rsp); // can't be an index
+                const unsigned mod = (base & 7) == 5 ? 1 : 0;
+                const unsigned scale = rm.value == 2 ? 1 : rm.value == 4 ? 2 : 3;
+                m_body.push_back(static_cast<std::uint8_t>(mod << 6 | reg_bits | 4));
+                m_body.push_back(static_cast<std::uint8_t>(scale << 6 | (base & 7) << 3 | (base & 7)));
+                if (mod == 1) {
+                    m_body.push_back(0);
+                }
+                break;
+            }
+            default:
+                assert(false); // Unreachable
+                break;
+        }
+    }
+
+    // The REX prefix, when the operand size or a register needs one
+    void rex(const bool wide, const unsigned reg, const unsigned index, const unsigned base) {
+        const unsigned bits = (wide ? 8 : 0) | (reg >> 3) << 2 | (index >> 3) << 1 | base >> 3;
+        if (bits != 0) {
+            m_body.push_back(static_cast<std::uint8_t>(0x40 | bits));
+        }
+    }
+
+    // value in little endian, truncated to bytes
+    void imm(const std::int64_t value, const int bytes) {
+        for (int i = 0; i < bytes; i++) {
+            m_body.push_back(static_cast<std::uint8_t>(static_cast<std::uint64_t>(value) >> (8 * i)));
+        }
+    }
+
+    [[nodiscard]] static unsigned number(const Reg reg) {
+        return static_cast<unsigned>(reg);
+    }
+
+    [[nodiscard]] static bool is_int8(const std::int64_t value) {
+        return value >= INT8_MIN && value <= INT8_MAX;
+    }
+
+    std::pmr::vector<std::uint8_t> m_body; // everything but the jumps
+    std::pmr::vector<Span> m_spans; // by instruction
+    std::pmr::vector<bool> m_wide; // by instruction: a jump with a rel32
+    std::pmr::vector<std::int64_t> m_offsets; // by instruction
+    std::pmr::vector<std::int64_t> m_label_pos; // by label number
+    std::pmr::vector<std::uint8_t> m_code;
+};
@@ -0,0 +1,302 @@
+#pragma once
+
+#include <cstdint>
+#include <memory_resource>
+#include <utility>
+
+#include "parser.hpp"
+#include "scoped_table.hpp"
+
+// Folds constant subtrees and applies algebraic identities to the AST, in
+// place, between parsing and generation. Arithmetic is unsigned 64-bit with
+// wraparound and div is unsigned, exactly as the generated code computes it.
+//
+// Evaluation traps on a zero divisor and the generator reports undeclared
+// identifiers, so a subtree is only dropped (x*0, x-x) when it can't trap
+// and every identifier in it is declared. Divisions by a literal zero are
+// never folded. Statements are walked in execution order with the
+// generator's scope rules to know what is declared.
+class Folder {
+public:
+    Folder(NodeProg& prog, const size_t symbol_count, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : m_prog(prog), m_in_scope(symbol_count, resource), m_tasks(resource),
+          m_expr_tasks(resource), m_pairs(resource), m_droppable(prog.exprs.size(), false, resource) {
+    }
+
+    void fold_prog() {
+        push_stmts(m_prog.body);
+        while (!m_tasks.empty()) {
+            const Task task = m_tasks.back();
+            m_tasks.pop_back();
+            switch (task.kind) {
+                case TaskKind::stmt: {
+                    const NodeStmt stmt = m_prog.stmts[task.index];
+                    switch (stmt.kind) {
+                        case StmtKind::exit:
+                            fold_expr(m_prog.exits[stmt.index].expr);
+                            break;
+                        case StmtKind::let: {
+                            const NodeStmtLet& stmt_let = m_prog.lets[stmt.index];
+                            fold_expr(stmt_let.expr);
+                            if (!m_in_scope.contains(stmt_let.ident)) {
+                                m_in_scope.declare(stmt_let.ident, true);
+                            }
+                            break;
+                        }
+                        case StmtKind::set:
+                            fold_expr(m_prog.sets[stmt.index].expr);
+                            break;
+                        case StmtKind::scope:
+                            push_scope(stmt.index);
+                            break;
+                        case StmtKind::if_: {
+                            const NodeStmtIf& stmt_if = m_prog.ifs[stmt.index];
+                            fold_expr(stmt_if.expr);
+                            if (stmt_if.pred.has_value()) {
+                                m_tasks.push_back({ .kind = TaskKind::if_pred, .index = stmt_if.pred.value() });
+                            }
+                            push_scope(stmt_if.scope);
+                            break;
+                        }
+                    }
+                    break;
+                }
+                case TaskKind::end_scope:
+                    m_in_scope.end_scope();
+                    break;
+                case TaskKind::if_pred: {
+                    const NodeIfPred& pred = m_prog.preds[task.index];
+                    if (pred.kind == IfPredKind::elif) {
+                        fold_expr(pred.expr);
+                        if (pred.pred.has_value()) {
+                            m_tasks.push_back({ .kind = TaskKind::if_pred, .index = pred.pred.value() });
+                        }
+                    }
+                    push_scope(pred.scope);
+                    break;
+                }
+            }
+        }
+    }
+
+private:
+    enum class TaskKind : std::uint8_t {
+        stmt, // index into NodeProg::stmts
+        end_scope, // index unused
+        if_pred // index of the NodeIfPred
+    };
+
+    struct Task {
+        TaskKind kind;
+        NodeIndex index;
+    };
+
+    struct ExprTask {
+        NodeIndex index;
+        bool operands_done;
+    };
+
+    // Post-order over the tree with an explicit stack, so every bin expr is
+    // simplified after its operands
+    void fold_expr(const NodeIndex root) {
+        m_expr_tasks.push_back({ .index = root, .operands_done = false });
+        while (!m_expr_tasks.empty()) {
+            const ExprTask task = m_expr_tasks.back();
+            m_expr_tasks.pop_back();
+            const NodeExpr& expr = m_prog.exprs[task.index];
+            switch (expr.kind) {
+                case ExprKind::int_lit:
+                    m_droppable[task.index] = true;
+                    break;
+                case ExprKind::ident:
+                    m_droppable[task.index] = m_in_scope.contains(expr.ident());
+                    break;
+                case ExprKind::bin:
+                    if (task.operands_done) {
+                        fold_bin(task.index);
+                    }
+                    else {
+                        m_expr_tasks.push_back({ .index = task.index, .operands_done = true });
+                        m_expr_tasks.push_back({ .index = expr.lhs, .operands_done = false });
+                        m_expr_tasks.push_back({ .index = expr.rhs, .operands_done = false });
+                    }
+                    break;
+            }
+        }
+    }
+
+    // Simplifies the bin expr at index, whose operands are already folded.
+    // A result that is one of its operands is copied over it; nodes only
+    // ever refer to lower indices, which the generator relies on.
+    void fold_bin(const NodeIndex index) {
+        NodeExpr expr = m_prog.exprs[index];
+        const BinOp op = expr.op;
+
+        // Constants go on the right of + and *, where the generator can use
+        // them as immediates
+        if ((op == BinOp::add || op == BinOp::mul) && is_const(expr.lhs) && !is_const(expr.rhs)) {
+            std::swap(expr.lhs, expr.rhs);
+            m_prog.exprs[index] = expr;
+        }
+        const NodeExpr lhs = m_prog.exprs[expr.lhs];
+        const NodeExpr rhs = m_prog.exprs[expr.rhs];
+        const bool droppable = m_droppable[expr.lhs] && m_droppable[expr.rhs] && !(op == BinOp::div && !is_nonzero_const(expr.rhs));
+
+        if (lhs.kind == ExprKind::int_lit && rhs.kind == ExprKind::int_lit) {
+            if (op == BinOp::div && rhs.int_lit() == 0) {
+                m_droppable[index] = false; // left for the program to trap on
+                return;
+            }
+            replace_with_const(index, eval(op, value(lhs), value(rhs)));
+            return;
+        }
+
+        if (rhs.kind == ExprKind::int_lit) {
+            const std::uint64_t c = value(rhs);
+            switch (op) {
+                case BinOp::add:
+                case BinOp::sub:
+                    if (c == 0) {
+                        replace_with_operand(index, expr.lhs);
+                        return;
+                    }
+                    // (x + c1) + c2 and the like become x + (c1 + c2)
+                    if (lhs.kind == ExprKind::bin && (lhs.op == BinOp::add || lhs.op == BinOp::sub) && is_const(lhs.rhs)) {
+                        const std::uint64_t c1 = lhs.op == BinOp::add ? value(m_prog.exprs[lhs.rhs]) : 0 - value(m_prog.exprs[lhs.rhs]);
+                        const std::uint64_t sum = op == BinOp::add ? c1 + c : c1 - c;
+                        reassociate(index, lhs.lhs, BinOp::add, expr.rhs, sum);
+                        return;
+                    }
+                    break;
+                case BinOp::mul:
+                    if (c == 1) {
+                        replace_with_operand(index, expr.lhs);
+                        return;
+                    }
+                    if (c == 0 && m_droppable[expr.lhs]) {
+                        replace_with_const(index, 0);
+                        return;
+                    }
+                    // (x * c1) * c2 becomes x * (c1 * c2)
+                    if (lhs.kind == ExprKind::bin && lhs.op == BinOp::mul && is_const(lhs.rhs)) {
+                        reassociate(index, lhs.lhs, BinOp::mul, expr.rhs, value(m_prog.exprs[lhs.rhs]) * c);
+                        return;
+                    }
+                    break;
+                case BinOp::div:
+                    if (c == 1) {
+                        replace_with_operand(index, expr.lhs);
+                        return;
+                    }
+                    break;
+            }
+        }
+
+        if (op == BinOp::sub && droppable && equal(expr.lhs, expr.rhs)) {
+            replace_with_const(index, 0);
+            return;
+        }
+        m_droppable[index] = droppable;
+    }
+
+    // Turns index into x op c, storing c in the literal node at const_index
+    void reassociate(const NodeIndex index, const NodeIndex x, const BinOp op, const NodeIndex const_index, const std::uint64_t c) {
+        if ((op == BinOp::add && c == 0) || (op == BinOp::mul && c == 1)) {
+            replace_with_operand(index, x);
+            return;
+        }
+        if (op == BinOp::mul && c == 0 && m_droppable[x]) {
+            replace_with_const(index, 0);
+            return;
+        }
+        m_prog.exprs[const_index] = NodeExpr::make_int_lit(c);
+        m_prog.exprs[index] = NodeExpr::make_bin(op, x, const_index);
+        m_droppable[index] = m_droppable[x];
+    }
+
+    void replace_with_const(const NodeIndex index, const std::uint64_t c) {
+        m_prog.exprs[index] = NodeExpr::make_int_lit(c);
+        m_droppable[index] = true;
+    }
+
+    void replace_with_operand(const NodeIndex index, const NodeIndex operand) {
+        m_prog.exprs[index] = m_prog.exprs[operand];
+        m_droppable[index] = m_droppable[operand];
+    }
+
+    [[nodiscard]] static std::uint64_t eval(const BinOp op, const std::uint64_t lhs, const std::uint64_t rhs) {
+        switch (op) {
+            case BinOp::add:
+                return lhs + rhs;
+            case BinOp::sub:
+                return lhs - rhs;
+            case BinOp::mul:
+                return lhs * rhs;
+            case BinOp::div:
+                return lhs / rhs;
+        }
+        return 0;
+    }
+
+    [[nodiscard]] static std::uint64_t value(const NodeExpr& int_lit) {
+        return int_lit.int_lit();
+    }
+
+    [[nodiscard]] bool is_const(const NodeIndex index) const {
+        return m_prog.exprs[index].kind == ExprKind::int_lit;
+    }
+
+    [[nodiscard]] bool is_nonzero_const(const NodeIndex index) const {
+        return is_const(index) && m_prog.exprs[index].int_lit() != 0;
+    }
+
+    // Whether two trees compute the same value, compared node by node
+    [[nodiscard]] bool equal(const NodeIndex a, const NodeIndex b) {
+        m_pairs.clear();
+        m_pairs.emplace_back(a, b);
+        while (!m_pairs.empty()) {
+            const auto [i, j] = m_pairs.back();
+            m_pairs.pop_back();
+            const NodeExpr& x = m_prog.exprs[i];
+            const NodeExpr& y = m_prog.exprs[j];
+            if (x.kind != y.kind) {
+                return false;
+            }
+            switch (x.kind) {
+                case ExprKind::int_lit:
+                case ExprKind::ident:
+                    if (x.lhs != y.lhs || x.rhs != y.rhs) {
+                        return false;
+                    }
+                    break;
+                case ExprKind::bin:
+                    if (x.op != y.op) {
+                        return false;
+                    }
+                    m_pairs.emplace_back(x.lhs, y.lhs);
+                    m_pairs.emplace_back(x.rhs, y.rhs);
+                    break;
+            }
+        }
+        return true;
+    }
+
+    void push_scope(const NodeIndex index) {
+        m_in_scope.begin_scope();
+        m_tasks.push_back({ .kind = TaskKind::end_scope });
+        push_stmts(m_prog.scopes[index]);
+    }
+
+    void push_stmts(const NodeScope& scope) {
+        for (std::uint32_t i = scope.first + scope.count; i-- > scope.first;) {
+            m_tasks.push_back({ .kind = TaskKind::stmt, .index = i });
+        }
+    }
+
+    NodeProg& m_prog;
+    ScopedTable<bool> m_in_scope; // variables declared so far
+    std::pmr::vector<Task> m_tasks;
+    std::pmr::vector<ExprTask> m_expr_tasks;
+    std::pmr::vector<std::pair<NodeIndex, NodeIndex>> m_pairs;
+    std::pmr::vector<bool> m_droppable; // by expr: can't trap and names only declared variables
+};
@@ -1,367 +1,315 @@
 #pragma once
 
+#include <array>
 #include <cassert>
-#include <sstream>
+#include <cstdint>
+#include <memory_resource>
+#include <string_view>
 #include <algorithm>
 
-#include "parser.hpp"
-
+#include "instruction.hpp"
+#include "ir.hpp"
+#include "peephole.hpp"
+#include "regalloc.hpp"
+#include "strength.hpp"
+
+// Lowers the IR to x86-64 for Linux. Values live in the registers the
+// allocator gives them or in stack slots, and constants are used as
+// immediates. The slots make one frame of fixed layout, reserved on entry
+// and addressed from rbp, which is set there to point just above it; rsp
+// doesn't move again, and [rbp-disp] encodes a byte shorter than
+// [rsp+disp], which needs a SIB byte. Phi copies are made at the end of each
+// predecessor. The result is an instruction list, for the encoder or, as
+// a listing, for NASM.
 class Generator {
 public:
-    explicit Generator(NodeProg prog, bool verbose, std::string srcName)
-       : m_prog(std::move(prog)), m_verbose(verbose), m_srcName(srcName) {
-
-    }
+    // How the program ends: with the exit system call, as an executable, or
+    // by returning the exit value to the host that called it in process
+    enum class ExitMode : std::uint8_t {
+        syscall,
+        ret
+    };
 
-    void error(std::string msg) {
-        std::cerr << m_srcName << ": " << msg << std::endl;
-    }
+    // The register assignment and the instruction list are allocated from resource
+    explicit Generator(const IrProg& ir, bool verbose, ExitMode exit_mode = ExitMode::syscall, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+       : m_ir(ir), m_code(resource), m_peephole(resource), m_regs(ir, pool.size(), resource), m_moves(resource), m_verbose(verbose), m_exit_mode(exit_mode) {
 
-    void gen_term(const NodeTerm* term) {
-        struct TermVisitor {
-            Generator& gen;
-            void operator()(const NodeTermIntLit* term_int_lit) const {
-                gen.m_output << "    mov rax, " << term_int_lit->int_lit.value.value() << "\n";
-                gen.push("rax");
-            }
-            void operator()(const NodeTermIdent* term_ident) const {
-                const auto it = std::ranges::find_if(
-                    std::as_const(gen.m_vars),
-                    [&](const Var& var) {
-                        return var.name == term_ident->ident.value.value();
-                    }
-                );
-                if (it == gen.m_vars.cend()) {
-                    gen.error("Undeclared identifier used '" + term_ident->ident.value.value() + "'");
-                    exit(EXIT_FAILURE);
-                }
-                std::stringstream offset;
-                offset << "QWORD [rsp+" << (gen.m_stack_size - it->stack_loc - 1) * 8 << "]";
-                gen.push(offset.str());
-            }
-
-            void operator()(const NodeTermParen* term_paren) const {
-                gen.gen_expr(term_paren->expr);
-            }
-        };
-        TermVisitor visitor({.gen = *this});
-        std::visit(visitor, term->var);
     }
 
-    void gen_bin_expr(const NodeBinExpr* bin_expr) {
-        struct BinExprVisitor {
-            Generator& gen;
-            void operator()(const NodeBinExprAdd* add) const {
-                gen.gen_expr(add->rhs);
-                gen.gen_expr(add->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    add rax, rbx\n";
-                gen.push("rax");
-            }
-
-            void operator()(const NodeBinExprSub* sub) const {
-                gen.gen_expr(sub->rhs);
-                gen.gen_expr(sub->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    sub rax, rbx\n";
-                gen.push("rax");
-            }
-
-            void operator()(const NodeBinExprMulti* multi) const {
-                gen.gen_expr(multi->rhs);
-                gen.gen_expr(multi->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    mul rbx\n";
-                gen.push("rax");
-            }
-
-            void operator()(const NodeBinExprDiv* div) const {
-                gen.gen_expr(div->rhs);
-                gen.gen_expr(div->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    xor rdx, rdx\n";
-                gen.m_output << "    div rbx\n";
-                gen.push("rax");
+    // dst = lhs op rhs. mul keeps the low 64 bits, which imul computes the
+    // same as mul does; div is unsigned and goes through rax and rdx.
+    // Multiplication and division by a constant are strength reduced.
+    void gen_bin(const IrOp op, const Operand& dst, Operand lhs, Operand rhs) {
+        if (op == IrOp::mul && lhs.kind == Operand::Kind::imm) {
+            std::swap(lhs, rhs);
+        }
+        if ((op == IrOp::mul || op == IrOp::div) && rhs.kind == Operand::Kind::imm && rhs.value != 0 && gen_by_const(op, dst, lhs, static_cast<std::uint64_t>(rhs.value))) {
+            return;
+        }
+        if (op == IrOp::div) {
+            emit(Opcode::mov, Operand::make_reg(Reg::rax), lhs);
+            emit(Opcode::clear, Operand::make_reg(Reg::rdx));
+            if (rhs.kind == Operand::Kind::imm) {
+                emit(Opcode::mov, Operand::make_reg(scratch), rhs);
+                rhs = Operand::make_reg(scratch);
             }
-        };
-
-        BinExprVisitor visitor{.gen = *this};
-        std::visit(visitor, bin_expr->var);
+            emit(Opcode::div, {}, rhs);
+            emit(Opcode::mov, dst, Operand::make_reg(Reg::rax));
+            return;
+        }
+        if (op != IrOp::sub && rhs == dst) {
+            std::swap(lhs, rhs);
+        }
+        if (rhs.kind == Operand::Kind::imm && !rhs.is_imm32()) {
+            emit(Opcode::mov, Operand::make_reg(scratch), rhs);
+            rhs = Operand::make_reg(scratch);
+        }
+        // Computed in place when dst is a register the instruction doesn't read as rhs
+        const Operand work = dst.kind == Operand::Kind::reg && rhs != dst ? dst : Operand::make_reg(Reg::rax);
+        if (lhs != work) {
+            emit(Opcode::mov, work, lhs);
+        }
+        switch (op) {
+            case IrOp::add:
+                emit(Opcode::add, work, rhs);
+                break;
+            case IrOp::sub:
+                emit(Opcode::sub, work, rhs);
+                break;
+            case IrOp::mul:
+                emit(Opcode::imul, work, rhs);
+                break;
+            default:
+                assert(false); // Unreachable
+                break;
+        }
+        if (work != dst) {
+            emit(Opcode::mov, dst, work);
+        }
     }
 
-    void gen_expr(const NodeExpr* expr) {
-        struct ExprVisitor {
-            Generator& gen;
-            void operator()(const NodeTerm* term) const {
-                gen.gen_term(term);
+    // dst = x * c or x / c with c nonzero, without imul or div where shifts,
+    // lea or a multiplication by the reciprocal do. Returns false, emitting
+    // nothing, for a multiplier imul is as good for.
+    bool gen_by_const(const IrOp op, const Operand& dst, const Operand& x, const std::uint64_t c) {
+        if (x.kind == Operand::Kind::imm) {
+            const auto lhs = static_cast<std::uint64_t>(x.value);
+            gen_move(dst, Operand::make_imm(static_cast<std::int64_t>(op == IrOp::mul ? lhs * c : lhs / c)));
+            return true;
+        }
+        if (c == 1) {
+            gen_move(dst, x);
+            return true;
+        }
+        const Operand rax = Operand::make_reg(Reg::rax);
+        const Operand rdx = Operand::make_reg(Reg::rdx);
+        const Operand work = dst.kind == Operand::Kind::reg ? dst : rax;
+        if (op == IrOp::mul) {
+            const std::optional<MulSteps> steps = mul_steps(c);
+            if (!steps.has_value()) {
+                return false;
             }
-            void operator()(const NodeBinExpr* bin_expr) const {
-                gen.gen_bin_expr(bin_expr);
+            // The first lea can read x itself when it is in a register
+            Operand src = x;
+            for (const std::uint8_t factor : steps->factors) {
+                if (factor == 1) {
+                    continue;
+                }
+                if (src.kind != Operand::Kind::reg) {
+                    gen_move(work, src);
+                    src = work;
+                }
+                emit(Opcode::lea, work, Operand::make_scaled(src.reg, factor - 1));
+                src = work;
             }
-        };
-
-        ExprVisitor visitor{ .gen = *this };
-        std::visit(visitor, expr->var);
+            gen_move(work, src);
+            shift(Opcode::shl, work, steps->shift);
+            gen_move(dst, work);
+            return true;
+        }
+        if (std::has_single_bit(c)) {
+            gen_move(work, x);
+            shift(Opcode::shr, work, std::countr_zero(c));
+            gen_move(dst, work);
+            return true;
+        }
+        const DivMagic magic = div_magic(c);
+        const Operand multiplier = Operand::make_imm(static_cast<std::int64_t>(magic.multiplier));
+        if (magic.pre_shift != 0) {
+            emit(Opcode::mov, rax, x);
+            shift(Opcode::shr, rax, magic.pre_shift);
+            emit(Opcode::mov, Operand::make_reg(scratch), multiplier);
+            emit(Opcode::mul, {}, Operand::make_reg(scratch));
+        }
+        else {
+            emit(Opcode::mov, rax, multiplier);
+            emit(Opcode::mul, {}, x);
+        }
+        if (magic.add) {
+            emit(Opcode::mov, rax, x);
+            emit(Opcode::sub, rax, rdx);
+            shift(Opcode::shr, rax, 1);
+            emit(Opcode::add, rax, rdx);
+            shift(Opcode::shr, rax, magic.post_shift);
+            gen_move(dst, rax);
+            return true;
+        }
+        shift(Opcode::shr, rdx, magic.post_shift);
+        gen_move(dst, rdx);
+        return true;
     }
 
-    void gen_scope(const NodeScope* scope) {
-        begin_scope();
-        for (const NodeStmt* stmt: scope->stmts) {
-            gen_stmt(stmt);
+    // Copies this block's phi arguments for the edge to target into the phis
+    void gen_phi_moves(const BlockId block, const BlockId target) {
+        const IrBlock& succ = m_ir.blocks[target];
+        const std::uint32_t arg = m_ir.pred_index(target, block);
+        m_moves.clear();
+        for (ValueId v = succ.first; v < succ.end() && m_ir.values[v].op == IrOp::phi; v++) {
+            m_moves.push_back({ .dst = operand(v), .src = operand(m_ir.phi_args[m_ir.values[v].a + arg]) });
         }
-        end_scope();
+        sequentialize(m_moves, Operand::make_reg(Reg::rax), [&](const Operand& dst, const Operand& src) {
+            gen_move(dst, src);
+        });
     }
 
-    void gen_stmt_set(const NodeStmtSet* stmt) {
-        struct StmtSetVisitor {
-            Generator& gen;
-            void operator()(const NodeStmtSetExpr* stmt_set_expr) const {
-                const auto it = std::ranges::find_if(
-                    std::as_const(gen.m_vars),
-                    [&](const Var& var) {
-                        return var.name == stmt_set_expr->ident.value.value();
-                    }
-                );
-                if (it == gen.m_vars.cend()) {
-                    gen.error("Undeclared identifier used '" + stmt_set_expr->ident.value.value() + "'");
-                    exit(EXIT_FAILURE);
+    void gen_term(const BlockId block) {
+        const IrTerm& term = m_ir.blocks[block].term;
+        switch (term.kind) {
+            case TermKind::jump:
+                gen_phi_moves(block, term.target);
+                emit(Opcode::jmp, Operand::make_label(term.target));
+                break;
+            case TermKind::branch: {
+                // Branch targets have no phis
+                Operand cond = operand(term.value);
+                if (cond.kind == Operand::Kind::imm) {
+                    emit(Opcode::jmp, Operand::make_label(cond.value != 0 ? term.target : term.alt));
+                    break;
                 }
-                gen.gen_expr(stmt_set_expr->expr);
-                gen.pop("rax");
-                gen.m_output << "    mov [rsp + " << (gen.m_stack_size - it->stack_loc - 1) * 8 << "], rax\n";
-            }
-
-            void operator()(const NodeStmtSetAdd* stmt_set_add) const {
-                const auto it = std::ranges::find_if(
-                    std::as_const(gen.m_vars),
-                    [&](const Var& var) {
-                        return var.name == stmt_set_add->ident.value.value();
-                    }
-                );
-                if (it == gen.m_vars.cend()) {
-                    gen.error("Undeclared identifier used '" + stmt_set_add->ident.value.value() + "'");
-                    exit(EXIT_FAILURE);
+                if (cond.kind != Operand::Kind::reg) {
+                    emit(Opcode::mov, Operand::make_reg(Reg::rax), cond);
+                    cond = Operand::make_reg(Reg::rax);
                 }
-                gen.gen_expr(stmt_set_add->expr);
-                gen.pop("rax");
-                gen.m_output << "    add QWORD [rsp+" << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << "], rax\n";
+                emit(Opcode::test, cond, cond);
+                emit(Opcode::jz, Operand::make_label(term.alt));
+                emit(Opcode::jmp, Operand::make_label(term.target));
+                break;
             }
-
-            void operator()(const NodeStmtSetMulti* stmt_set_add) const {
-                const auto it = std::ranges::find_if(
-                    std::as_const(gen.m_vars),
-                    [&](const Var& var) {
-                        return var.name == stmt_set_add->ident.value.value();
+            case TermKind::exit:
+                if (m_exit_mode == ExitMode::ret) {
+                    emit(Opcode::mov, Operand::make_reg(Reg::rax), operand(term.value));
+                    if (m_regs.slot_count() > 0) {
+                        emit(Opcode::mov, Operand::make_reg(Reg::rsp), Operand::make_reg(Reg::rbp));
                     }
-                );
-                if (it == gen.m_vars.cend()) {
-                    gen.error("Undeclared identifier used '" + stmt_set_add->ident.value.value() + "'");
-                    exit(EXIT_FAILURE);
-                }
-                gen.gen_expr(stmt_set_add->expr);
-                gen.pop("rbx");
-                gen.m_output << "    mov rax, QWORD [rsp+" << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << "]\n";
-                gen.m_output << "    mul rbx\n";
-                gen.m_output << "    mov QWORD [rsp+" << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << "], rax\n";
-            }
-
-            void operator()(const NodeStmtSetSub* stmt_set_add) const {
-                const auto it = std::ranges::find_if(
-                    std::as_const(gen.m_vars),
-                    [&](const Var& var) {
-                        return var.name == stmt_set_add->ident.value.value();
-                    }
-                );
-                if (it == gen.m_vars.cend()) {
-                    gen.error("Undeclared identifier used '" + stmt_set_add->ident.value.value() + "'");
-                    exit(EXIT_FAILURE);
-                }
-                gen.gen_expr(stmt_set_add->expr);
-                gen.pop("rax");
-                gen.m_output << "    sub QWORD [rsp+" << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << "], rax\n";
-            }
-
-            void operator()(const NodeStmtSetDiv* stmt_set_add) const {
-                const auto it = std::ranges::find_if(
-                    std::as_const(gen.m_vars),
-                    [&](const Var& var) {
-                        return var.name == stmt_set_add->ident.value.value();
+                    for (size_t i = callee_saved.size(); i-- > 0;) {
+                        emit(Opcode::pop, Operand::make_reg(callee_saved[i]));
                     }
-                );
-                if (it == gen.m_vars.cend()) {
-                    gen.error("Undeclared identifier used '" + stmt_set_add->ident.value.value() + "'");
-                    exit(EXIT_FAILURE);
-                }
-                gen.gen_expr(stmt_set_add->expr);
-                gen.pop("rbx");
-                gen.m_output << "    mov rax, QWORD [rsp+" << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << "]\n";
-                gen.m_output << "    xor rdx, rdx\n";
-                gen.m_output << "    div rbx\n";
-                gen.m_output << "    mov QWORD [rsp+" << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << "], rax\n";
-            }
-        };
-
-        StmtSetVisitor visitor{ .gen = *this };
-        std::visit(visitor, stmt->var);
-    }
-
-    void gen_if_pred(const NodeIfPred* if_pred, const std::string& end_label) {
-        struct PredVisitor {
-            Generator& gen;
-            const std::string& end_label;
-
-            void operator()(const NodeIfPredElseIf* elseif) const {
-                if (gen.m_verbose)
-                    gen.m_output << "    ;; elif\n";
-                gen.gen_expr(elseif->expr);
-                gen.pop("rax");
-                const std::string label = gen.create_label();
-                gen.m_output << "    test rax, rax\n";
-                gen.m_output << "    jz " << label << "\n";
-                gen.gen_scope(elseif->scope);
-                gen.m_output << "    jmp " << end_label << "\n";
-                gen.m_output << label << ":\n";
-                if (elseif->pred.has_value()) {
-                    gen.gen_if_pred(elseif->pred.value(), end_label);
+                    emit(Opcode::ret);
+                    break;
                 }
-            }
-
-            void operator()(const NodeIfPredElse* else_) const {
-                if (gen.m_verbose)
-                    gen.m_output << "    ;; else\n";
-                gen.gen_scope(else_->scope);
-            }
-        };
-
-        PredVisitor visitor{ .gen = *this, .end_label = end_label };
-        std::visit(visitor, if_pred->var);
+                emit(Opcode::mov, Operand::make_reg(Reg::rdi), operand(term.value));
+                emit(Opcode::mov, Operand::make_reg(Reg::rax), Operand::make_imm(60));
+                emit(Opcode::syscall);
+                break;
+        }
     }
 
-    void gen_stmt(const NodeStmt* stmt) {
-        struct StmtVisitor {
-            Generator& gen;
-            void operator()(const NodeStmtExit* stmt_exit) const {
-                if (gen.m_verbose)
-                    gen.m_output << "    ;; exit\n";
-                gen.gen_expr(stmt_exit->expr);
-                gen.m_output << "    mov rax, 60\n";
-                gen.pop("rdi");
-                gen.m_output << "    syscall\n";
-                if (gen.m_verbose)
-                    gen.m_output << "    ;; /exit\n";
-            }
-
-            void operator()(const NodeStmtLet* stmt_let) const {
-                if (gen.m_verbose)
-                    gen.m_output << "    ;; let\n";
-                if(std::ranges::find_if(
-                    std::as_const(gen.m_vars),
-                    [&](const Var& var) {
-                        return var.name == stmt_let->ident.value.value();
-                    }) != gen.m_vars.cend()) {
-                    gen.error("Identifier already used: '" + stmt_let->ident.value.value() + "'");
-                    exit(EXIT_FAILURE);
-                }
-                gen.m_vars.push_back({ .name = stmt_let->ident.value.value(), .stack_loc = gen.m_stack_size });
-                gen.gen_expr(stmt_let->expr);
-                if (gen.m_verbose)
-                    gen.m_output << "    ;; /let\n";
-            }
-
-            void operator()(const NodeStmtSet* stmt_set) const {
-                gen.gen_stmt_set(stmt_set);
+    [[nodiscard]] const std::pmr::vector<Instr>& gen_prog() {
+        m_regs.allocate();
+        if (m_exit_mode == ExitMode::ret) {
+            for (const Reg reg : callee_saved) {
+                emit(Opcode::push, {}, Operand::make_reg(reg));
             }
-
-            void operator()(const NodeScope* scope) const {
-                gen.gen_scope(scope);
+        }
+        if (m_regs.slot_count() > 0) {
+            emit(Opcode::mov, Operand::make_reg(Reg::rbp), Operand::make_reg(Reg::rsp));
+            emit(Opcode::sub, Operand::make_reg(Reg::rsp), Operand::make_imm(static_cast<std::int64_t>(m_regs.slot_count()) * 8));
+        }
+        for (BlockId b = 0; b < m_ir.blocks.size(); b++) {
+            const IrBlock& block = m_ir.blocks[b];
+            emit(Opcode::label, Operand::make_label(b));
+            if (m_verbose) {
+                emit(Opcode::comment, Operand::make_imm(b));
             }
-
-            void operator()(const NodeStmtIf* stmt_if) {
-                if (gen.m_verbose)
-                    gen.m_output << "    ;; if\n";
-                gen.gen_expr(stmt_if->expr);
-                gen.pop("rax");
-                const std::string label = gen.create_label();
-                gen.m_output << "    test rax, rax\n";
-                gen.m_output << "    jz " << label << "\n";
-                gen.gen_scope(stmt_if->scope);
-                if (stmt_if->pred.has_value()) {
-                    const std::string end_label = gen.create_label();
-                    gen.m_output << "    jmp " << end_label << "\n";
-                    gen.m_output << label << ":\n";
-                    gen.gen_if_pred(stmt_if->pred.value(), end_label);
-                    gen.m_output << end_label << ":\n";
-                }
-                else {
-                    gen.m_output << label << ":\n";
+            for (ValueId v = block.first; v < block.end(); v++) {
+                const IrValue& value = m_ir.values[v];
+                if (value.is_bin()) {
+                    gen_bin(value.op, operand(v), operand(value.a), operand(value.b));
                 }
-                if (gen.m_verbose)
-                    gen.m_output << "    ;; /if\n";
             }
-        };
+            gen_term(b);
+        }
 
-        StmtVisitor visitor{ .gen = *this };
-        std::visit(visitor, stmt->var);
+        m_peephole.run(m_code);
+        return m_code;
     }
 
-    [[nodiscard]] std::string gen_prog() {
-        m_output << "global _start\n_start:\n";
-
-        for (const NodeStmt* stmt : m_prog.stmts) {
-            gen_stmt(stmt);
+    // The generated code as NASM source
+    void write_asm(OutputBuffer& out) const {
+        out << "global _start\n_start:\n";
+        for (const Instr& instr : m_code) {
+            out << instr;
         }
+    }
 
-        m_output << "    mov rax, 60\n";
-        m_output << "    mov rdi, 0\n";
-        m_output << "    syscall\n";
-        return m_output.str();
+    [[nodiscard]] const Peephole& peephole() const {
+        return m_peephole;
     }
 private:
+    // Registers values are allocated to. rax and rdx are left for div and as
+    // temporaries, and r11 for immediates that don't fit an instruction.
+    // rsp and rbp hold the frame.
+    static constexpr std::array<Reg, 11> pool {
+        Reg::rbx, Reg::rcx, Reg::rsi, Reg::rdi, Reg::r8, Reg::r9, Reg::r10, Reg::r12, Reg::r13, Reg::r14, Reg::r15,
+    };
+    static constexpr Reg scratch = Reg::r11;
 
-    void push(const std::string& reg) {
-        m_output << "    push " << reg << "\n";
-        m_stack_size++;
-    }
+    // Registers a System V caller expects back, saved when returning to one
+    static constexpr std::array<Reg, 6> callee_saved {
+        Reg::rbx, Reg::rbp, Reg::r12, Reg::r13, Reg::r14, Reg::r15,
+    };
 
-    void pop(const std::string& reg) {
-        m_output << "    pop " << reg << "\n";
-        m_stack_size--;
+    // Where value v is: its register, its stack slot or its constant
+    [[nodiscard]] Operand operand(const ValueId v) const {
+        const IrValue& value = m_ir.values[v];
+        if (value.op == IrOp::const_) {
+            return Operand::make_imm(static_cast<std::int64_t>(value.constant()));
+        }
+        if (const std::optional<std::uint8_t> reg = m_regs.reg(v)) {
+            return Operand::make_reg(pool[reg.value()]);
+        }
+        return Operand::make_frame(-8 * (static_cast<std::int64_t>(m_regs.slot(v)) + 1));
     }
 
-    void begin_scope() {
-        m_scopes.push_back(m_vars.size());
+    // mov without its restrictions: memory to memory and a wide immediate to
+    // memory go through the scratch register. Nothing for a copy to itself.
+    void gen_move(const Operand& dst, const Operand& src) {
+        if (dst == src) {
+            return;
+        }
+        if (dst.is_mem() && (src.is_mem() || (src.kind == Operand::Kind::imm && !src.is_imm32()))) {
+            emit(Opcode::mov, Operand::make_reg(scratch), src);
+            emit(Opcode::mov, dst, Operand::make_reg(scratch));
+            return;
+        }
+        emit(Opcode::mov, dst, src);
     }
 
-    void end_scope() {
-        const size_t pop_count = m_vars.size() - m_scopes.back();
-        m_output << "    add rsp, " << pop_count * 8 << '\n';
-        m_stack_size -= pop_count;
-        for (size_t i = 0; i < pop_count; i++) {
-            m_vars.pop_back();
+    void shift(const Opcode op, const Operand& dst, const int count) {
+        if (count != 0) {
+            emit(op, dst, Operand::make_imm(count));
         }
-        m_scopes.pop_back();
     }
 
-    std::string create_label() {
-        return "label" + std::to_string(m_label_count++);
+    void emit(const Opcode op, const Operand& dst = {}, const Operand& src = {}) {
+        m_code.push_back({ .op = op, .dst = dst, .src = src });
     }
 
-    struct Var {
-        std::string name;
-        size_t stack_loc;
-    };
-
-    const std::string m_srcName;
-    const NodeProg m_prog;
-    std::stringstream m_output;
-    size_t m_stack_size = 0;
-    std::vector<Var> m_vars {};
-    std::vector<size_t> m_scopes {};
-    size_t m_label_count = 0;
+    const IrProg& m_ir;
+    std::pmr::vector<Instr> m_code;
+    Peephole m_peephole;
+    RegisterAllocator m_regs;
+    std::pmr::vector<Move> m_moves;
     bool m_verbose = false;
-    //std::map<std::string, Var> m_vars {};
-};
\ No newline at end of file
+    ExitMode m_exit_mode;
+};
@@ -1,320 +1,172 @@
 #pragma once
 
 #include <cassert>
-#include <sstream>
 #include <algorithm>
 
-#include "parser.hpp"
-
-// Make generation errors happen in the parser because no errors should happen in 
-// the generation stage as we don't know on what line and col they happend
-
+#include "ir.hpp"
+#include "lith.hpp"
+#include "output_buffer.hpp"
+#include "regalloc.hpp"
+
+// Lowers the IR to the Lith register machine. Values live in r1 to r13 as
+// the allocator assigns them, r0 and r14 are temporaries and r15 is the
+// stack pointer: push lowers it by 8 and stores, pop loads and raises it.
+// The machine has no memory operands, so a spilled value is reached by
+// moving r15 to its slot and popping or pushing it there. Operands are
+// kept as Operands, with the Reg number standing for the Lith register.
 class GeneratorLith {
 public:
-    inline explicit GeneratorLith(NodeProg prog)
-       : m_prog(std::move(prog)) {
+    explicit GeneratorLith(const IrProg& ir, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+       : m_ir(ir), m_regs(ir, pool_size, resource), m_moves(resource), m_code(resource) {
 
     }
 
-    void gen_term(const NodeTerm* term) {
-        struct TermVisitor {
-            GeneratorLith& gen;
-            void operator()(const NodeTermIntLit* term_int_lit) const {
-                gen.m_output << "    mov r0, " << term_int_lit->int_lit.value.value() << "\n";
-                gen.push("r0");
-            }
-            void operator()(const NodeTermIdent* term_ident) const {
-                auto it = std::find_if(gen.m_vars.cbegin(), gen.m_vars.cend(), [&](const Var& var) {
-                    return var.name == term_ident->ident.value.value();
-                });
-                if (it == gen.m_vars.cend()) {
-                    std::cerr << "Undeclared identifier used '" << term_ident->ident.value.value() << "'\n";
-                    exit(EXIT_FAILURE);
-                }
-                gen.m_output << "    sub r5, " << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << '\n';
-                gen.pop("r2");
-                gen.push("r2");
-                gen.m_output << "    add r15, " << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << '\n';;
-                gen.push("r2");
-            }
-
-            void operator()(const NodeTermParen* term_paren) const {
-                gen.gen_expr(term_paren->expr);
-            }
-        };
-        TermVisitor visitor({.gen = *this});
-        std::visit(visitor, term->var);
-    }
-
-    void gen_bin_expr(const NodeBinExpr* bin_expr) {
-        struct BinExprVisitor {
-            GeneratorLith& gen;
-            void operator()(const NodeBinExprAdd* add) const {
-                gen.gen_expr(add->rhs);
-                gen.gen_expr(add->lhs);
-                gen.pop("r0");
-                gen.pop("r3");
-                gen.m_output << "    add r0, r3\n";
-                gen.push("r0");
-            }
-
-            void operator()(const NodeBinExprSub* sub) const {
-                gen.gen_expr(sub->rhs);
-                gen.gen_expr(sub->lhs);
-                gen.pop("r0");
-                gen.pop("r3");
-                gen.m_output << "    sub r0, r3\n";
-                gen.push("r0");
-            }
-
-            void operator()(const NodeBinExprMulti* multi) const {
-                gen.gen_expr(multi->rhs);
-                gen.gen_expr(multi->lhs);
-                gen.pop("r0");
-                gen.pop("r3");
-                gen.m_output << "    mul r0, r3\n";
-                gen.push("r0");
-            }
-
-            void operator()(const NodeBinExprDiv* div) const {
-                gen.gen_expr(div->rhs);
-                gen.gen_expr(div->lhs);
-                gen.pop("r0");
-                gen.pop("r3");
-                gen.m_output << "    div r0, r3\n";
-                gen.push("r0");
-            }
-        };
-
-        BinExprVisitor visitor{.gen = *this};
-        std::visit(visitor, bin_expr->var);
-    }
-
-    void gen_expr(const NodeExpr* expr) {
-        struct ExprVisitor {
-            GeneratorLith& gen;
-            void operator()(const NodeTerm* term) const {
-                gen.gen_term(term);
-            }
-            void operator()(const NodeBinExpr* bin_expr) const {
-                gen.gen_bin_expr(bin_expr);
-            }
-        };
-
-        ExprVisitor visitor{ .gen = *this };
-        std::visit(visitor, expr->var);
-    }
-
-    void gen_scope(const NodeScope* scope) {
-        begin_scope();
-        for (const NodeStmt* stmt: scope->stmts) {
-            gen_stmt(stmt);
+    void gen_bin(const ValueId v) {
+        const IrValue& value = m_ir.values[v];
+        const Operand dst = operand(v);
+        const Operand rhs_loc = operand(value.b);
+        const Operand work = dst.kind == Operand::Kind::reg && dst != rhs_loc ? dst : reg(14);
+        gen_move(work, operand(value.a));
+        const Operand rhs = load(rhs_loc, reg(0));
+        switch (value.op) {
+            case IrOp::add:
+                emit(LithOp::add, work, rhs);
+                break;
+            case IrOp::sub:
+                emit(LithOp::sub, work, rhs);
+                break;
+            case IrOp::mul:
+                emit(LithOp::mul, work, rhs);
+                break;
+            case IrOp::div:
+                emit(LithOp::div, work, rhs);
+                break;
+            default:
+                assert(false); // Unreachable
+                break;
         }
-        end_scope();
+        gen_move(dst, work);
     }
 
-    void gen_stmt_set(const NodeStmtSet* stmt) {
-        struct StmtSetVisitor {
-            GeneratorLith& gen;
-            void operator()(const NodeStmtSetExpr* stmt_set_expr) const {
-                auto it = std::find_if(gen.m_vars.cbegin(), gen.m_vars.cend(), [&](const Var& var) {
-                    return var.name == stmt_set_expr->ident.value.value();
-                });
-                if (it == gen.m_vars.cend()) {
-                    std::cerr << "Undeclared identifier used '" << stmt_set_expr->ident.value.value() << "'\n";
-                    exit(EXIT_FAILURE);
-                }
-                gen.gen_expr(stmt_set_expr->expr);
-                gen.pop("r0");
-                gen.m_output << "    sub r15, " << (gen.m_stack_size - (*it).stack_loc - 1) * 8 + 8 << '\n';
-                gen.m_output << "    push r0\n";
-                gen.m_output << "    add r15, " << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << '\n';
-            }
-
-            void operator()(const NodeStmtSetAdd* stmt_set_add) const {
-                auto it = std::find_if(gen.m_vars.cbegin(), gen.m_vars.cend(), [&](const Var& var) {
-                    return var.name == stmt_set_add->ident.value.value();
-                });
-                if (it == gen.m_vars.cend()) {
-                    std::cerr << "Undeclared identifier used '" << stmt_set_add->ident.value.value() << "'\n";
-                    exit(EXIT_FAILURE);
+    void gen_term(const BlockId block) {
+        const IrTerm& term = m_ir.blocks[block].term;
+        switch (term.kind) {
+            case TermKind::jump: {
+                const IrBlock& succ = m_ir.blocks[term.target];
+                const std::uint32_t arg = m_ir.pred_index(term.target, block);
+                m_moves.clear();
+                for (ValueId v = succ.first; v < succ.end() && m_ir.values[v].op == IrOp::phi; v++) {
+                    m_moves.push_back({ .dst = operand(v), .src = operand(m_ir.phi_args[m_ir.values[v].a + arg]) });
                 }
-                gen.gen_expr(stmt_set_add->expr);
-                gen.pop("r0");
-                gen.m_output << "    sub r15, " << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << '\n';
-                gen.pop("r2");
-                gen.m_output << "    add r2, r0\n";
-                gen.push("r2");
-                gen.m_output << "    add r15, " << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << '\n';
-            }
-
-            void operator()(const NodeStmtSetMulti* stmt_set_add) const {
-                auto it = std::find_if(gen.m_vars.cbegin(), gen.m_vars.cend(), [&](const Var& var) {
-                    return var.name == stmt_set_add->ident.value.value();
+                sequentialize(m_moves, reg(14), [&](const Operand& dst, const Operand& src) {
+                    gen_move(dst, src);
                 });
-                if (it == gen.m_vars.cend()) {
-                    std::cerr << "Undeclared identifier used '" << stmt_set_add->ident.value.value() << "'\n";
-                    exit(EXIT_FAILURE);
-                }
-                gen.gen_expr(stmt_set_add->expr);
-                gen.pop("r3");
-                gen.m_output << "   sub r15, " << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << '\n';
-                gen.pop("r0");
-                gen.push("r0");
-                gen.m_output << "   add r15, " << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << '\n';
-                gen.m_output << "   mul r0, r3";
-                gen.m_output << "   sub r15, " << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << '\n';
-                gen.pop("r13");
-                gen.push("r0");
-                gen.m_output << "   add r15, " << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << '\n';
-                gen.m_output << "   sub r15, " << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << '\n';
-                gen.pop("r2");
-                gen.m_output << "   mov r2, r0";
-                gen.push("r2");
-                gen.m_output << "   add r15, " << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << '\n';
-            }
-
-            void operator()(const NodeStmtSetSub* stmt_set_add) const {
-                auto it = std::find_if(gen.m_vars.cbegin(), gen.m_vars.cend(), [&](const Var& var) {
-                    return var.name == stmt_set_add->ident.value.value();
-                });
-                if (it == gen.m_vars.cend()) {
-                    std::cerr << "Undeclared identifier used '" << stmt_set_add->ident.value.value() << "'\n";
-                    exit(EXIT_FAILURE);
-                }
-                gen.gen_expr(stmt_set_add->expr);
-                gen.pop("r0");
-                gen.m_output << "   sub r15, " << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << '\n';
-                gen.pop("r2");
-                gen.m_output << "   sub r2, r0\n";
-                gen.push("r2");
-                gen.m_output << "   add r15, " << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << '\n';
-            }
-
-            void operator()(const NodeStmtSetDiv* stmt_set_add) const {
-                auto it = std::find_if(gen.m_vars.cbegin(), gen.m_vars.cend(), [&](const Var& var) {
-                    return var.name == stmt_set_add->ident.value.value();
-                });
-                if (it == gen.m_vars.cend()) {
-                    std::cerr << "Undeclared identifier used '" << stmt_set_add->ident.value.value() << "'\n";
-                    exit(EXIT_FAILURE);
-                }
-                gen.gen_expr(stmt_set_add->expr);
-                gen.pop("r3");
-                gen.m_output << "   sub r15, " << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << '\n';
-                gen.pop("r0");
-                gen.push("r0");
-                gen.m_output << "   add r15, " << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << '\n';
-                gen.m_output << "   div r0, r3\n";
-                gen.m_output << "   sub r15, " << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << '\n';
-                gen.pop("r2");
-                gen.m_output << "   mov r2, r0\n";
-                gen.push("r2");
-                gen.m_output << "   add r15, " << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << '\n';
-            }
-        };
-
-        StmtSetVisitor visitor{ .gen = *this };
-        std::visit(visitor, stmt->var);
+                emit(LithOp::jmp, Operand::make_label(term.target));
+                break;
+            }
+            case TermKind::branch: {
+                const Operand cond = load(operand(term.value), reg(14));
+                emit(LithOp::test, cond, cond);
+                emit(LithOp::jz, Operand::make_label(term.alt));
+                emit(LithOp::jmp, Operand::make_label(term.target));
+                break;
+            }
+            case TermKind::exit:
+                gen_move(reg(1), operand(term.value));
+                emit(LithOp::mov, reg(0), Operand::make_imm(60));
+                emit(LithOp::syscall);
+                break;
+        }
     }
 
-    void gen_stmt(const NodeStmt* stmt) {
-        struct StmtVisitor {
-            GeneratorLith& gen;
-            void operator()(const NodeStmtExit* stmt_exit) const {
-                gen.gen_expr(stmt_exit->expr);
-                gen.m_output << "    mov r0, 60\n";
-                gen.pop("r1");
-                gen.m_output << "    syscall\n";
-            }
-
-            void operator()(const NodeStmtLet* stmt_let) const {
-                auto it = std::find_if(gen.m_vars.cbegin(), gen.m_vars.cend(), [&](const Var& var) {
-                    return var.name == stmt_let->ident.value.value();
-                });
-                if(it != gen.m_vars.cend()) {
-                    std::cerr << "Identifier already used: " << stmt_let->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
+    const std::pmr::vector<LithInstr>& gen_prog() {
+        m_code.clear();
+        m_regs.allocate();
+        adjust_sp(LithOp::sub, stack_size());
+        for (BlockId b = 0; b < m_ir.blocks.size(); b++) {
+            const IrBlock& block = m_ir.blocks[b];
+            emit(LithOp::label, Operand::make_label(b));
+            for (ValueId v = block.first; v < block.end(); v++) {
+                if (m_ir.values[v].is_bin()) {
+                    gen_bin(v);
                 }
-                gen.m_vars.push_back({ .name = stmt_let->ident.value.value(), .stack_loc = gen.m_stack_size });
-                gen.gen_expr(stmt_let->expr);
-            }
-
-            void operator()(const NodeStmtSet* stmt_set) const {
-                gen.gen_stmt_set(stmt_set);
             }
-
-            void operator()(const NodeScope* scope) const {
-                gen.gen_scope(scope);
-            }
-
-            void operator()(const NodeStmtIf* stmt_if) {
-                gen.gen_expr(stmt_if->expr);
-                gen.pop("r0");
-                std::string label = gen.create_label();
-                gen.m_output << "    test r0, r0\n";
-                gen.m_output << "    jz " << label << "\n";
-                gen.gen_scope(stmt_if->scope);
-                gen.m_output << label << ":\n";
-            }
-        };
-
-        StmtVisitor visitor{ .gen = *this };
-        std::visit(visitor, stmt->var);
+            gen_term(b);
+        }
+        return m_code;
     }
 
-    [[nodiscard]] std::string gen_prog() {
-        m_output << "bits 64\n_start:\n";
+    // The bytes of stack the spilled values take, all of the program's
+    [[nodiscard]] std::uint64_t stack_size() const {
+        return std::uint64_t { m_regs.slot_count() } * 8;
+    }
 
-        for (const NodeStmt* stmt : m_prog.stmts) {
-            gen_stmt(stmt);
+    void write_asm(OutputBuffer& out) const {
+        out << "bits 64\n_start:\n";
+        for (const LithInstr& instr : m_code) {
+            out << instr;
         }
-
-        m_output << "    mov r0, 60\n";
-        m_output << "    mov r1, 0\n";
-        m_output << "    syscall\n";
-        return m_output.str();
     }
 private:
+    static constexpr size_t pool_size = 13; // r1 to r13
 
-    void push(const std::string& reg) {
-        m_output << "    push " << reg << "\n";
-        m_stack_size++;
+    void emit(const LithOp op, const Operand& dst = {}, const Operand& src = {}) {
+        m_code.push_back({ .op = op, .dst = dst, .src = src });
     }
 
-    void pop(const std::string& reg) {
-        m_output << "    pop " << reg << "\n";
-        m_stack_size--;
+    static Operand reg(const unsigned number) {
+        return Operand::make_reg(static_cast<Reg>(number));
     }
 
-    void begin_scope() {
-        m_scopes.push_back(m_vars.size());
+    [[nodiscard]] Operand operand(const ValueId v) const {
+        const IrValue& value = m_ir.values[v];
+        if (value.op == IrOp::const_) {
+            return Operand::make_imm(static_cast<std::int64_t>(value.constant()));
+        }
+        if (const std::optional<std::uint8_t> r = m_regs.reg(v)) {
+            return reg(r.value() + 1u);
+        }
+        return Operand::make_stack(static_cast<size_t>(m_regs.slot(v)) * 8);
     }
 
-    void end_scope() {
-        size_t pop_count = m_vars.size() - m_scopes.back();
-        m_output << "    sub r15, " << pop_count * 8 << '\n';
-        m_stack_size -= pop_count;
-        for (size_t i = 0; i < pop_count; i++) {
-            m_vars.pop_back();
+    // A register holding src: src itself, or temp loaded with it
+    Operand load(const Operand& src, const Operand& temp) {
+        if (src.kind == Operand::Kind::reg) {
+            return src;
         }
-        m_scopes.pop_back();
+        gen_move(temp, src);
+        return temp;
     }
 
-    std::string create_label() {
-        return "label" + std::to_string(m_label_count++);
+    void gen_move(const Operand& dst, const Operand& src) {
+        if (dst == src) {
+            return;
+        }
+        if (dst.kind == Operand::Kind::reg) {
+            if (src.is_mem()) {
+                adjust_sp(LithOp::add, src.value);
+                emit(LithOp::pop, dst);
+                adjust_sp(LithOp::sub, src.value + 8);
+            }
+            else {
+                emit(LithOp::mov, dst, src);
+            }
+            return;
+        }
+        const Operand value = load(src, reg(0));
+        adjust_sp(LithOp::add, dst.value + 8);
+        emit(LithOp::push, {}, value);
+        adjust_sp(LithOp::sub, dst.value);
     }
 
-    struct Var {
-        std::string name;
-        size_t stack_loc;
-    };
+    void adjust_sp(const LithOp op, const std::int64_t bytes) {
+        if (bytes != 0) {
+            emit(op, reg(15), Operand::make_imm(bytes));
+        }
+    }
 
-    const NodeProg m_prog;
-    std::stringstream m_output;
-    size_t m_stack_size = 0;
-    std::vector<Var> m_vars {};
-    std::vector<size_t> m_scopes {};
-    size_t m_label_count = 0;
-    //std::map<std::string, Var> m_vars {};
-};
\ No newline at end of file
+    const IrProg& m_ir;
+    RegisterAllocator m_regs;
+    std::pmr::vector<Move> m_moves;
+    std::pmr::vector<LithInstr> m_code;
+};
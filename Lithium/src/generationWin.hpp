@@ -1,291 +1,154 @@
 #pragma once
 
-#include <unordered_map>
 #include <cassert>
-#include <sstream>
 #include <algorithm>
-
-#include "parser.hpp"
-
+#include <memory_resource>
+#include <vector>
+
+#include "instruction.hpp"
+#include "ir.hpp"
+#include "output_buffer.hpp"
+#include "strength.hpp"
+
+// Lowers the IR to x86-64 for Windows. Every value gets a stack slot of its
+// own and operations go through rax and rbx. Phi copies are made at the end
+// of each predecessor; their arguments are never phis of the same block, so
+// they can be made in any order. Multiplying or dividing by a power of two
+// is a shift and dividing by another constant a multiplication by its
+// reciprocal.
 class GeneratorWin {
 public:
-    inline explicit GeneratorWin(NodeProg prog)
-       : m_prog(std::move(prog)) {
-
-    }
-
-    void gen_term(const NodeTerm* term) {
-        struct TermVisitor {
-            GeneratorWin& gen;
-            void operator()(const NodeTermIntLit* term_int_lit) const {
-                gen.m_output << "    mov rax, " << term_int_lit->int_lit.value.value() << "\n";
-                gen.push("rax");
-            }
-            void operator()(const NodeTermIdent* term_ident) const {
-                auto it = std::find_if(gen.m_vars.cbegin(), gen.m_vars.cend(), [&](const Var& var) {
-                    return var.name == term_ident->ident.value.value();
-                });
-                if (it == gen.m_vars.cend()) {
-                    std::cerr << "Undeclared identifier used '" << term_ident->ident.value.value() << "'\n";
-                    exit(EXIT_FAILURE);
-                }
-                std::stringstream offset;
-                offset << "QWORD [rsp+" << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << "]";
-                gen.push(offset.str());
-            }
-
-            void operator()(const NodeTermParen* term_paren) const {
-                gen.gen_expr(term_paren->expr);
-            }
-        };
-        TermVisitor visitor({.gen = *this});
-        std::visit(visitor, term->var);
-    }
-
-    void gen_bin_expr(const NodeBinExpr* bin_expr) {
-        struct BinExprVisitor {
-            GeneratorWin& gen;
-            void operator()(const NodeBinExprAdd* add) const {
-                gen.gen_expr(add->rhs);
-                gen.gen_expr(add->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    add rax, rbx\n";
-                gen.push("rax");
-            }
-
-            void operator()(const NodeBinExprSub* sub) const {
-                gen.gen_expr(sub->rhs);
-                gen.gen_expr(sub->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    sub rax, rbx\n";
-                gen.push("rax");
-            }
-
-            void operator()(const NodeBinExprMulti* multi) const {
-                gen.gen_expr(multi->rhs);
-                gen.gen_expr(multi->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    mul rbx\n";
-                gen.push("rax");
-            }
+    GeneratorWin(const IrProg& ir, OutputBuffer& output, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+       : m_ir(ir), m_output(output), m_slots(ir.values.size(), resource) {
 
-            void operator()(const NodeBinExprDiv* div) const {
-                gen.gen_expr(div->rhs);
-                gen.gen_expr(div->lhs);
-                gen.pop("rax");
-                gen.pop("rbx");
-                gen.m_output << "    xor rdx, rdx\n";
-                gen.m_output << "    div rbx\n";
-                gen.push("rax");
-            }
-        };
-
-        BinExprVisitor visitor{.gen = *this};
-        std::visit(visitor, bin_expr->var);
     }
 
-    void gen_expr(const NodeExpr* expr) {
-        struct ExprVisitor {
-            GeneratorWin& gen;
-            void operator()(const NodeTerm* term) const {
-                gen.gen_term(term);
-            }
-            void operator()(const NodeBinExpr* bin_expr) const {
-                gen.gen_bin_expr(bin_expr);
-            }
-        };
-
-        ExprVisitor visitor{ .gen = *this };
-        std::visit(visitor, expr->var);
+    void gen_bin(const ValueId v) {
+        const IrValue& value = m_ir.values[v];
+        if (gen_by_const(value)) {
+            m_output << "    mov " << operand(v) << ", rax\n";
+            return;
+        }
+        m_output << "    mov rax, " << operand(value.a) << "\n";
+        m_output << "    mov rbx, " << operand(value.b) << "\n";
+        switch (value.op) {
+            case IrOp::add:
+                m_output << "    add rax, rbx\n";
+                break;
+            case IrOp::sub:
+                m_output << "    sub rax, rbx\n";
+                break;
+            case IrOp::mul:
+                m_output << "    mul rbx\n";
+                break;
+            case IrOp::div:
+                m_output << "    xor rdx, rdx\n";
+                m_output << "    div rbx\n";
+                break;
+            default:
+                assert(false); // Unreachable
+                break;
+        }
+        m_output << "    mov " << operand(v) << ", rax\n";
     }
 
-    void gen_scope(const NodeScope* scope) {
-        begin_scope();
-        for (const NodeStmt* stmt: scope->stmts) {
-            gen_stmt(stmt);
+    // rax = a * b or a / b when b is a constant these have a cheaper form for
+    bool gen_by_const(const IrValue& value) {
+        const IrValue& rhs = m_ir.values[value.b];
+        if ((value.op != IrOp::mul && value.op != IrOp::div) || rhs.op != IrOp::const_ || rhs.constant() == 0) {
+            return false;
+        }
+        const std::uint64_t c = rhs.constant();
+        if (std::has_single_bit(c)) {
+            m_output << "    mov rax, " << operand(value.a) << "\n";
+            m_output << "    " << (value.op == IrOp::mul ? "shl" : "shr") << " rax, " << std::countr_zero(c) << "\n";
+            return true;
+        }
+        if (value.op == IrOp::mul) {
+            return false;
         }
-        end_scope();
+        const DivMagic magic = div_magic(c);
+        m_output << "    mov rax, " << operand(value.a) << "\n";
+        if (magic.pre_shift != 0) {
+            m_output << "    shr rax, " << magic.pre_shift << "\n";
+        }
+        m_output << "    mov rbx, " << magic.multiplier << "\n";
+        m_output << "    mul rbx\n";
+        if (magic.add) {
+            m_output << "    mov rax, " << operand(value.a) << "\n";
+            m_output << "    sub rax, rdx\n";
+            m_output << "    shr rax, 1\n";
+            m_output << "    add rax, rdx\n";
+            m_output << "    shr rax, " << magic.post_shift << "\n";
+            return true;
+        }
+        m_output << "    shr rdx, " << magic.post_shift << "\n";
+        m_output << "    mov rax, rdx\n";
+        return true;
     }
 
-    void gen_stmt_set(const NodeStmtSet* stmt) {
-        struct StmtSetVisitor {
-            GeneratorWin& gen;
-            void operator()(const NodeStmtSetExpr* stmt_set_expr) const {
-                auto it = std::find_if(gen.m_vars.cbegin(), gen.m_vars.cend(), [&](const Var& var) {
-                    return var.name == stmt_set_expr->ident.value.value();
-                });
-                if (it == gen.m_vars.cend()) {
-                    std::cerr << "Undeclared identifier used '" << stmt_set_expr->ident.value.value() << "'\n";
-                    exit(EXIT_FAILURE);
-                }
-                gen.gen_expr(stmt_set_expr->expr);
-                gen.pop("rax");
-                gen.m_output << "    add rsp, " << (gen.m_stack_size - (*it).stack_loc - 1) * 8 + 8 << '\n';
-                gen.m_output << "    push rax\n";
-                gen.m_output << "    sub rsp, " << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << '\n';
-            }
-
-            void operator()(const NodeStmtSetAdd* stmt_set_add) const {
-                auto it = std::find_if(gen.m_vars.cbegin(), gen.m_vars.cend(), [&](const Var& var) {
-                    return var.name == stmt_set_add->ident.value.value();
-                });
-                if (it == gen.m_vars.cend()) {
-                    std::cerr << "Undeclared identifier used '" << stmt_set_add->ident.value.value() << "'\n";
-                    exit(EXIT_FAILURE);
-                }
-                gen.gen_expr(stmt_set_add->expr);
-                gen.pop("rax");
-                gen.m_output << "    add QWORD [rsp+" << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << "], rax\n";
-            }
-
-            void operator()(const NodeStmtSetMulti* stmt_set_add) const {
-                auto it = std::find_if(gen.m_vars.cbegin(), gen.m_vars.cend(), [&](const Var& var) {
-                    return var.name == stmt_set_add->ident.value.value();
-                });
-                if (it == gen.m_vars.cend()) {
-                    std::cerr << "Undeclared identifier used '" << stmt_set_add->ident.value.value() << "'\n";
-                    exit(EXIT_FAILURE);
+    void gen_term(const BlockId block) {
+        const IrTerm& term = m_ir.blocks[block].term;
+        switch (term.kind) {
+            case TermKind::jump: {
+                const IrBlock& succ = m_ir.blocks[term.target];
+                const std::uint32_t arg = m_ir.pred_index(term.target, block);
+                for (ValueId v = succ.first; v < succ.end() && m_ir.values[v].op == IrOp::phi; v++) {
+                    m_output << "    mov rax, " << operand(m_ir.phi_args[m_ir.values[v].a + arg]) << "\n";
+                    m_output << "    mov " << operand(v) << ", rax\n";
                 }
-                gen.gen_expr(stmt_set_add->expr);
-                gen.pop("rbx");
-                gen.m_output << "    mov rax, QWORD [rsp+" << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << "]\n";
-                gen.m_output << "    mul rbx\n";
-                gen.m_output << "    mov QWORD [rsp+" << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << "], rax\n";
-            }
-
-            void operator()(const NodeStmtSetSub* stmt_set_add) const {
-                auto it = std::find_if(gen.m_vars.cbegin(), gen.m_vars.cend(), [&](const Var& var) {
-                    return var.name == stmt_set_add->ident.value.value();
-                });
-                if (it == gen.m_vars.cend()) {
-                    std::cerr << "Undeclared identifier used '" << stmt_set_add->ident.value.value() << "'\n";
-                    exit(EXIT_FAILURE);
-                }
-                gen.gen_expr(stmt_set_add->expr);
-                gen.pop("rax");
-                gen.m_output << "    sub QWORD [rsp+" << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << "], rax\n";
-            }
-
-            void operator()(const NodeStmtSetDiv* stmt_set_add) const {
-                auto it = std::find_if(gen.m_vars.cbegin(), gen.m_vars.cend(), [&](const Var& var) {
-                    return var.name == stmt_set_add->ident.value.value();
-                });
-                if (it == gen.m_vars.cend()) {
-                    std::cerr << "Undeclared identifier used '" << stmt_set_add->ident.value.value() << "'\n";
-                    exit(EXIT_FAILURE);
-                }
-                gen.gen_expr(stmt_set_add->expr);
-                gen.pop("rbx");
-                gen.m_output << "    mov rax, QWORD [rsp+" << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << "]\n";
-                gen.m_output << "    xor rdx, rdx\n";
-                gen.m_output << "    div rbx\n";
-                gen.m_output << "    mov QWORD [rsp+" << (gen.m_stack_size - (*it).stack_loc - 1) * 8 << "], rax\n";
-            }
-        };
-
-        StmtSetVisitor visitor{ .gen = *this };
-        std::visit(visitor, stmt->var);
+                m_output << "    jmp label" << term.target << "\n";
+                break;
+            }
+            case TermKind::branch:
+                m_output << "    mov rax, " << operand(term.value) << "\n";
+                m_output << "    test rax, rax\n";
+                m_output << "    jz label" << term.alt << "\n";
+                m_output << "    jmp label" << term.target << "\n";
+                break;
+            case TermKind::exit:
+                m_output << "    mov rcx, " << operand(term.value) << "\n";
+                m_output << "    sub rsp, 28h\n";
+                m_output << "    call ExitProcess\n";
+                break;
+        }
     }
 
-    void gen_stmt(const NodeStmt* stmt) {
-        struct StmtVisitor {
-            GeneratorWin& gen;
-            void operator()(const NodeStmtExit* stmt_exit) const {
-                gen.gen_expr(stmt_exit->expr);
-                gen.pop("rcx");
-                gen.m_output << "    sub rsp, 28h\n";
-                gen.m_output << "    call ExitProcess\n";
-            }
-
-            void operator()(const NodeStmtLet* stmt_let) const {
-                auto it = std::find_if(gen.m_vars.cbegin(), gen.m_vars.cend(), [&](const Var& var) {
-                    return var.name == stmt_let->ident.value.value();
-                });
-                if(it != gen.m_vars.cend()) {
-                    std::cerr << "Identifier already used: " << stmt_let->ident.value.value() << std::endl;
-                    exit(EXIT_FAILURE);
-                }
-                gen.m_vars.push_back({ .name = stmt_let->ident.value.value(), .stack_loc = gen.m_stack_size });
-                gen.gen_expr(stmt_let->expr);
-            }
-
-            void operator()(const NodeStmtSet* stmt_set) const {
-                gen.gen_stmt_set(stmt_set);
-            }
+    void gen_prog() {
+        m_output << "extern ExitProcess\n\nglobal _start\nsection .text\n_start:\n";
 
-            void operator()(const NodeScope* scope) const {
-                gen.gen_scope(scope);
+        size_t slot_count = 0;
+        for (ValueId v = 0; v < m_ir.values.size(); v++) {
+            if (m_ir.values[v].op != IrOp::const_) {
+                m_slots[v] = slot_count++;
             }
+        }
+        if (slot_count > 0) {
+            m_output << "    sub rsp, " << slot_count * 8 << "\n";
+        }
 
-            void operator()(const NodeStmtIf* stmt_if) {
-                gen.gen_expr(stmt_if->expr);
-                gen.pop("rax");
-                std::string label = gen.create_label();
-                gen.m_output << "    test rax, rax\n";
-                gen.m_output << "    jz " << label << "\n";
-                gen.gen_scope(stmt_if->scope);
-                gen.m_output << label << ":\n";
+        for (BlockId b = 0; b < m_ir.blocks.size(); b++) {
+            const IrBlock& block = m_ir.blocks[b];
+            m_output << "label" << b << ":\n";
+            for (ValueId v = block.first; v < block.end(); v++) {
+                if (m_ir.values[v].is_bin()) {
+                    gen_bin(v);
+                }
             }
-        };
-
-        StmtVisitor visitor{ .gen = *this };
-        std::visit(visitor, stmt->var);
-    }
-
-    [[nodiscard]] std::string gen_prog() {
-        m_output << "extern ExitProcess\n\nglobal _start\nsection .text\n_start:\n";
-
-        for (const NodeStmt* stmt : m_prog.stmts) {
-            gen_stmt(stmt);
+            gen_term(b);
         }
-
-        m_output << "    sub rsp, 28h\n";
-        m_output << "    mov ecx, 0\n";
-        m_output << "    call ExitProcess\n";
-        return m_output.str();
     }
 private:
 
-    void push(const std::string& reg) {
-        m_output << "    push " << reg << "\n";
-        m_stack_size++;
-    }
-
-    void pop(const std::string& reg) {
-        m_output << "    pop " << reg << "\n";
-        m_stack_size--;
-    }
-
-    void begin_scope() {
-        m_scopes.push_back(m_vars.size());
-    }
-
-    void end_scope() {
-        size_t pop_count = m_vars.size() - m_scopes.back();
-        m_output << "    add rsp, " << pop_count * 8 << '\n';
-        m_stack_size -= pop_count;
-        for (size_t i = 0; i < pop_count; i++) {
-            m_vars.pop_back();
+    [[nodiscard]] Operand operand(const ValueId v) const {
+        const IrValue& value = m_ir.values[v];
+        if (value.op == IrOp::const_) {
+            return Operand::make_imm(static_cast<std::int64_t>(value.constant()));
         }
-        m_scopes.pop_back();
-    }
-
-    std::string create_label() {
-        return "label" + std::to_string(m_label_count++);
+        return Operand::make_stack(m_slots[v] * 8);
     }
 
-    struct Var {
-        std::string name;
-        size_t stack_loc;
-    };
-
-    const NodeProg m_prog;
-    std::stringstream m_output;
-    size_t m_stack_size = 0;
-    std::vector<Var> m_vars {};
-    std::vector<size_t> m_scopes {};
-    size_t m_label_count = 0;
-};
\ No newline at end of file
+    const IrProg& m_ir;
+    OutputBuffer& m_output;
+    std::pmr::vector<size_t> m_slots; // by value
+};
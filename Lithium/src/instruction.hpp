@@ -0,0 +1,203 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <string_view>
+
+#include "output_buffer.hpp"
+
+// The x86-64 subset the generator emits, as records instead of text, so
+// passes like the peephole optimizer can inspect and rewrite it
+
+enum class Reg : std::uint8_t {
+    rax,
+    rcx,
+    rdx,
+    rbx,
+    rsp,
+    rbp,
+    rsi,
+    rdi,
+    r8,
+    r9,
+    r10,
+    r11,
+    r12,
+    r13,
+    r14,
+    r15
+};
+
+inline std::string_view reg_name(const Reg reg) {
+    static constexpr std::array<std::string_view, 16> names {
+        "rax", "rcx", "rdx", "rbx", "rsp", "rbp", "rsi", "rdi",
+        "r8", "r9", "r10", "r11", "r12", "r13", "r14", "r15",
+    };
+    return names[static_cast<size_t>(reg)];
+}
+
+inline std::string_view reg_name32(const Reg reg) {
+    static constexpr std::array<std::string_view, 16> names {
+        "eax", "ecx", "edx", "ebx", "esp", "ebp", "esi", "edi",
+        "r8d", "r9d", "r10d", "r11d", "r12d", "r13d", "r14d", "r15d",
+    };
+    return names[static_cast<size_t>(reg)];
+}
+
+// Source or destination of an instruction: a register, a stack slot given
+// as a displacement from rsp or the frame base rbp, an immediate, a jump
+// target, or the address reg + reg * scale that lea computes
+struct Operand {
+    enum class Kind : std::uint8_t {
+        none,
+        reg,
+        stack,
+        imm,
+        label,
+        scaled
+    };
+
+    Kind kind = Kind::none;
+    Reg reg = Reg::rax; // reg, stack: the base, scaled
+    std::int64_t value = 0; // stack: the displacement, imm: the value, label: its number, scaled: the scale
+
+    static Operand make_reg(const Reg reg) {
+        return { .kind = Kind::reg, .reg = reg, .value = 0 };
+    }
+
+    static Operand make_stack(const size_t offset) {
+        return { .kind = Kind::stack, .reg = Reg::rsp, .value = static_cast<std::int64_t>(offset) };
+    }
+
+    // The slot at displacement from the frame base, which lies below it
+    static Operand make_frame(const std::int64_t displacement) {
+        return { .kind = Kind::stack, .reg = Reg::rbp, .value = displacement };
+    }
+
+    static Operand make_imm(const std::int64_t value) {
+        return { .kind = Kind::imm, .reg = Reg::rax, .value = value };
+    }
+
+    static Operand make_label(const size_t label) {
+        return { .kind = Kind::label, .reg = Reg::rax, .value = static_cast<std::int64_t>(label) };
+    }
+
+    static Operand make_scaled(const Reg reg, const std::int64_t scale) {
+        return { .kind = Kind::scaled, .reg = reg, .value = scale };
+    }
+
+    [[nodiscard]] bool is_reg(const Reg r) const {
+        return kind == Kind::reg && reg == r;
+    }
+
+    [[nodiscard]] bool is_mem() const {
+        return kind == Kind::stack;
+    }
+
+    [[nodiscard]] bool is_imm32() const {
+        return kind == Kind::imm && value >= INT32_MIN && value <= INT32_MAX;
+    }
+
+    friend bool operator==(const Operand&, const Operand&) = default;
+};
+
+inline OutputBuffer& operator<<(OutputBuffer& out, const Operand& operand) {
+    switch (operand.kind) {
+        case Operand::Kind::none:
+            return out;
+        case Operand::Kind::reg:
+            return out << reg_name(operand.reg);
+        case Operand::Kind::stack:
+            if (operand.value < 0) {
+                return out << "QWORD [" << reg_name(operand.reg) << "-" << -operand.value << "]";
+            }
+            return out << "QWORD [" << reg_name(operand.reg) << "+" << operand.value << "]";
+        case Operand::Kind::imm:
+            return out << operand.value;
+        case Operand::Kind::label:
+            return out << "label" << operand.value;
+        case Operand::Kind::scaled:
+            return out << "[" << reg_name(operand.reg) << "+" << reg_name(operand.reg) << "*" << operand.value << "]";
+    }
+    return out;
+}
+
+enum class Opcode : std::uint8_t {
+    mov, // dst = src
+    add, // dst += src
+    sub, // dst -= src
+    imul, // dst *= src, low 64 bits
+    mul, // rdx:rax = rax * src, unsigned
+    div, // rdx:rax / src, unsigned
+    shl, // dst <<= src, an immediate
+    shr, // dst >>= src, an immediate, unsigned
+    lea, // dst = src, a scaled address
+    clear, // dst = 0, as a 32-bit xor
+    test, // flags of dst & src
+    push, // src
+    pop, // dst
+    jmp, // to dst
+    jz, // to dst
+    label, // dst
+    syscall,
+    ret,
+    comment // dst.value is the IR block starting here, only with -v
+};
+
+struct Instr {
+    Opcode op;
+    Operand dst;
+    Operand src;
+
+    [[nodiscard]] bool is_jump() const {
+        return op == Opcode::jmp || op == Opcode::jz;
+    }
+};
+
+// One line of NASM
+inline OutputBuffer& operator<<(OutputBuffer& out, const Instr& instr) {
+    switch (instr.op) {
+        case Opcode::mov:
+            return out << "    mov " << instr.dst << ", " << instr.src << "\n";
+        case Opcode::add:
+            return out << "    add " << instr.dst << ", " << instr.src << "\n";
+        case Opcode::sub:
+            return out << "    sub " << instr.dst << ", " << instr.src << "\n";
+        case Opcode::imul:
+            if (instr.src.kind == Operand::Kind::imm) {
+                return out << "    imul " << instr.dst << ", " << instr.dst << ", " << instr.src << "\n";
+            }
+            return out << "    imul " << instr.dst << ", " << instr.src << "\n";
+        case Opcode::mul:
+            return out << "    mul " << instr.src << "\n";
+        case Opcode::div:
+            return out << "    div " << instr.src << "\n";
+        case Opcode::shl:
+            return out << "    shl " << instr.dst << ", " << instr.src << "\n";
+        case Opcode::shr:
+            return out << "    shr " << instr.dst << ", " << instr.src << "\n";
+        case Opcode::lea:
+            return out << "    lea " << instr.dst << ", " << instr.src << "\n";
+        case Opcode::clear:
+            return out << "    xor " << reg_name32(instr.dst.reg) << ", " << reg_name32(instr.dst.reg) << "\n";
+        case Opcode::test:
+            return out << "    test " << instr.dst << ", " << instr.src << "\n";
+        case Opcode::push:
+            return out << "    push " << instr.src << "\n";
+        case Opcode::pop:
+            return out << "    pop " << instr.dst << "\n";
+        case Opcode::jmp:
+            return out << "    jmp " << instr.dst << "\n";
+        case Opcode::jz:
+            return out << "    jz " << instr.dst << "\n";
+        case Opcode::label:
+            return out << instr.dst << ":\n";
+        case Opcode::syscall:
+            return out << "    syscall\n";
+        case Opcode::ret:
+            return out << "    ret\n";
+        case Opcode::comment:
+            return out << "    ;; bb" << instr.dst.value << "\n";
+    }
+    return out;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+#include <memory_resource>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Dense id for an interned identifier; ids count up from 0 in order of first appearance.
+using Symbol = std::uint32_t;
+
+// Maps each distinct identifier to a Symbol so that later stages compare and
+// index by integer instead of by string. Names are views into the source.
+class Interner {
+public:
+    explicit Interner(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : m_ids(resource), m_names(resource)
+    {
+    }
+
+    Symbol intern(const std::string_view name) {
+        const auto [it, inserted] = m_ids.try_emplace(name, static_cast<Symbol>(m_names.size()));
+        if (inserted) {
+            m_names.push_back(name);
+        }
+        return it->second;
+    }
+
+    [[nodiscard]] std::string_view name(const Symbol symbol) const {
+        return m_names[symbol];
+    }
+
+    [[nodiscard]] size_t size() const {
+        return m_names.size();
+    }
+
+private:
+    std::pmr::unordered_map<std::string_view, Symbol> m_ids;
+    std::pmr::vector<std::string_view> m_names;
+};
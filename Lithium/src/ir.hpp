@@ -0,0 +1,577 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <iostream>
+#include <memory_resource>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <string_view>
+
+#include "interner.hpp"
+#include "parser.hpp"
+#include "scoped_table.hpp"
+
+// SSA intermediate representation between the AST and the backends. A
+// program is a list of basic blocks, each a contiguous run of values ended
+// by a terminator; values are integer ops, constants and phi nodes, and
+// refer to each other by 32-bit id. Variables disappear: a read is the
+// value last assigned, and where control flow merges a phi picks it by
+// predecessor.
+//
+// The language only branches forward, so blocks are created, and stored,
+// in a topological order, and value ids increase along every path. Every
+// branch target is built with a single predecessor, and no pass gives a
+// branch a target with phis, so no edge into a phi's block is critical and
+// backends can put phi copies at the end of predecessors.
+using ValueId = std::uint32_t;
+using BlockId = std::uint32_t;
+
+enum class IrOp : std::uint8_t {
+    const_,
+    add,
+    sub,
+    mul,
+    div, // unsigned, traps on zero
+    phi
+};
+
+inline IrOp ir_op(const BinOp op) {
+    switch (op) {
+        case BinOp::add:
+            return IrOp::add;
+        case BinOp::sub:
+            return IrOp::sub;
+        case BinOp::mul:
+            return IrOp::mul;
+        case BinOp::div:
+            return IrOp::div;
+    }
+    return IrOp::add;
+}
+
+struct IrValue {
+    IrOp op;
+    std::uint32_t a; // bin: lhs value, const_: low half, phi: first argument in IrProg::phi_args
+    std::uint32_t b; // bin: rhs value, const_: high half
+
+    static IrValue make_const(const std::uint64_t value) {
+        return { .op = IrOp::const_, .a = static_cast<std::uint32_t>(value), .b = static_cast<std::uint32_t>(value >> 32) };
+    }
+
+    static IrValue make_bin(const IrOp op, const ValueId lhs, const ValueId rhs) {
+        return { .op = op, .a = lhs, .b = rhs };
+    }
+
+    static IrValue make_phi(const std::uint32_t first_arg) {
+        return { .op = IrOp::phi, .a = first_arg, .b = 0 };
+    }
+
+    [[nodiscard]] std::uint64_t constant() const {
+        return static_cast<std::uint64_t>(b) << 32 | a;
+    }
+
+    [[nodiscard]] bool is_bin() const {
+        return op != IrOp::const_ && op != IrOp::phi;
+    }
+};
+
+static_assert(sizeof(IrValue) == 12);
+
+enum class TermKind : std::uint8_t {
+    jump, // to target
+    branch, // to target if value is nonzero, else to alt
+    exit // with value as the exit code
+};
+
+struct IrTerm {
+    TermKind kind = TermKind::jump;
+    ValueId value = 0;
+    BlockId target = 0;
+    BlockId alt = 0;
+};
+
+struct IrBlock {
+    std::uint32_t first; // values [first, first + count), phis first
+    std::uint32_t count;
+    std::uint32_t first_pred; // predecessors [first_pred, first_pred + pred_count) in IrProg::preds
+    std::uint32_t pred_count;
+    IrTerm term;
+
+    [[nodiscard]] std::uint32_t end() const {
+        return first + count;
+    }
+};
+
+struct IrProg {
+    explicit IrProg(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : values(resource), blocks(resource), preds(resource), phi_args(resource)
+    {
+    }
+
+    std::pmr::vector<IrValue> values;
+    std::pmr::vector<IrBlock> blocks;
+    std::pmr::vector<BlockId> preds;
+    std::pmr::vector<ValueId> phi_args; // a phi has one per predecessor of its block, in the same order
+
+    // Position of pred among the predecessors of block, which is where the
+    // arguments of block's phis for that edge are
+    [[nodiscard]] std::uint32_t pred_index(const BlockId block, const BlockId pred) const {
+        const IrBlock& b = blocks[block];
+        for (std::uint32_t i = 0; i < b.pred_count; i++) {
+            if (preds[b.first_pred + i] == pred) {
+                return i;
+            }
+        }
+        return b.pred_count;
+    }
+};
+
+inline std::ostream& operator<<(std::ostream& out, const IrProg& ir) {
+    static constexpr std::array<std::string_view, 6> names { "const", "add", "sub", "mul", "div", "phi" };
+    for (BlockId b = 0; b < ir.blocks.size(); b++) {
+        const IrBlock& block = ir.blocks[b];
+        out << "bb" << b << ":";
+        for (std::uint32_t i = 0; i < block.pred_count; i++) {
+            out << (i == 0 ? " ; preds " : ", ") << "bb" << ir.preds[block.first_pred + i];
+        }
+        out << "\n";
+        for (ValueId v = block.first; v < block.end(); v++) {
+            const IrValue& value = ir.values[v];
+            out << "    %" << v << " = ";
+            switch (value.op) {
+                case IrOp::const_:
+                    out << value.constant();
+                    break;
+                case IrOp::phi:
+                    out << "phi";
+                    for (std::uint32_t i = 0; i < block.pred_count; i++) {
+                        out << (i == 0 ? " " : ", ") << "[bb" << ir.preds[block.first_pred + i] << ": %" << ir.phi_args[value.a + i] << "]";
+                    }
+                    break;
+                default:
+                    out << names[static_cast<size_t>(value.op)] << " %" << value.a << ", %" << value.b;
+                    break;
+            }
+            out << "\n";
+        }
+        switch (block.term.kind) {
+            case TermKind::jump:
+                out << "    jmp bb" << block.term.target << "\n";
+                break;
+            case TermKind::branch:
+                out << "    br %" << block.term.value << ", bb" << block.term.target << ", bb" << block.term.alt << "\n";
+                break;
+            case TermKind::exit:
+                out << "    exit %" << block.term.value << "\n";
+                break;
+        }
+    }
+    return out;
+}
+
+// Builds the IR from the AST in one walk in execution order, with the
+// scope rules the generators used to apply: a let may not reuse a name that
+// is in scope, and its variable ends with the enclosing scope. Those errors
+// are reported here and stop compilation.
+//
+// Each variable's current value is kept in a ScopedTable. Inside an if, every
+// assignment also goes to an undo log; when an arm ends the final values of
+// the variables it assigned are recorded and the log is rolled back, so the
+// next arm starts from the values before the if. Where the arms meet, a
+// variable that differs between them gets a phi. Code after an exit goes
+// to a block without predecessors.
+class IrBuilder {
+public:
+    // The IR is allocated from resource
+    IrBuilder(const NodeProg& prog, const Interner& symbols, std::string srcName, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : m_prog(prog), m_symbols(symbols), m_srcName(std::move(srcName)), m_ir(resource), m_defs(symbols.size(), resource),
+          m_log(resource), m_ifs(resource), m_arm_ends(resource), m_merges(resource),
+          m_arm_stamp(symbols.size(), resource), m_phi_block(symbols.size(), no_block, resource), m_phi_slot(symbols.size(), resource), m_phi_syms(resource),
+          m_phi_scratch(resource), m_tasks(resource), m_expr_tasks(resource), m_operands(resource), m_need(resource) {
+    }
+
+    void error(const std::string& msg) const {
+        std::cerr << m_srcName << ": " << msg << std::endl;
+    }
+
+    [[nodiscard]] IrProg build() {
+        label_exprs();
+        m_cur = new_block(0, 0);
+        push_stmts(m_prog.body);
+        while (!m_tasks.empty()) {
+            const Task task = m_tasks.back();
+            m_tasks.pop_back();
+            switch (task.kind) {
+                case TaskKind::stmt:
+                    build_stmt(m_prog.stmts[task.index]);
+                    break;
+                case TaskKind::end_scope:
+                    m_defs.end_scope();
+                    break;
+                case TaskKind::if_scope_done:
+                    end_cond_arm(m_prog.ifs[task.index].pred);
+                    break;
+                case TaskKind::if_pred:
+                    build_if_pred(task.index);
+                    break;
+                case TaskKind::elif_scope_done:
+                    end_cond_arm(m_prog.preds[task.index].pred);
+                    break;
+                case TaskKind::else_scope_done:
+                    end_arm();
+                    join();
+                    break;
+            }
+        }
+        terminate({ .kind = TermKind::exit, .value = add_value(IrValue::make_const(0)) });
+        return std::move(m_ir);
+    }
+
+private:
+    static constexpr BlockId no_block = UINT32_MAX;
+
+    enum class TaskKind : std::uint8_t {
+        stmt, // index into NodeProg::stmts
+        end_scope,
+        if_scope_done, // index of the NodeStmtIf
+        if_pred, // index of the NodeIfPred
+        elif_scope_done, // index of the NodeIfPred
+        else_scope_done
+    };
+
+    struct Task {
+        TaskKind kind;
+        NodeIndex index = 0;
+    };
+
+    struct LogEntry {
+        Symbol symbol;
+        std::optional<ValueId> prev;
+    };
+
+    // An if chain whose arms are being built
+    struct IfFrame {
+        BlockId branch; // block whose false edge is still to be created
+        size_t log_mark; // size of m_log when the if began
+        size_t first_arm_end; // into m_arm_ends
+        size_t first_merge; // into m_merges
+    };
+
+    // The value a variable had at the end of one arm
+    struct Merge {
+        Symbol symbol;
+        std::uint32_t arm; // predecessor index in the join block
+        ValueId value;
+    };
+
+    enum class ExprStep : std::uint8_t {
+        eval,
+        op, // the bin expr's operands are on m_operands, lhs on top
+        op_swapped // rhs on top
+    };
+
+    struct ExprTask {
+        ExprStep step;
+        NodeIndex index;
+    };
+
+    void build_stmt(const NodeStmt stmt) {
+        switch (stmt.kind) {
+            case StmtKind::exit:
+                terminate({ .kind = TermKind::exit, .value = build_expr(m_prog.exits[stmt.index].expr) });
+                m_cur = new_block(0, 0);
+                break;
+            case StmtKind::let: {
+                const NodeStmtLet& stmt_let = m_prog.lets[stmt.index];
+                if (m_defs.contains(stmt_let.ident)) {
+                    error("Identifier already used: '" + name(stmt_let.ident) + "'");
+                    exit(EXIT_FAILURE);
+                }
+                const ValueId value = build_expr(stmt_let.expr);
+                if (!m_ifs.empty()) {
+                    m_log.push_back({ .symbol = stmt_let.ident, .prev = {} });
+                }
+                m_defs.declare(stmt_let.ident, value);
+                break;
+            }
+            case StmtKind::set: {
+                const NodeStmtSet& stmt_set = m_prog.sets[stmt.index];
+                read(stmt_set.ident); // undeclared target is reported before errors in the expression
+                const ValueId value = build_expr(stmt_set.expr);
+                if (stmt_set.op == SetOp::assign) {
+                    assign(stmt_set.ident, value);
+                }
+                else {
+                    assign(stmt_set.ident, add_value(IrValue::make_bin(ir_op(bin_op(stmt_set.op)), read(stmt_set.ident), value)));
+                }
+                break;
+            }
+            case StmtKind::scope:
+                push_scope(m_prog.scopes[stmt.index]);
+                break;
+            case StmtKind::if_: {
+                const NodeStmtIf& stmt_if = m_prog.ifs[stmt.index];
+                const ValueId cond = build_expr(stmt_if.expr);
+                m_ifs.push_back({ .branch = m_cur, .log_mark = m_log.size(), .first_arm_end = m_arm_ends.size(), .first_merge = m_merges.size() });
+                begin_arm(cond);
+                m_tasks.push_back({ .kind = TaskKind::if_scope_done, .index = stmt.index });
+                push_scope(m_prog.scopes[stmt_if.scope]);
+                break;
+            }
+        }
+    }
+
+    void build_if_pred(const NodeIndex index) {
+        const NodeIfPred& pred = m_prog.preds[index];
+        switch (pred.kind) {
+            case IfPredKind::elif:
+                m_ifs.back().branch = m_cur;
+                begin_arm(build_expr(pred.expr));
+                m_tasks.push_back({ .kind = TaskKind::elif_scope_done, .index = index });
+                break;
+            case IfPredKind::else_:
+                m_tasks.push_back({ .kind = TaskKind::else_scope_done });
+                break;
+        }
+        push_scope(m_prog.scopes[pred.scope]);
+    }
+
+    // Ends the current block on cond and continues in the block it jumps to
+    // when cond is nonzero; the other target is created by end_cond_arm
+    void begin_arm(const ValueId cond) {
+        const BlockId branch = m_cur;
+        terminate({ .kind = TermKind::branch, .value = cond, .target = no_block, .alt = no_block });
+        m_cur = new_block(add_pred(branch), 1);
+        m_ir.blocks[branch].term.target = m_cur;
+    }
+
+    // After an if or elif arm: continues in its condition's false target,
+    // where the next arm starts, or which falls through to the join
+    void end_cond_arm(const std::optional<NodeIndex> next) {
+        end_arm();
+        const BlockId branch = m_ifs.back().branch;
+        m_cur = new_block(add_pred(branch), 1);
+        m_ir.blocks[branch].term.alt = m_cur;
+        if (next.has_value()) {
+            m_tasks.push_back({ .kind = TaskKind::if_pred, .index = next.value() });
+        }
+        else {
+            end_arm();
+            join();
+        }
+    }
+
+    // Records the values the arm leaves in the variables it assigned, rolls
+    // them back to the values before the if and leaves the block pending a
+    // jump to the join
+    void end_arm() {
+        const IfFrame& frame = m_ifs.back();
+        const auto arm = static_cast<std::uint32_t>(m_arm_ends.size() - frame.first_arm_end);
+        const std::uint32_t stamp = ++m_arm_count;
+        for (size_t i = m_log.size(); i-- > frame.log_mark;) {
+            const Symbol symbol = m_log[i].symbol;
+            // The latest entry for a symbol comes first, while it still holds
+            // the arm's final value. Variables of the arm's own scopes are
+            // already gone.
+            if (m_arm_stamp[symbol] != stamp) {
+                m_arm_stamp[symbol] = stamp;
+                if (m_defs.contains(symbol)) {
+                    m_merges.push_back({ .symbol = symbol, .arm = arm, .value = m_defs.find(symbol).value() });
+                }
+            }
+            m_defs.assign(symbol, m_log[i].prev);
+        }
+        m_log.resize(frame.log_mark);
+        terminate({ .kind = TermKind::jump, .target = no_block });
+        m_arm_ends.push_back(m_cur);
+    }
+
+    // Starts the block where the arms of the innermost if meet, with a phi
+    // for each variable whose value depends on the arm taken
+    void join() {
+        const IfFrame frame = m_ifs.back();
+        m_ifs.pop_back();
+        const auto arm_count = static_cast<std::uint32_t>(m_arm_ends.size() - frame.first_arm_end);
+        const auto first_pred = static_cast<std::uint32_t>(m_ir.preds.size());
+        m_ir.preds.insert(m_ir.preds.end(), m_arm_ends.begin() + static_cast<std::ptrdiff_t>(frame.first_arm_end), m_arm_ends.end());
+        m_cur = new_block(first_pred, arm_count);
+        for (size_t i = frame.first_arm_end; i < m_arm_ends.size(); i++) {
+            m_ir.blocks[m_arm_ends[i]].term.target = m_cur;
+        }
+        m_arm_ends.resize(frame.first_arm_end);
+
+        // Arms that didn't assign a variable pass on its value from before the if
+        m_phi_syms.clear();
+        m_phi_scratch.clear();
+        for (size_t i = frame.first_merge; i < m_merges.size(); i++) {
+            const Merge& merge = m_merges[i];
+            if (m_phi_block[merge.symbol] != m_cur) {
+                m_phi_block[merge.symbol] = m_cur;
+                m_phi_slot[merge.symbol] = static_cast<std::uint32_t>(m_phi_scratch.size());
+                m_phi_syms.push_back(merge.symbol);
+                m_phi_scratch.insert(m_phi_scratch.end(), arm_count, m_defs.find(merge.symbol).value());
+            }
+            m_phi_scratch[m_phi_slot[merge.symbol] + merge.arm] = merge.value;
+        }
+        m_merges.resize(frame.first_merge);
+
+        for (size_t i = 0; i < m_phi_syms.size(); i++) {
+            const auto args = m_phi_scratch.begin() + static_cast<std::ptrdiff_t>(i * arm_count);
+            if (std::all_of(args, args + arm_count, [&](const ValueId arg) { return arg == args[0]; })) {
+                if (args[0] != m_defs.find(m_phi_syms[i]).value()) {
+                    assign(m_phi_syms[i], args[0]);
+                }
+                continue;
+            }
+            const ValueId phi = add_value(IrValue::make_phi(static_cast<std::uint32_t>(m_ir.phi_args.size())));
+            m_ir.phi_args.insert(m_ir.phi_args.end(), args, args + arm_count);
+            assign(m_phi_syms[i], phi);
+        }
+    }
+
+    // Emits the ops of an expression tree and returns the value it computes.
+    // Of two operands the one needing more registers goes first (Sethi-
+    // Ullman), which keeps fewer values live at once for the allocators.
+    // Variables and literals need none: a variable is its current value and
+    // the backends take literals as immediates.
+    ValueId build_expr(const NodeIndex root) {
+        m_expr_tasks.push_back({ .step = ExprStep::eval, .index = root });
+        while (!m_expr_tasks.empty()) {
+            const ExprTask task = m_expr_tasks.back();
+            m_expr_tasks.pop_back();
+            const NodeExpr& expr = m_prog.exprs[task.index];
+            switch (task.step) {
+                case ExprStep::eval:
+                    switch (expr.kind) {
+                        case ExprKind::int_lit:
+                            m_operands.push_back(add_value(IrValue::make_const(expr.int_lit())));
+                            break;
+                        case ExprKind::ident:
+                            m_operands.push_back(read(expr.ident()));
+                            break;
+                        case ExprKind::bin:
+                            if (m_need[expr.rhs] > m_need[expr.lhs]) {
+                                m_expr_tasks.push_back({ .step = ExprStep::op, .index = task.index });
+                                m_expr_tasks.push_back({ .step = ExprStep::eval, .index = expr.lhs });
+                                m_expr_tasks.push_back({ .step = ExprStep::eval, .index = expr.rhs });
+                            }
+                            else {
+                                m_expr_tasks.push_back({ .step = ExprStep::op_swapped, .index = task.index });
+                                m_expr_tasks.push_back({ .step = ExprStep::eval, .index = expr.rhs });
+                                m_expr_tasks.push_back({ .step = ExprStep::eval, .index = expr.lhs });
+                            }
+                            break;
+                    }
+                    break;
+                case ExprStep::op:
+                case ExprStep::op_swapped: {
+                    ValueId lhs = m_operands.back();
+                    m_operands.pop_back();
+                    ValueId rhs = m_operands.back();
+                    if (task.step == ExprStep::op_swapped) {
+                        std::swap(lhs, rhs);
+                    }
+                    m_operands.back() = add_value(IrValue::make_bin(ir_op(expr.op), lhs, rhs));
+                    break;
+                }
+            }
+        }
+        const ValueId value = m_operands.back();
+        m_operands.pop_back();
+        return value;
+    }
+
+    // Sethi-Ullman numbers, by expr. Nodes only refer to lower indices, so
+    // one pass in index order sees operands first.
+    void label_exprs() {
+        m_need.resize(m_prog.exprs.size());
+        for (size_t i = 0; i < m_prog.exprs.size(); i++) {
+            const NodeExpr& expr = m_prog.exprs[i];
+            if (expr.kind != ExprKind::bin) {
+                m_need[i] = 0;
+                continue;
+            }
+            const std::uint8_t lhs = m_need[expr.lhs];
+            const std::uint8_t rhs = m_need[expr.rhs];
+            m_need[i] = lhs == rhs ? static_cast<std::uint8_t>(std::min(lhs + 1, UINT8_MAX)) : std::max(lhs, rhs);
+        }
+    }
+
+    ValueId read(const Symbol ident) {
+        const std::optional<ValueId>& value = m_defs.find(ident);
+        if (!value.has_value()) {
+            error("Undeclared identifier used '" + name(ident) + "'");
+            exit(EXIT_FAILURE);
+        }
+        return value.value();
+    }
+
+    void assign(const Symbol ident, const ValueId value) {
+        if (!m_ifs.empty()) {
+            m_log.push_back({ .symbol = ident, .prev = m_defs.find(ident) });
+        }
+        m_defs.assign(ident, value);
+    }
+
+    ValueId add_value(const IrValue& value) {
+        m_ir.values.push_back(value);
+        m_ir.blocks[m_cur].count++;
+        return static_cast<ValueId>(m_ir.values.size() - 1);
+    }
+
+    // New blocks always come last, so the current block is the last one and
+    // its values stay contiguous
+    BlockId new_block(const std::uint32_t first_pred, const std::uint32_t pred_count) {
+        m_ir.blocks.push_back({ .first = static_cast<std::uint32_t>(m_ir.values.size()), .count = 0, .first_pred = first_pred, .pred_count = pred_count, .term = {} });
+        return static_cast<BlockId>(m_ir.blocks.size() - 1);
+    }
+
+    std::uint32_t add_pred(const BlockId pred) {
+        m_ir.preds.push_back(pred);
+        return static_cast<std::uint32_t>(m_ir.preds.size() - 1);
+    }
+
+    void terminate(const IrTerm& term) {
+        m_ir.blocks[m_cur].term = term;
+    }
+
+    void push_scope(const NodeScope& scope) {
+        m_defs.begin_scope();
+        m_tasks.push_back({ .kind = TaskKind::end_scope });
+        push_stmts(scope);
+    }
+
+    void push_stmts(const NodeScope& scope) {
+        for (std::uint32_t i = scope.first + scope.count; i-- > scope.first;) {
+            m_tasks.push_back({ .kind = TaskKind::stmt, .index = i });
+        }
+    }
+
+    [[nodiscard]] std::string name(const Symbol symbol) const {
+        return std::string(m_symbols.name(symbol));
+    }
+
+    const NodeProg& m_prog;
+    const Interner& m_symbols;
+    const std::string m_srcName;
+    IrProg m_ir;
+    BlockId m_cur = 0;
+    ScopedTable<ValueId> m_defs; // current value of each variable
+    std::pmr::vector<LogEntry> m_log; // assignments inside ifs, for rolling back arms
+    std::pmr::vector<IfFrame> m_ifs;
+    std::pmr::vector<BlockId> m_arm_ends; // last block of each finished arm of the open ifs
+    std::pmr::vector<Merge> m_merges;
+    std::pmr::vector<std::uint32_t> m_arm_stamp; // by Symbol: last arm that recorded it
+    std::pmr::vector<BlockId> m_phi_block; // by Symbol: join that last gathered it
+    std::pmr::vector<std::uint32_t> m_phi_slot; // by Symbol: its arguments in m_phi_scratch
+    std::pmr::vector<Symbol> m_phi_syms;
+    std::pmr::vector<ValueId> m_phi_scratch;
+    std::uint32_t m_arm_count = 0;
+    std::pmr::vector<Task> m_tasks;
+    std::pmr::vector<ExprTask> m_expr_tasks;
+    std::pmr::vector<ValueId> m_operands;
+    std::pmr::vector<std::uint8_t> m_need; // Sethi-Ullman number, by expr
+};
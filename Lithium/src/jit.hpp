@@ -0,0 +1,37 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory_resource>
+#include <vector>
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+// Runs machine code generated with Generator::ExitMode::ret in this process
+// and returns its exit value. The code is copied to fresh pages that are
+// made executable only once they are no longer writable. A division by zero
+// raises SIGFPE here just as it would in the executable.
+inline std::uint64_t run_jit(const std::pmr::vector<std::uint8_t>& code) {
+    const auto page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+    const size_t size = (code.size() + page - 1) / page * page;
+    void* memory = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+        std::cerr << "Error: could not map memory for the program: " << std::strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    std::memcpy(memory, code.data(), code.size());
+    if (mprotect(memory, size, PROT_READ | PROT_EXEC) == -1) {
+        std::cerr << "Error: could not make the program executable: " << std::strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    using Entry = std::uint64_t (*)();
+    const auto entry = reinterpret_cast<Entry>(memory);
+    const std::uint64_t result = entry();
+
+    munmap(memory, size);
+    return result;
+}
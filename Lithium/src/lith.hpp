@@ -0,0 +1,244 @@
+#pragma once
+
+#include <array>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+#include <memory_resource>
+#include <string_view>
+#include <vector>
+
+#include "instruction.hpp"
+#include "output_buffer.hpp"
+
+// The Lith register machine: sixteen 64-bit registers r0 to r15, with r15
+// the stack pointer, and a downward stack of 64-bit words addressed by it.
+// Operands reuse Operand, with the Reg number standing for the Lith
+// register.
+
+enum class LithOp : std::uint8_t {
+    mov, // dst = src
+    add, // dst += src
+    sub, // dst -= src
+    mul, // dst *= src, low 64 bits
+    div, // dst /= src, unsigned, trapping on zero
+    push, // r15 -= 8, then [r15] = src
+    pop, // dst = [r15], then r15 += 8
+    test, // zero flag = (dst & src) == 0
+    jmp, // to dst
+    jz, // to dst if the zero flag is set
+    label, // dst
+    syscall // r0 = 60 exits with r1
+};
+
+struct LithInstr {
+    LithOp op;
+    Operand dst;
+    Operand src;
+};
+
+// A register, an immediate or a label in Lith syntax
+inline OutputBuffer& write_lith_operand(OutputBuffer& out, const Operand& operand) {
+    switch (operand.kind) {
+        case Operand::Kind::reg:
+            return out << 'r' << static_cast<unsigned>(operand.reg);
+        case Operand::Kind::label:
+            return out << "label" << operand.value;
+        default:
+            return out << operand.value;
+    }
+}
+
+// One line of Lith assembly
+inline OutputBuffer& operator<<(OutputBuffer& out, const LithInstr& instr) {
+    static constexpr std::array<std::string_view, 12> names {
+        "mov", "add", "sub", "mul", "div", "push", "pop", "test", "jmp", "jz", "", "syscall",
+    };
+    switch (instr.op) {
+        case LithOp::label:
+            return write_lith_operand(out, instr.dst) << ":\n";
+        case LithOp::syscall:
+            return out << "    syscall\n";
+        case LithOp::push:
+            return write_lith_operand(out << "    push ", instr.src) << '\n';
+        case LithOp::pop:
+        case LithOp::jmp:
+        case LithOp::jz:
+            return write_lith_operand(out << "    " << names[static_cast<size_t>(instr.op)] << ' ', instr.dst) << '\n';
+        default:
+            write_lith_operand(out << "    " << names[static_cast<size_t>(instr.op)] << ' ', instr.dst) << ", ";
+            return write_lith_operand(out, instr.src) << '\n';
+    }
+}
+
+// Binary encoding of Lith, for the VM. Every opcode has one operand form,
+// so the interpreter never decodes one: two registers share a byte (dst in
+// the high nibble), immediates are 32 bits sign-extended or 64 bits, and
+// jumps hold the 32-bit offset of their target from the start of the code.
+// All little endian and unaligned.
+//
+//   mov_rr, add_rr, sub_rr, mul_rr, div_rr, test   op regs
+//   mov_ri32, add_ri32, sub_ri32                   op reg imm32
+//   mov_ri64                                       op reg imm64
+//   push, pop                                      op reg
+//   jmp, jz                                        op target32
+//   syscall                                        op
+enum class LithCode : std::uint8_t {
+    mov_rr,
+    mov_ri32,
+    mov_ri64,
+    add_rr,
+    add_ri32,
+    sub_rr,
+    sub_ri32,
+    mul_rr,
+    div_rr,
+    push,
+    pop,
+    test,
+    jmp,
+    jz,
+    syscall
+};
+
+static constexpr size_t lith_code_count = 15;
+
+// A program in the binary encoding and the stack it needs, in bytes
+struct LithImage {
+    std::pmr::vector<std::uint8_t> code;
+    std::uint64_t stack_size = 0;
+};
+
+// Encodes code, resolving labels once all of them are placed
+class LithAssembler {
+public:
+    explicit LithAssembler(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : m_resource(resource), m_label_pos(resource), m_fixups(resource) {
+    }
+
+    [[nodiscard]] LithImage assemble(const std::pmr::vector<LithInstr>& code, const std::uint64_t stack_size) {
+        LithImage image { .code = std::pmr::vector<std::uint8_t>(m_resource), .stack_size = stack_size };
+        m_out = &image.code;
+        m_label_pos.clear();
+        m_fixups.clear();
+        for (const LithInstr& instr : code) {
+            encode(instr);
+        }
+        for (const Fixup& fixup : m_fixups) {
+            const std::uint32_t target = m_label_pos[fixup.label];
+            std::memcpy(image.code.data() + fixup.pos, &target, sizeof(target));
+        }
+        return image;
+    }
+
+private:
+    struct Fixup {
+        size_t pos; // of the 32-bit target
+        size_t label;
+    };
+
+    void encode(const LithInstr& instr) {
+        switch (instr.op) {
+            case LithOp::mov:
+                if (instr.src.kind != Operand::Kind::imm) {
+                    regs(LithCode::mov_rr, instr.dst, instr.src);
+                }
+                else if (instr.src.is_imm32()) {
+                    reg_imm(LithCode::mov_ri32, instr.dst, instr.src.value, 4);
+                }
+                else {
+                    reg_imm(LithCode::mov_ri64, instr.dst, instr.src.value, 8);
+                }
+                break;
+            case LithOp::add:
+            case LithOp::sub: {
+                const bool add = instr.op == LithOp::add;
+                if (instr.src.kind == Operand::Kind::imm) {
+                    assert(instr.src.is_imm32());
+                    reg_imm(add ? LithCode::add_ri32 : LithCode::sub_ri32, instr.dst, instr.src.value, 4);
+                }
+                else {
+                    regs(add ? LithCode::add_rr : LithCode::sub_rr, instr.dst, instr.src);
+                }
+                break;
+            }
+            case LithOp::mul:
+                regs(LithCode::mul_rr, instr.dst, instr.src);
+                break;
+            case LithOp::div:
+                regs(LithCode::div_rr, instr.dst, instr.src);
+                break;
+            case LithOp::test:
+                regs(LithCode::test, instr.dst, instr.src);
+                break;
+            case LithOp::push:
+                op(LithCode::push);
+                m_out->push_back(reg(instr.src));
+                break;
+            case LithOp::pop:
+                op(LithCode::pop);
+                m_out->push_back(reg(instr.dst));
+                break;
+            case LithOp::jmp:
+            case LithOp::jz:
+                op(instr.op == LithOp::jmp ? LithCode::jmp : LithCode::jz);
+                m_fixups.push_back({ .pos = m_out->size(), .label = static_cast<size_t>(instr.dst.value) });
+                m_out->insert(m_out->end(), 4, 0);
+                break;
+            case LithOp::label: {
+                const auto label = static_cast<size_t>(instr.dst.value);
+                if (label >= m_label_pos.size()) {
+                    m_label_pos.resize(label + 1, 0);
+                }
+                m_label_pos[label] = static_cast<std::uint32_t>(m_out->size());
+                break;
+            }
+            case LithOp::syscall:
+                op(LithCode::syscall);
+                break;
+        }
+    }
+
+    void op(const LithCode code) {
+        m_out->push_back(static_cast<std::uint8_t>(code));
+    }
+
+    static std::uint8_t reg(const Operand& operand) {
+        assert(operand.kind == Operand::Kind::reg);
+        return static_cast<std::uint8_t>(operand.reg);
+    }
+
+    void regs(const LithCode code, const Operand& dst, const Operand& src) {
+        op(code);
+        m_out->push_back(static_cast<std::uint8_t>(reg(dst) << 4 | reg(src)));
+    }
+
+    void reg_imm(const LithCode code, const Operand& dst, const std::int64_t value, const size_t bytes) {
+        op(code);
+        m_out->push_back(reg(dst));
+        for (size_t i = 0; i < bytes; i++) {
+            m_out->push_back(static_cast<std::uint8_t>(static_cast<std::uint64_t>(value) >> (8 * i)));
+        }
+    }
+
+    std::pmr::memory_resource* m_resource;
+    std::pmr::vector<std::uint8_t>* m_out = nullptr;
+    std::pmr::vector<std::uint32_t> m_label_pos; // by label number
+    std::pmr::vector<Fixup> m_fixups;
+};
+
+// The image as a file: "LITH", a 32-bit format version, the 64-bit stack
+// size and the code, little endian
+inline void write_lith_image(OutputBuffer& out, const LithImage& image) {
+    static constexpr std::uint32_t version = 1;
+    std::array<std::uint8_t, 16> header {};
+    std::memcpy(header.data(), "LITH", 4);
+    for (size_t i = 0; i < 4; i++) {
+        header[4 + i] = static_cast<std::uint8_t>(version >> (8 * i));
+    }
+    for (size_t i = 0; i < 8; i++) {
+        header[8 + i] = static_cast<std::uint8_t>(image.stack_size >> (8 * i));
+    }
+    out.append(std::string_view(reinterpret_cast<const char*>(header.data()), header.size()));
+    out.append(std::string_view(reinterpret_cast<const char*>(image.code.data()), image.code.size()));
+}
@@ -0,0 +1,147 @@
+#pragma once
+
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory_resource>
+#include <vector>
+
+#include "lith.hpp"
+
+// Runs a Lith image and returns its exit value, like the executable would.
+//
+// Dispatch is direct threaded where the compiler has computed goto: every
+// handler ends by jumping through the table to the next opcode's handler,
+// so each one gets its own indirect branch for the predictor to learn,
+// where a switch funnels them all through one. Elsewhere it falls back to
+// a switch in a loop. The registers are a local array and pc a local
+// pointer, so they stay out of memory the handlers could alias.
+//
+// The image is trusted to come from LithAssembler: opcodes, registers and
+// jump targets are not checked. Stack accesses are, and a division by zero
+// raises SIGFPE as the x86 backends' div would. instructions, if given,
+// receives the number executed.
+inline std::uint64_t run_lith(const LithImage& image, std::uint64_t* instructions = nullptr) {
+    std::pmr::vector<std::uint8_t> stack(image.stack_size, 0, image.code.get_allocator().resource());
+    std::uint64_t r[16] = {};
+    r[15] = image.stack_size;
+    const std::uint8_t* const code = image.code.data();
+    const std::uint8_t* pc = code;
+    std::uint64_t count = 0;
+    bool zero = false;
+
+    const auto imm32 = [](const std::uint8_t* p) {
+        std::int32_t value;
+        std::memcpy(&value, p, sizeof(value));
+        return static_cast<std::uint64_t>(static_cast<std::int64_t>(value));
+    };
+    const auto target = [code](const std::uint8_t* p) {
+        std::uint32_t offset;
+        std::memcpy(&offset, p, sizeof(offset));
+        return code + offset;
+    };
+    const auto stack_at = [&stack](const std::uint64_t address) {
+        if (stack.size() < 8 || address > stack.size() - 8) {
+            std::cerr << "Error: Lith stack access out of bounds at " << address << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return stack.data() + address;
+    };
+    const auto dst = [](const std::uint8_t* p) { return *p >> 4; };
+    const auto src = [](const std::uint8_t* p) { return *p & 15; };
+
+#if defined(__GNUC__)
+    static constexpr void* handlers[lith_code_count] = {
+        &&op_mov_rr, &&op_mov_ri32, &&op_mov_ri64, &&op_add_rr, &&op_add_ri32,
+        &&op_sub_rr, &&op_sub_ri32, &&op_mul_rr, &&op_div_rr, &&op_push,
+        &&op_pop, &&op_test, &&op_jmp, &&op_jz, &&op_syscall,
+    };
+#define LITH_DISPATCH() count++; goto *handlers[*pc]
+#define LITH_CASE(name) op_##name:
+    LITH_DISPATCH();
+#else
+#define LITH_DISPATCH() continue
+#define LITH_CASE(name) case LithCode::name:
+    for (;;) {
+        count++;
+        switch (static_cast<LithCode>(*pc)) {
+#endif
+
+    LITH_CASE(mov_rr)
+        r[dst(pc + 1)] = r[src(pc + 1)];
+        pc += 2;
+        LITH_DISPATCH();
+    LITH_CASE(mov_ri32)
+        r[pc[1]] = imm32(pc + 2);
+        pc += 6;
+        LITH_DISPATCH();
+    LITH_CASE(mov_ri64)
+        std::memcpy(&r[pc[1]], pc + 2, 8);
+        pc += 10;
+        LITH_DISPATCH();
+    LITH_CASE(add_rr)
+        r[dst(pc + 1)] += r[src(pc + 1)];
+        pc += 2;
+        LITH_DISPATCH();
+    LITH_CASE(add_ri32)
+        r[pc[1]] += imm32(pc + 2);
+        pc += 6;
+        LITH_DISPATCH();
+    LITH_CASE(sub_rr)
+        r[dst(pc + 1)] -= r[src(pc + 1)];
+        pc += 2;
+        LITH_DISPATCH();
+    LITH_CASE(sub_ri32)
+        r[pc[1]] -= imm32(pc + 2);
+        pc += 6;
+        LITH_DISPATCH();
+    LITH_CASE(mul_rr)
+        r[dst(pc + 1)] *= r[src(pc + 1)];
+        pc += 2;
+        LITH_DISPATCH();
+    LITH_CASE(div_rr)
+        if (r[src(pc + 1)] == 0) {
+            std::raise(SIGFPE);
+        }
+        r[dst(pc + 1)] /= r[src(pc + 1)];
+        pc += 2;
+        LITH_DISPATCH();
+    LITH_CASE(push)
+        r[15] -= 8;
+        std::memcpy(stack_at(r[15]), &r[pc[1]], 8);
+        pc += 2;
+        LITH_DISPATCH();
+    LITH_CASE(pop)
+        std::memcpy(&r[pc[1]], stack_at(r[15]), 8);
+        r[15] += 8;
+        pc += 2;
+        LITH_DISPATCH();
+    LITH_CASE(test)
+        zero = (r[dst(pc + 1)] & r[src(pc + 1)]) == 0;
+        pc += 2;
+        LITH_DISPATCH();
+    LITH_CASE(jmp)
+        pc = target(pc + 1);
+        LITH_DISPATCH();
+    LITH_CASE(jz)
+        pc = zero ? target(pc + 1) : pc + 5;
+        LITH_DISPATCH();
+    LITH_CASE(syscall)
+        if (r[0] != 60) {
+            std::cerr << "Error: unsupported Lith syscall " << r[0] << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        if (instructions != nullptr) {
+            *instructions = count;
+        }
+        return r[1];
+
+#if !defined(__GNUC__)
+        }
+    }
+#endif
+#undef LITH_DISPATCH
+#undef LITH_CASE
+}
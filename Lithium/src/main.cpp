@@ -1,16 +1,30 @@
 #include <iostream>
-#include <fstream>
-#include <sstream>
 #include <optional>
 #include <vector>
 #include <cstring>
+#include <string>
+#include <thread>
+#include <chrono>
 #include "stdio.h"
 
+#include "arena.hpp"
+#include "ast_cache.hpp"
+#include "mapped_file.hpp"
 #include "tokenization.hpp"
 #include "parser.hpp"
+#include "folding.hpp"
+#include "ir.hpp"
+#include "sccp.hpp"
+#include "dead_code.hpp"
+#include "encoder.hpp"
+#include "elf.hpp"
 #include "generation.hpp"
-//#include "generationWin.hpp"
-//#include "generationLith.hpp"
+#include "generationWin.hpp"
+#include "generationLith.hpp"
+#include "jit.hpp"
+#include "lith.hpp"
+#include "lith_vm.hpp"
+#include "output_buffer.hpp"
 
 int main(int argc, char** argv) {
     if (argc < 2) {
@@ -21,9 +35,13 @@ int main(int argc, char** argv) {
 
     bool verbose = false;
     bool debug = false;
+    bool run = false;
     std::string outputFile = "out";
     std::string platform = "linux";
     std::string inputFile = "";
+    std::optional<unsigned> lexThreads;
+    std::optional<std::string> cacheDir;
+    bool useCache = true;
     for (int i = 1; i < argc; i++) {
         if (std::strcmp(argv[i], "-output") == 0 || std::strcmp(argv[i], "-o") == 0) {
             if (i + 1 < argc) {
@@ -51,6 +69,32 @@ int main(int argc, char** argv) {
                 return 1;
             }    
         }
+        else if (std::strcmp(argv[i], "-threads") == 0 || std::strcmp(argv[i], "-j") == 0) {
+            if (i + 1 < argc && std::atoi(argv[i + 1]) > 0) {
+                lexThreads = std::atoi(argv[i + 1]);
+                i++;
+            }
+            else {
+                std::cerr << "Error: -j option requires a positive thread count.\n";
+                return 1;
+            }
+        }
+        else if (std::strcmp(argv[i], "-cache") == 0) {
+            if (i + 1 < argc) {
+                cacheDir = argv[i + 1];
+                i++;
+            }
+            else {
+                std::cerr << "Error: -cache option requires a directory.\n";
+                return 1;
+            }
+        }
+        else if (std::strcmp(argv[i], "-no-cache") == 0) {
+            useCache = false;
+        }
+        else if (std::strcmp(argv[i], "-run") == 0) {
+            run = true;
+        }
         else {
             inputFile = argv[i];
         }
@@ -60,55 +104,155 @@ int main(int argc, char** argv) {
         std::cout << "No input file" << std::endl;
         exit(EXIT_FAILURE);
     }
+    if (run && platform != "linux" && platform != "lith") {
+        std::cerr << "Error: -run is only supported on linux and lith.\n";
+        return 1;
+    }
 
-    std::stringstream contents_stream;
-    std::fstream input(inputFile, std::ios::in);
-    contents_stream << input.rdbuf();
-    input.close();
-    std::string contents = contents_stream.str();
+    const std::optional<MappedFile> source = MappedFile::open(inputFile);
+    if (!source.has_value()) {
+        std::cerr << "Error: could not open '" << inputFile << "'" << std::endl;
+        exit(EXIT_FAILURE);
+    }
 
     std::string fileName = inputFile.substr(inputFile.find_last_of("/\\") + 1);
 
-    Tokenizer tokenizer(std::move(contents), fileName);
-    std::vector<Token> tokens = tokenizer.tokenize();
+    // Small files are lexed on demand as the parser pulls tokens; big ones are
+    // lexed up front on all cores.
+    constexpr size_t parallel_lex_threshold = 8 * 1024 * 1024;
+    if (!lexThreads.has_value()) {
+        lexThreads = source->view().size() >= parallel_lex_threshold ? std::max(std::thread::hardware_concurrency(), 1u) : 1;
+    }
+
+    // Tokens, symbols, the AST and the generated assembly all come from one
+    // arena, so a compile makes a handful of heap allocations whatever the
+    // size of the source.
+    ArenaAllocator arena(1024 * 1024);
+
+    // Parsed programs are only cached when -cache names a directory. Nothing
+    // evicts entries, and a rebuilt compiler can't read the old ones, so an
+    // always-on cache would grow without bound under one-off scripts.
+    std::optional<AstCache> cache;
+    Interner cachedSymbols(&arena);
+    std::optional<NodeProg> prog;
+    if (cacheDir.has_value() && useCache) {
+        cache.emplace(cacheDir.value(), source->view());
+        prog = cache->load(cachedSymbols, &arena);
+    }
 
-    Parser parser(std::move(tokens), fileName);
-    std::optional<NodeProg> prog = parser.parse_prog();
+    std::optional<Tokenizer> tokenizer;
+    if (!prog.has_value()) {
+        tokenizer.emplace(source->view(), fileName, &arena);
+        TokenBuffer tokens(&arena);
+        if (lexThreads.value() > 1) {
+            tokens = tokenizer->tokenize_parallel(lexThreads.value());
+        }
+        Parser parser(lexThreads.value() > 1 ? TokenStream(tokens) : TokenStream(tokenizer.value()), tokenizer->lines(), fileName, &arena);
+        prog = parser.parse_prog();
+        if (prog.has_value() && cache.has_value()) {
+            cache->store(prog.value(), tokenizer->symbols());
+        }
+    }
+    const Interner& symbols = tokenizer.has_value() ? tokenizer->symbols() : cachedSymbols;
 
     if (!prog.has_value()) {
         std::cerr << "Invalid program" << std::endl;
         exit(EXIT_FAILURE);
     }
 
+    Folder folder(prog.value(), symbols.size(), &arena);
+    folder.fold_prog();
+
+    IrBuilder builder(prog.value(), symbols, fileName, &arena);
+    ConstantPropagator propagator(&arena);
+    DeadCodeEliminator eliminator(&arena);
+    const IrProg ir = eliminator.run(propagator.run(builder.build()));
+    if (verbose) {
+        std::cout << ir;
+        propagator.report(std::cout);
+        eliminator.report(std::cout);
+    }
+
+    // Assembly is written straight to out.asm as it is generated
+    const auto createAsm = [&arena]() {
+        std::optional<OutputBuffer> file = OutputBuffer::create("out.asm", OutputBuffer::default_capacity, &arena);
+        if (!file.has_value()) {
+            std::cerr << "Error: could not create 'out.asm'" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return file;
+    };
+
     if (platform == "win") {
-        std::cout << "Broken by updates and currently no longer supported." << std::endl;
-        // GeneratorWin generator(prog.value());
-        // std::fstream file("out.asm", std::ios::out);
-        // file << generator.gen_prog();
-        // file.close();
-        // system("nasm -fwin64 out.asm");
-        // system("gl.exe /console /entry:_start out.obj kernel32.dll");
+        std::optional<OutputBuffer> file = createAsm();
+        GeneratorWin generator(ir, file.value(), &arena);
+        generator.gen_prog();
+        file.reset();
+        system("nasm -fwin64 out.asm");
+        system("gl.exe /console /entry:_start out.obj kernel32.dll");
+        if (!debug) {
+            system("rm out.asm");
+            system("rm out.obj");
+        }
     }
     else if (platform == "linux") {
-        Generator generator(prog.value(), verbose, fileName);
-        std::fstream file("out.asm", std::ios::out);
-        file << generator.gen_prog();
-        file.close();
-        system("nasm -felf64 out.asm");
-        std::string ldCmd = "ld -o " + outputFile + " out.o";
-        system(ldCmd.c_str());
+        // Encoded and linked in process; the listing is only written for -d.
+        // With -run the code is called in process instead and its exit value
+        // becomes the compiler's.
+        Generator generator(ir, verbose, run ? Generator::ExitMode::ret : Generator::ExitMode::syscall, &arena);
+        const std::pmr::vector<Instr>& code = generator.gen_prog();
+        if (verbose) {
+            generator.peephole().report(std::cout);
+        }
+        if (debug) {
+            std::optional<OutputBuffer> file = createAsm();
+            generator.write_asm(file.value());
+        }
+        Encoder encoder(&arena);
+        const std::pmr::vector<std::uint8_t>& machineCode = encoder.encode(code);
+        if (run) {
+            return static_cast<int>(run_jit(machineCode) & 0xFF);
+        }
+
+        // Replaced rather than truncated, as ld does, so it gets the mode
+        ::unlink(outputFile.c_str());
+        std::optional<OutputBuffer> executable = OutputBuffer::create(outputFile, OutputBuffer::default_capacity, &arena, 0755);
+        if (!executable.has_value()) {
+            std::cerr << "Error: could not create '" << outputFile << "'" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        write_elf(executable.value(), machineCode);
     }
     else if (platform == "lith") {
-        std::cout << "Not yet supported." << std::endl; 
-        // GeneratorLith generator(prog.value());
-        // std::fstream file("out.asm", std::ios::out);
-        // file << generator.gen_prog();
-        // file.close();
-    }
+        // Assembled to a Lith image, which -run interprets in process and
+        // which is otherwise written to the output file. The listing is
+        // only written for -d.
+        GeneratorLith generator(ir, &arena);
+        const std::pmr::vector<LithInstr>& code = generator.gen_prog();
+        if (debug) {
+            std::optional<OutputBuffer> file = createAsm();
+            generator.write_asm(file.value());
+        }
+        LithAssembler assembler(&arena);
+        const LithImage image = assembler.assemble(code, generator.stack_size());
+        if (run) {
+            std::uint64_t instructions = 0;
+            const auto start = std::chrono::steady_clock::now();
+            const std::uint64_t result = run_lith(image, &instructions);
+            const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+            if (verbose) {
+                std::cout << "vm: " << instructions << " instructions in " << elapsed.count() / 1e6 << " ms, "
+                          << elapsed.count() / static_cast<double>(std::max<std::uint64_t>(instructions, 1)) << " ns each" << std::endl;
+            }
+            return static_cast<int>(result & 0xFF);
+        }
 
-    if (!debug) {
-        system("rm out.asm");
-        system("rm out.o");
+        std::optional<OutputBuffer> file = OutputBuffer::create(outputFile, OutputBuffer::default_capacity, &arena);
+        if (!file.has_value()) {
+            std::cerr << "Error: could not create '" << outputFile << "'" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        write_lith_image(file.value(), image);
     }
 
     return EXIT_SUCCESS;
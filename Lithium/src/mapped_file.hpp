@@ -0,0 +1,113 @@
+#pragma once
+
+#include <cerrno>
+#include <cstddef>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Read-only memory mapping of a source file. Tokens keep std::string_view
+// slices into the mapping, so it has to outlive every stage of the compiler.
+// What can't be mapped, such as a pipe or /dev/stdin, is read into a buffer
+// the object owns instead.
+class MappedFile final {
+public:
+    [[nodiscard]] static std::optional<MappedFile> open(const std::string& path)
+    {
+        const int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd == -1) {
+            return {};
+        }
+        struct stat st {};
+        if (fstat(fd, &st) == -1) {
+            ::close(fd);
+            return {};
+        }
+        MappedFile file;
+        if (!S_ISREG(st.st_mode)) {
+            const bool read = file.read_all(fd);
+            ::close(fd);
+            if (!read) {
+                return {};
+            }
+            return file;
+        }
+        file.m_size = static_cast<std::size_t>(st.st_size);
+        if (file.m_size > 0) {
+            void* data = mmap(nullptr, file.m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data == MAP_FAILED) {
+                ::close(fd);
+                return {};
+            }
+            madvise(data, file.m_size, MADV_SEQUENTIAL);
+            file.m_data = static_cast<const char*>(data);
+        }
+        ::close(fd);
+        return file;
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    MappedFile(MappedFile&& other) noexcept
+        : m_data { std::exchange(other.m_data, nullptr) }
+        , m_size { std::exchange(other.m_size, 0) }
+        , m_buffer { std::move(other.m_buffer) }
+    {
+    }
+
+    MappedFile& operator=(MappedFile&& other) noexcept
+    {
+        std::swap(m_data, other.m_data);
+        std::swap(m_size, other.m_size);
+        std::swap(m_buffer, other.m_buffer);
+        return *this;
+    }
+
+    [[nodiscard]] std::string_view view() const
+    {
+        if (m_data == nullptr) {
+            return m_buffer;
+        }
+        return { m_data, m_size };
+    }
+
+    ~MappedFile()
+    {
+        if (m_data != nullptr) {
+            munmap(const_cast<char*>(m_data), m_size);
+        }
+    }
+
+private:
+    MappedFile() = default;
+
+    bool read_all(const int fd)
+    {
+        constexpr std::size_t chunk = 64 * 1024;
+        for (;;) {
+            const std::size_t size = m_buffer.size();
+            m_buffer.resize(size + chunk);
+            const ssize_t count = ::read(fd, m_buffer.data() + size, chunk);
+            if (count == -1 && errno == EINTR) {
+                m_buffer.resize(size);
+                continue;
+            }
+            if (count <= 0) {
+                m_buffer.resize(size);
+                return count == 0;
+            }
+            m_buffer.resize(size + static_cast<std::size_t>(count));
+        }
+    }
+
+    const char* m_data = nullptr; // the mapping, or null when read into m_buffer
+    std::size_t m_size = 0;
+    std::string m_buffer;
+};
@@ -0,0 +1,132 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <concepts>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory_resource>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Append-only buffer for the generated assembly, written to a file in large
+// blocks whenever it fills up. Numbers are formatted in place with
+// std::to_chars, so emitting a line copies bytes and allocates nothing.
+class OutputBuffer final {
+public:
+    static constexpr size_t default_capacity = 256 * 1024;
+
+    // Creates or truncates the file at path, or nothing if it can't be
+    // opened. mode, less the umask, only applies to a new file.
+    [[nodiscard]] static std::optional<OutputBuffer> create(const std::string& path, const size_t capacity = default_capacity,
+                                                            std::pmr::memory_resource* resource = std::pmr::get_default_resource(),
+                                                            const mode_t mode = 0644) {
+        const int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, mode);
+        if (fd == -1) {
+            return {};
+        }
+        return OutputBuffer(fd, capacity, resource);
+    }
+
+    OutputBuffer(const OutputBuffer&) = delete;
+    OutputBuffer& operator=(const OutputBuffer&) = delete;
+
+    OutputBuffer(OutputBuffer&& other) noexcept
+        : m_fd(std::exchange(other.m_fd, -1)), m_data(std::move(other.m_data)), m_size(std::exchange(other.m_size, 0)) {
+    }
+
+    OutputBuffer& operator=(OutputBuffer&&) = delete;
+
+    // Flushes what is left and closes the file
+    ~OutputBuffer() {
+        if (m_fd != -1) {
+            flush();
+            ::close(m_fd);
+        }
+    }
+
+    void append(const std::string_view text) {
+        if (text.size() > m_data.size() - m_size) {
+            flush();
+            if (text.size() > m_data.size()) {
+                write_all(text.data(), text.size());
+                return;
+            }
+        }
+        std::memcpy(m_data.data() + m_size, text.data(), text.size());
+        m_size += text.size();
+    }
+
+    void append(const char c) {
+        if (m_size == m_data.size()) {
+            flush();
+        }
+        m_data[m_size++] = c;
+    }
+
+    template <std::integral T>
+    void append_int(const T value) {
+        if (m_data.size() - m_size < max_int_chars) {
+            flush();
+        }
+        const std::to_chars_result result = std::to_chars(m_data.data() + m_size, m_data.data() + m_data.size(), value);
+        m_size = static_cast<size_t>(result.ptr - m_data.data());
+    }
+
+    void flush() {
+        write_all(m_data.data(), m_size);
+        m_size = 0;
+    }
+
+private:
+    static constexpr size_t max_int_chars = 20; // -9223372036854775808 and 18446744073709551615
+
+    OutputBuffer(const int fd, const size_t capacity, std::pmr::memory_resource* resource)
+        : m_fd(fd), m_data(std::max(capacity, max_int_chars), resource) {
+    }
+
+    void write_all(const char* data, size_t size) const {
+        while (size > 0) {
+            const ssize_t written = ::write(m_fd, data, size);
+            if (written == -1) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                std::cerr << "Error: could not write the output: " << std::strerror(errno) << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            data += written;
+            size -= static_cast<size_t>(written);
+        }
+    }
+
+    int m_fd = -1;
+    std::pmr::vector<char> m_data;
+    size_t m_size = 0;
+};
+
+inline OutputBuffer& operator<<(OutputBuffer& out, const std::string_view text) {
+    out.append(text);
+    return out;
+}
+
+inline OutputBuffer& operator<<(OutputBuffer& out, const char c) {
+    out.append(c);
+    return out;
+}
+
+template <std::integral T>
+    requires(!std::same_as<T, char> && !std::same_as<T, bool>)
+OutputBuffer& operator<<(OutputBuffer& out, const T value) {
+    out.append_int(value);
+    return out;
+}
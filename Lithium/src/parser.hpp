@@ -1,476 +1,510 @@
 #pragma once
 
-#include <variant>
+#include <array>
 #include <cassert>
+#include <cstdint>
+#include <memory_resource>
 
 #include "tokenization.hpp"
-#include "arena.hpp"
 
-struct NodeTermIntLit {
-    Token int_lit;
-};
-
-struct NodeTermIdent {
-    Token ident;
-};
-
-struct NodeExpr;
-
-struct NodeTermParen {
-    NodeExpr* expr;
-};
+// The AST is flat: nodes live in per-kind pools inside NodeProg and refer to
+// each other by 32-bit index. Children of a scope are a contiguous range of
+// NodeProg::stmts, and parentheses leave no node behind.
+using NodeIndex = std::uint32_t;
 
-struct NodeBinExprAdd {
-    NodeExpr* lhs;
-    NodeExpr* rhs;
+enum class BinOp : std::uint8_t {
+    add,
+    sub,
+    mul,
+    div
 };
 
-struct NodeBinExprSub {
-    NodeExpr* lhs;
-    NodeExpr* rhs;
-};
+inline BinOp bin_op(const TokenType type) {
+    switch (type) {
+        case TokenType::plus:
+            return BinOp::add;
+        case TokenType::minus:
+            return BinOp::sub;
+        case TokenType::star:
+            return BinOp::mul;
+        case TokenType::fslash:
+            return BinOp::div;
+        default:
+            assert(false); // Unreachable
+            return BinOp::add;
+    }
+}
 
-struct NodeBinExprMulti {
-    NodeExpr* lhs;
-    NodeExpr* rhs;
+enum class ExprKind : std::uint8_t {
+    int_lit,
+    ident,
+    bin
 };
 
-struct NodeBinExprDiv {
-    NodeExpr* lhs;
-    NodeExpr* rhs;
-};
+struct NodeExpr {
+    ExprKind kind;
+    BinOp op; // bin
+    std::uint32_t lhs; // bin: lhs expr, ident: Symbol, int_lit: low half of the value
+    std::uint32_t rhs; // bin: rhs expr, int_lit: high half of the value
 
-struct NodeBinExpr {
-    std::variant<NodeBinExprAdd*, NodeBinExprSub*, NodeBinExprMulti*, NodeBinExprDiv*> var;
-};
+    static NodeExpr make_int_lit(const std::uint64_t value) {
+        return { .kind = ExprKind::int_lit, .op = {}, .lhs = static_cast<std::uint32_t>(value), .rhs = static_cast<std::uint32_t>(value >> 32) };
+    }
 
-struct NodeTerm {
-    std::variant<NodeTermIntLit*, NodeTermIdent*, NodeTermParen*> var;
-};
+    static NodeExpr make_ident(const Symbol symbol) {
+        return { .kind = ExprKind::ident, .op = {}, .lhs = symbol, .rhs = 0 };
+    }
 
-struct NodeExpr {
-    std::variant<NodeTerm*, NodeBinExpr*> var;
-};
+    static NodeExpr make_bin(const BinOp op, const NodeIndex lhs, const NodeIndex rhs) {
+        return { .kind = ExprKind::bin, .op = op, .lhs = lhs, .rhs = rhs };
+    }
 
-struct NodeStmtExit {
-    NodeExpr* expr;
-};
+    [[nodiscard]] std::uint64_t int_lit() const {
+        return static_cast<std::uint64_t>(rhs) << 32 | lhs;
+    }
 
-struct NodeStmtLet {
-    Token ident;
-    NodeExpr* expr;
+    [[nodiscard]] Symbol ident() const {
+        return lhs;
+    }
 };
 
-struct NodeStmtSetExpr {
-    Token ident;
-    NodeExpr* expr;
-};
+static_assert(sizeof(NodeExpr) == 12);
 
-struct NodeStmtSetAdd {
-    Token ident;
-    NodeExpr* expr;
+// "x = e" and the compound "x op= e" forms share one node
+enum class SetOp : std::uint8_t {
+    assign,
+    add,
+    sub,
+    mul,
+    div
 };
 
-struct NodeStmtSetMulti {
-    Token ident;
-    NodeExpr* expr;
-};
+inline BinOp bin_op(const SetOp op) {
+    assert(op != SetOp::assign);
+    return static_cast<BinOp>(static_cast<std::uint8_t>(op) - 1);
+}
 
-struct NodeStmtSetSub {
-    Token ident;
-    NodeExpr* expr;
+struct NodeStmtExit {
+    NodeIndex expr;
 };
 
-struct NodeStmtSetDiv {
-    Token ident;
-    NodeExpr* expr;
+struct NodeStmtLet {
+    Symbol ident;
+    NodeIndex expr;
 };
 
 struct NodeStmtSet {
-    std::variant<NodeStmtSetExpr*, NodeStmtSetAdd*, NodeStmtSetMulti*, NodeStmtSetSub*, NodeStmtSetDiv*> var;
+    SetOp op;
+    Symbol ident;
+    NodeIndex expr;
 };
 
-struct NodeStmt;
-
 struct NodeScope {
-    std::vector<NodeStmt*> stmts;
-};
-
-struct NodeIfPred;
-
-struct NodeIfPredElseIf {
-    NodeExpr* expr;
-    NodeScope* scope;
-    std::optional<NodeIfPred*> pred;
+    std::uint32_t first; // index into NodeProg::stmts
+    std::uint32_t count;
 };
 
-struct NodeIfPredElse {
-    NodeScope* scope;
+enum class IfPredKind : std::uint8_t {
+    elif,
+    else_
 };
 
 struct NodeIfPred {
-    std::variant<NodeIfPredElseIf*, NodeIfPredElse*> var;
+    IfPredKind kind;
+    NodeIndex expr; // elif
+    NodeIndex scope;
+    std::optional<NodeIndex> pred; // elif
 };
 
 struct NodeStmtIf {
-    NodeExpr* expr;
-    NodeScope* scope;
-    std::optional<NodeIfPred*> pred;
+    NodeIndex expr;
+    NodeIndex scope;
+    std::optional<NodeIndex> pred;
 };
 
+enum class StmtKind : std::uint8_t {
+    exit,
+    let,
+    set,
+    scope,
+    if_
+};
+
+// Reference to a statement: its kind and its index in the matching pool
 struct NodeStmt {
-    std::variant<NodeStmtExit*, NodeStmtLet*, NodeStmtSet*, NodeScope*, NodeStmtIf*> var;
+    StmtKind kind;
+    NodeIndex index;
 };
 
 struct NodeProg {
-    std::vector<NodeStmt*> stmts;
+    explicit NodeProg(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : exprs(resource), exits(resource), lets(resource), sets(resource), scopes(resource), ifs(resource), preds(resource), stmts(resource)
+    {
+    }
+
+    std::pmr::vector<NodeExpr> exprs;
+    std::pmr::vector<NodeStmtExit> exits;
+    std::pmr::vector<NodeStmtLet> lets;
+    std::pmr::vector<NodeStmtSet> sets;
+    std::pmr::vector<NodeScope> scopes;
+    std::pmr::vector<NodeStmtIf> ifs;
+    std::pmr::vector<NodeIfPred> preds;
+    std::pmr::vector<NodeStmt> stmts;
+    NodeScope body {}; // the top-level statements
 };
 
 class Parser {
 public:
-    explicit Parser(std::vector<Token> tokens, std::string srcName) :
-        m_tokens(std::move(tokens)),
-        m_allocator(1024 * 1024 * 4), // 4 mb
-        m_srcName(srcName)
+    // The AST is allocated from resource
+    explicit Parser(TokenStream tokens, const LineIndex& lines, std::string srcName, std::pmr::memory_resource* resource = std::pmr::get_default_resource()) :
+        m_tokens(tokens),
+        m_lines(lines),
+        m_srcName(srcName),
+        m_prog(resource),
+        m_pending_stmts(resource),
+        m_open_scopes(resource),
+        m_operands(resource),
+        m_operators(resource)
         {
             
         }
 
-        void error(const std::string& msg, int line = -1, int col = -1) {
-            if (line == -1) {
-                line = peek(-1).value().line;
-            }
-            if (col == -1) {
-                col = peek(-1).value().col + 1;
-            }
-            std::cerr << m_srcName << ":" << line << ":" << col << ": parse_error: " << msg << std::endl;
+        // Reports msg at the position just past the last consumed token. Line and
+        // column are only computed here, from the source's LineIndex.
+        void error(const std::string& msg) {
+            const std::optional<Token> last = peek(-1);
+            const size_t pos = last.has_value() ? token_end(m_lines.source(), last.value()) : 0;
+            const LineIndex::Location loc = m_lines.locate(pos);
+            std::cerr << m_srcName << ":" << loc.line << ":" << loc.col << ": parse_error: " << msg << std::endl;
         }
 
-        void error_expected(const std::string& msg, const int line, const int col = -1) {
-            error("Expected " + msg, line, col);
+        void error_expected(const std::string& msg) {
+            error("Expected " + msg);
         }
 
-        std::optional<NodeTerm*> parse_term() {
+        std::optional<NodeIndex> parse_term() {
             if (auto int_lit = try_consume(TokenType::int_lit)) {
-                auto term_int_lit = m_allocator.emplace<NodeTermIntLit>(int_lit.value());
-                auto term = m_allocator.emplace<NodeTerm>(term_int_lit);
-                return term;
+                return add_node(m_prog.exprs, NodeExpr::make_int_lit(int_lit.value().value));
             }
             if (auto ident = try_consume(TokenType::ident)) {
-                auto expr_ident = m_allocator.emplace<NodeTermIdent>(ident.value());
-                auto term = m_allocator.emplace<NodeTerm>(expr_ident);
-                return term;
-            }
-            if (const auto open_paren = try_consume(TokenType::open_paren)) {
-                auto expr = parse_expr();
-                if (!expr.has_value()) {
-                    error_expected("expr", open_paren.value().line);
-                    exit(EXIT_FAILURE);
-                }
-                try_consume(TokenType::close_paren, "Expected ')'", open_paren.value().line);
-                auto term_paren = m_allocator.emplace<NodeTermParen>(expr.value());
-                auto term = m_allocator.emplace<NodeTerm>(term_paren);
-                return term;
+                return add_node(m_prog.exprs, NodeExpr::make_ident(ident.value().symbol()));
             }
             return {};
         }
 
-        std::optional<NodeExpr*> parse_expr(const int min_prec = 0) {
-            std::optional<NodeTerm*> term_lhs = parse_term();
-            if (!term_lhs.has_value()) {
-                return {};
-            }
-            auto expr_lhs = m_allocator.emplace<NodeExpr>(term_lhs.value());
-
+        // Precedence climbing with explicit stacks instead of recursion, so
+        // nesting depth is bounded by memory rather than the native stack.
+        // Operators wait on m_operators until an operator of lower or equal
+        // precedence (all are left associative) or a ')' reduces them; an
+        // open_paren entry marks where a parenthesized sub-expression began.
+        std::optional<NodeIndex> parse_expr() {
             while (true) {
-                std::optional<Token> curr_tok = peek();
-                std::optional<int> prec;
-                if (curr_tok.has_value()) {
-                    prec = bin_prec(curr_tok->type);
-                    if (!prec.has_value() || prec < min_prec) {
-                        break;
-                    }      
-                }
-                else {
-                    break;
-                }
-                const Token op = consume();
-                const int next_min_prec = prec.value() + 1;
-                auto expr_rhs = parse_expr(next_min_prec);
-                if (!expr_rhs.has_value()) {
-                    error("Unable to parse expression", op.line);
-                    exit(EXIT_FAILURE);
-                }
-                auto expr = m_allocator.emplace<NodeBinExpr>();
-                auto expr_lhs2 = m_allocator.emplace<NodeExpr>();
-                if (op.type == TokenType::plus) {
-                    expr_lhs2->var = expr_lhs->var;
-                    auto add = m_allocator.emplace<NodeBinExprAdd>(expr_lhs2, expr_rhs.value());
-                    expr->var = add;
+                if (try_consume(TokenType::open_paren)) {
+                    m_operators.push_back(TokenType::open_paren);
+                    continue;
                 }
-                else if (op.type == TokenType::minus) {
-                    expr_lhs2->var = expr_lhs->var;
-                    auto sub = m_allocator.emplace<NodeBinExprSub>(expr_lhs2, expr_rhs.value());
-                    expr->var = sub;
+                if (const auto term = parse_term()) {
+                    m_operands.push_back(term.value());
                 }
-                else if (op.type == TokenType::star) {
-                    expr_lhs2->var = expr_lhs->var;
-                    auto multi = m_allocator.emplace<NodeBinExprMulti>(expr_lhs2, expr_rhs.value());
-                    expr->var = multi;
+                else if (m_operators.empty()) {
+                    return {};
                 }
-                else if (op.type == TokenType::fslash) {
-                    expr_lhs2->var = expr_lhs->var;
-                    auto div = m_allocator.emplace<NodeBinExprDiv>(expr_lhs2, expr_rhs.value());
-                    expr->var = div;
+                else if (m_operators.back() == TokenType::open_paren) {
+                    error_expected("expr");
+                    exit(EXIT_FAILURE);
                 }
                 else {
-                    assert(false); // Unreachable
+                    error("Unable to parse expression");
+                    exit(EXIT_FAILURE);
+                }
+
+                while (true) {
+                    const std::optional<Token> curr_tok = peek();
+                    const std::optional<int> prec = curr_tok.has_value() ? bin_prec(curr_tok->type) : std::nullopt;
+                    if (prec.has_value()) {
+                        reduce_operators(prec.value());
+                        m_operators.push_back(consume().type);
+                        break;
+                    }
+                    reduce_operators(0);
+                    if (m_operators.empty()) {
+                        const NodeIndex expr = m_operands.back();
+                        m_operands.pop_back();
+                        return expr;
+                    }
+                    try_consume(TokenType::close_paren, "Expected ')'");
+                    m_operators.pop_back();
                 }
-                expr_lhs->var = expr;
             }
-            return expr_lhs;
         }
 
-        std::optional<NodeScope*> parse_scope() {
-            if (!try_consume(TokenType::open_curly).has_value()) {
-                return {};
+        std::optional<NodeIndex> parse_stmt_set() {
+            const Token ident = consume();
+            SetOp op;
+            switch (peek().value().type) {
+                case TokenType::eq:
+                    op = SetOp::assign;
+                    break;
+                case TokenType::pluseq:
+                    op = SetOp::add;
+                    break;
+                case TokenType::minuseq:
+                    op = SetOp::sub;
+                    break;
+                case TokenType::stareq:
+                    op = SetOp::mul;
+                    break;
+                case TokenType::fslasheq:
+                    op = SetOp::div;
+                    break;
+                default:
+                    return {};
             }
-            const auto scope = m_allocator.emplace<NodeScope>();
-            while (auto stmt = parse_stmt()) {
-                scope->stmts.push_back(stmt.value());
+            consume();
+            const auto expr = parse_expr();
+            if (!expr.has_value()) {
+                error("Invalid expression");
+                exit(EXIT_FAILURE);
             }
-            try_consume(TokenType::close_curly, "Expected '}'");
-            return scope;
+            return add_node(m_prog.sets, NodeStmtSet { .op = op, .ident = ident.symbol(), .expr = expr.value() });
         }
 
-        std::optional<NodeStmtSet*> parse_stmt_set() {
-            Token ident = consume();
-            auto stmt_set = m_allocator.emplace<NodeStmtSet>();
-            if (peek().value().type == TokenType::eq) {
-                auto stmt_set_expr = m_allocator.emplace<NodeStmtSetExpr>();
-                stmt_set_expr->ident = ident;
-                consume();
-                if (const auto expr = parse_expr()) {
-                    stmt_set_expr->expr = expr.value();
-                }
-                else {
-                    error("Invalid expression", ident.line);
-                    exit(EXIT_FAILURE);
-                }
-                stmt_set->var = stmt_set_expr;
+        // Parses the else-if / else arms that follow the scope of stmt_if (or of
+        // its arm prev). An arm opens its scope and returns; the chain resumes
+        // when that scope closes, so a chain of any length uses no native stack.
+        // The if statement is complete once no further arm follows.
+        void parse_if_pred(const NodeIndex stmt_if, const std::optional<NodeIndex> prev) {
+            if (!try_consume(TokenType::else_)) {
+                m_pending_stmts.push_back(NodeStmt { .kind = StmtKind::if_, .index = stmt_if });
+                return;
             }
-            else if (peek().value().type == TokenType::pluseq) {
-                auto stmt_set_expr = m_allocator.emplace<NodeStmtSetAdd>();
-                stmt_set_expr->ident = ident;
-                consume();
-                if (const auto expr = parse_expr()) {
-                    stmt_set_expr->expr = expr.value();
-                }
-                else {
-                    error("Invalid expression", ident.line);
-                    exit(EXIT_FAILURE);
-                }
-                stmt_set->var = stmt_set_expr;
-            }
-            else if (peek().value().type == TokenType::stareq) {
-                auto stmt_set_expr = m_allocator.emplace<NodeStmtSetMulti>();
-                stmt_set_expr->ident = ident;
-                consume();
+            NodeIfPred pred { .kind = IfPredKind::else_ };
+            if (try_consume(TokenType::if_)) {
+                pred.kind = IfPredKind::elif;
+                try_consume(TokenType::open_paren, "Expected '('");
                 if (const auto expr = parse_expr()) {
-                    stmt_set_expr->expr = expr.value();
+                    pred.expr = expr.value();
                 }
                 else {
-                    error("Invalid expression", ident.line);
+                    error("Expected expression");
                     exit(EXIT_FAILURE);
                 }
-                stmt_set->var = stmt_set_expr;
-            }
-            else if (peek().value().type == TokenType::minuseq) {
-                auto stmt_set_expr = m_allocator.emplace<NodeStmtSetSub>();
-                stmt_set_expr->ident = ident;
-                consume();
-                if (const auto expr = parse_expr()) {
-                    stmt_set_expr->expr = expr.value();
-                }
-                else {
-                    error("Invalid expression", ident.line);
-                    exit(EXIT_FAILURE);
-                }
-                stmt_set->var = stmt_set_expr;
+                try_consume(TokenType::close_paren, "Expected ')'");
             }
-            else if (peek().value().type == TokenType::fslasheq) {
-                auto stmt_set_expr = m_allocator.emplace<NodeStmtSetDiv>();
-                stmt_set_expr->ident = ident;
-                consume();
-                if (const auto expr = parse_expr()) {
-                    stmt_set_expr->expr = expr.value();
-                }
-                else {
-                    error("Invalid expression", ident.line);
-                    exit(EXIT_FAILURE);
-                }
-                stmt_set->var = stmt_set_expr;
+            const NodeIndex index = add_node(m_prog.preds, pred);
+            if (prev.has_value()) {
+                m_prog.preds[prev.value()].pred = index;
             }
             else {
-                return {};
+                m_prog.ifs[stmt_if].pred = index;
+            }
+            const ScopeOwner owner = pred.kind == IfPredKind::elif ? ScopeOwner::elif : ScopeOwner::else_;
+            if (!open_scope(owner, stmt_if, index)) {
+                error("Invalid scope");
+                exit(EXIT_FAILURE);
             }
-            return stmt_set;
         }
 
-        std::optional<NodeIfPred*> parse_if_pred() {
-            if (try_consume(TokenType::else_)) {
-                if (try_consume(TokenType::if_)) {
-                    // else if
-                    try_consume(TokenType::open_paren, "Expected '('");
-                    const auto elseif = m_allocator.alloc<NodeIfPredElseIf>();
-                    if (const auto expr = parse_expr()) {
-                        elseif->expr = expr.value();
-                    }
-                    else {
-                        error("Expected expression");
-                        exit(EXIT_FAILURE);
-                    }
-                    try_consume(TokenType::close_paren, "Expected ')'");
-                    if (const auto scope = parse_scope()) {
-                        elseif->scope = scope.value();
-                    }
-                    else {
-                        error("Invalid scope");
-                        exit(EXIT_FAILURE);
-                    }
-                    elseif->pred = parse_if_pred();
-                    auto if_pred = m_allocator.emplace<NodeIfPred>(elseif);
-                    return if_pred;
-                }
-                else {
-                    // else
-                    const auto else_ = m_allocator.alloc<NodeIfPredElse>();
-                    if (const auto scope = parse_scope()) {
-                        else_->scope = scope.value();
-                    }
-                    else {
-                        error("Invalid scope");
-                        exit(EXIT_FAILURE);
-                    }
-                    auto if_pred = m_allocator.emplace<NodeIfPred>(else_);
-                    return if_pred;
-                }
+        void parse_stmt_if() {
+            try_consume(TokenType::open_paren, "Expected '('");
+            NodeStmtIf stmt_if {};
+            if (auto expr = parse_expr()) {
+                stmt_if.expr = expr.value();
+            }
+            else {
+                error("Invalid expression");
+                exit(EXIT_FAILURE);
+            }
+            try_consume(TokenType::close_paren, "Expected ')'");
+            const NodeIndex index = add_node(m_prog.ifs, stmt_if);
+            if (!open_scope(ScopeOwner::if_, index)) {
+                error("Invalid scope");
+                exit(EXIT_FAILURE);
             }
-            // no pred found
-            return {};
         }
 
-        std::optional<NodeStmt*> parse_stmt() {
+        // Parses one exit, let or set statement. Scopes and ifs nest, so
+        // parse_prog handles those itself.
+        std::optional<NodeStmt> parse_stmt() {
+            if (!peek().has_value()) {
+                return {};
+            }
             if (peek().value().type == TokenType::_exit && peek(1).has_value() && peek(1).value().type == TokenType::open_paren) {
                 consume();
                 consume();
-                auto stmt_exit = m_allocator.emplace<NodeStmtExit>();
+                NodeStmtExit stmt_exit;
                 if (const auto node_expr = parse_expr()) {
-                    stmt_exit->expr = node_expr.value();
+                    stmt_exit.expr = node_expr.value();
                 } else {
                     error("Invalid expression");
                     exit(EXIT_FAILURE);
                 }
                 try_consume(TokenType::close_paren, "Expected ')'");
                 try_consume(TokenType::semi, "Expected ';'");
-                auto stmt = m_allocator.emplace<NodeStmt>();
-                stmt->var = stmt_exit;
-                return stmt;
+                return NodeStmt { .kind = StmtKind::exit, .index = add_node(m_prog.exits, stmt_exit) };
             }
-            if (peek().has_value() && peek().value().type == TokenType::let && peek(1).has_value() && peek(1).value().type == TokenType::ident && peek(2).has_value() && peek(2).value().type == TokenType::eq) {
+            if (peek().value().type == TokenType::let && peek(1).has_value() && peek(1).value().type == TokenType::ident && peek(2).has_value() && peek(2).value().type == TokenType::eq) {
                 consume();
-                auto stmt_let = m_allocator.emplace<NodeStmtLet>();
-                stmt_let->ident = consume();
+                NodeStmtLet stmt_let { .ident = consume().symbol() };
                 consume();
                 if (auto expr = parse_expr()) {
-                    stmt_let->expr = expr.value();
+                    stmt_let.expr = expr.value();
                 }
                 else {
-                    error("Invalid expression", stmt_let->ident.line);
+                    error("Invalid expression");
                     exit(EXIT_FAILURE);
                 }
-                try_consume(TokenType::semi, "Expected ';'", stmt_let->ident.line);
-                auto stmt = m_allocator.emplace<NodeStmt>();
-                stmt->var = stmt_let;
-                return stmt;
+                try_consume(TokenType::semi, "Expected ';'");
+                return NodeStmt { .kind = StmtKind::let, .index = add_node(m_prog.lets, stmt_let) };
             }
-            if (peek().has_value() && peek().value().type == TokenType::ident && peek(1).has_value()) {
-                auto stmt = m_allocator.emplace<NodeStmt>();
-                if (auto stmt_set = parse_stmt_set()) {
-                    stmt->var = stmt_set.value();
-                }
-                else {
+            if (peek().value().type == TokenType::ident && peek(1).has_value()) {
+                const auto stmt_set = parse_stmt_set();
+                if (!stmt_set.has_value()) {
                     error("Invalid set statement");
                     exit(EXIT_FAILURE);
                 }
                 try_consume(TokenType::semi, "Expected ';'");
-                return stmt;
-            }
-            if (peek().has_value() && peek().value().type == TokenType::open_curly) {
-                if (auto scope = parse_scope()) {
-                    auto stmt = m_allocator.emplace<NodeStmt>();
-                    stmt->var = scope.value();
-                    return stmt;
-                }
-                error("Invalid scope");
-                exit(EXIT_FAILURE);
-            }
-            if (auto if_ = try_consume(TokenType::if_)) {
-                try_consume(TokenType::open_paren, "Expected '('", if_.value().line);
-                auto stmt_if = m_allocator.emplace<NodeStmtIf>();
-                if (auto expr = parse_expr()) {
-                    stmt_if->expr = expr.value();
-                }
-                else {
-                    error("Invalid expression", if_.value().line);
-                    exit(EXIT_FAILURE);
-                }
-                try_consume(TokenType::close_paren, "Expected ')'", if_.value().line);
-                if (auto scope = parse_scope()) {
-                    stmt_if->scope = scope.value();
-                }
-                else {
-                    error("Invalid scope");
-                    exit(EXIT_FAILURE);
-                }
-                stmt_if->pred = parse_if_pred();
-                auto stmt = m_allocator.emplace<NodeStmt>(stmt_if);
-                return stmt;
+                return NodeStmt { .kind = StmtKind::set, .index = stmt_set.value() };
             }
             return {};
         }
 
+        // Statements are parsed in one loop; the scopes that are still open
+        // live on m_open_scopes rather than on the native stack.
         std::optional<NodeProg> parse_prog() {
-            NodeProg prog;
-            while (peek().has_value()) {
+            while (peek().has_value() || !m_open_scopes.empty()) {
                 if (auto stmt = parse_stmt()) {
-                    prog.stmts.push_back(stmt.value());
+                    m_pending_stmts.push_back(stmt.value());
+                    continue;
                 }
-                else {
+                if (try_consume(TokenType::if_)) {
+                    parse_stmt_if();
+                    continue;
+                }
+                if (open_scope(ScopeOwner::block)) {
+                    continue;
+                }
+                if (m_open_scopes.empty()) {
                     error("Invalid statement");
                     exit(EXIT_FAILURE);
                 }
+                try_consume(TokenType::close_curly, "Expected '}'");
+                close_scope();
             }
-            return prog;
+            m_prog.body = flush_scope(0);
+            return std::move(m_prog);
         }
 
 private:
-    [[nodiscard]] std::optional<Token> peek(const int offset = 0) const {
-        if (m_index + offset >= m_tokens.size()) {
+    // What a '{' that is still open belongs to, and so what happens when it closes
+    enum class ScopeOwner : std::uint8_t {
+        block,
+        if_,
+        elif,
+        else_
+    };
+
+    struct OpenScope {
+        ScopeOwner owner;
+        NodeIndex stmt_if; // if_, elif, else_
+        NodeIndex pred; // elif, else_
+        size_t mark; // size of m_pending_stmts when the scope opened
+    };
+
+    bool open_scope(const ScopeOwner owner, const NodeIndex stmt_if = 0, const NodeIndex pred = 0) {
+        if (!try_consume(TokenType::open_curly).has_value()) {
+            return false;
+        }
+        m_open_scopes.push_back({ .owner = owner, .stmt_if = stmt_if, .pred = pred, .mark = m_pending_stmts.size() });
+        return true;
+    }
+
+    void close_scope() {
+        const OpenScope open = m_open_scopes.back();
+        m_open_scopes.pop_back();
+        const NodeIndex scope = add_node(m_prog.scopes, flush_scope(open.mark));
+        switch (open.owner) {
+            case ScopeOwner::block:
+                m_pending_stmts.push_back(NodeStmt { .kind = StmtKind::scope, .index = scope });
+                break;
+            case ScopeOwner::if_:
+                m_prog.ifs[open.stmt_if].scope = scope;
+                parse_if_pred(open.stmt_if, {});
+                break;
+            case ScopeOwner::elif:
+                m_prog.preds[open.pred].scope = scope;
+                parse_if_pred(open.stmt_if, open.pred);
+                break;
+            case ScopeOwner::else_:
+                m_prog.preds[open.pred].scope = scope;
+                m_pending_stmts.push_back(NodeStmt { .kind = StmtKind::if_, .index = open.stmt_if });
+                break;
+        }
+    }
+
+    // Pops operators of at least min_prec off m_operators, stopping at an
+    // open_paren, and combines their operands into bin exprs
+    void reduce_operators(const int min_prec) {
+        while (!m_operators.empty() && m_operators.back() != TokenType::open_paren && bin_prec(m_operators.back()).value() >= min_prec) {
+            const NodeIndex rhs = m_operands.back();
+            m_operands.pop_back();
+            const NodeIndex lhs = m_operands.back();
+            m_operands.back() = add_node(m_prog.exprs, NodeExpr::make_bin(bin_op(m_operators.back()), lhs, rhs));
+            m_operators.pop_back();
+        }
+    }
+
+    template <typename T>
+    static NodeIndex add_node(std::pmr::vector<T>& pool, const T& node) {
+        pool.push_back(node);
+        return static_cast<NodeIndex>(pool.size() - 1);
+    }
+
+    // Moves the statements parsed since mark into NodeProg::stmts as one
+    // contiguous range. Nested scopes flush before their parent does, so
+    // each scope's children stay adjacent.
+    NodeScope flush_scope(const size_t mark) {
+        const NodeScope scope {
+            .first = static_cast<std::uint32_t>(m_prog.stmts.size()),
+            .count = static_cast<std::uint32_t>(m_pending_stmts.size() - mark),
+        };
+        m_prog.stmts.insert(m_prog.stmts.end(), m_pending_stmts.begin() + static_cast<std::ptrdiff_t>(mark), m_pending_stmts.end());
+        m_pending_stmts.resize(mark);
+        return scope;
+    }
+
+    // Tokens are pulled from the tokenizer into a ring buffer holding the last
+    // consumed token (for peek(-1) in diagnostics) and up to three lookahead
+    // tokens, which is as far as parse_stmt looks ("let ident =").
+    static constexpr size_t ring_size = 4;
+
+    [[nodiscard]] std::optional<Token> peek(const int offset = 0) {
+        assert(offset >= -1 && offset < static_cast<int>(ring_size) - 1);
+        const size_t index = m_index + offset;
+        if (offset < 0 && m_index == 0) {
             return {};
         }
-        return m_tokens.at(m_index + offset);
+        while (m_pulled <= index) {
+            const std::optional<Token> token = m_tokens.next();
+            if (!token.has_value()) {
+                return {};
+            }
+            m_ring[m_pulled++ % ring_size] = token.value();
+        }
+        return m_ring[index % ring_size];
     }
 
     Token consume() {
-        return m_tokens.at(m_index++);
+        const Token token = peek().value();
+        m_index++;
+        return token;
     }
 
-    Token try_consume(const TokenType type, const std::string& err_msg, int line = -1, int col = -1) {
+    Token try_consume(const TokenType type, const std::string& err_msg) {
         if (peek().has_value() && peek().value().type == type) {
             return consume();
         }
-        error(err_msg, line, col);
+        error(err_msg);
         exit(EXIT_FAILURE);
     }
 
@@ -482,7 +516,14 @@ private:
     }
 
     const std::string m_srcName;
-    const std::vector<Token> m_tokens;
+    TokenStream m_tokens;
+    const LineIndex& m_lines;
+    std::array<Token, ring_size> m_ring {};
+    size_t m_pulled = 0;
     size_t m_index = 0;
-    ArenaAllocator m_allocator;
+    NodeProg m_prog;
+    std::pmr::vector<NodeStmt> m_pending_stmts; // statements of the scopes still open
+    std::pmr::vector<OpenScope> m_open_scopes;
+    std::pmr::vector<NodeIndex> m_operands; // parse_expr
+    std::pmr::vector<TokenType> m_operators; // parse_expr
 };
\ No newline at end of file
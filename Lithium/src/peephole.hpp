@@ -0,0 +1,518 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory_resource>
+#include <optional>
+#include <ostream>
+#include <string_view>
+
+#include "instruction.hpp"
+
+// Peephole optimizer over the generator's instruction list. Instructions are
+// streamed into an output list and the rules below are retried on its tail
+// after every append, so a rewrite can enable another one further back.
+// Jumps are threaded in a separate linear pass over the whole list that
+// settles every chain of jumps at once, and both passes repeat until
+// neither changes anything, which a rewrite exposing a new chain can need.
+//
+// Rewrites never span a label or a jump: what a register or stack slot holds
+// there depends on other paths. A register is considered dead when every
+// path onward, following jumps, overwrites it before reading it.
+class Peephole {
+public:
+    enum class Rule : std::uint8_t {
+        push_pop, // push X / pop Y, and push X / add rsp, 8
+        forward, // a stack slot read right after it was stored
+        zero_adjust, // add rsp, 0
+        jump, // jumps to a jump, and jumps to the next instruction
+        copy // mov T, X / op Y, T with T dead afterwards
+    };
+
+    static constexpr size_t rule_count = 5;
+
+    explicit Peephole(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : m_out(resource), m_label_pos(resource), m_label_uses(resource), m_final(resource), m_chain(resource), m_next(resource),
+          m_label_region(resource), m_keep(resource), m_paths(resource) {
+    }
+
+    void run(std::pmr::vector<Instr>& code) {
+        size_t before;
+        do {
+            before = total();
+            stream(code);
+            thread_jumps(code);
+        } while (total() != before);
+    }
+
+    // Instructions each rule removed. For forward, loads turned into
+    // register reads; for jump, jumps retargeted or removed.
+    [[nodiscard]] size_t eliminated(const Rule rule) const {
+        return m_counts[static_cast<size_t>(rule)];
+    }
+
+    void report(std::ostream& out) const {
+        static constexpr std::array<std::string_view, rule_count> names {
+            "push/pop pairs", "store-to-load forwarding", "zero stack adjustments", "jumps to jumps", "copy propagation",
+        };
+        out << "peephole:\n";
+        for (size_t i = 0; i < rule_count; i++) {
+            out << "  " << names[i] << ": " << m_counts[i] << "\n";
+        }
+    }
+
+private:
+    // Rewrites code through m_out, retrying the tail rules after each append
+    void stream(std::pmr::vector<Instr>& code) {
+        index_labels(code);
+        m_out.clear();
+        for (size_t i = 0; i < code.size(); i++) {
+            m_out.push_back(code[i]);
+            while (reduce(code, i + 1)) {
+            }
+        }
+        code.assign(m_out.begin(), m_out.end());
+    }
+
+    // Applies the first rule that matches the tail of m_out. next is where
+    // the rest of the input starts, for liveness.
+    bool reduce(const std::pmr::vector<Instr>& code, const size_t next) {
+        const std::optional<size_t> last = previous(m_out.size());
+        if (!last.has_value()) {
+            return false;
+        }
+        Instr& instr = m_out[last.value()];
+
+        if ((instr.op == Opcode::add || instr.op == Opcode::sub) && instr.dst.is_reg(Reg::rsp) && instr.src.kind == Operand::Kind::imm && instr.src.value == 0) {
+            erase(last.value());
+            count(Rule::zero_adjust, 1);
+            return true;
+        }
+
+        const std::optional<size_t> prev = previous(last.value());
+        if (!prev.has_value()) {
+            return false;
+        }
+        Instr& prev_instr = m_out[prev.value()];
+
+        if (prev_instr.op == Opcode::push && instr.op == Opcode::pop) {
+            const Operand value = prev_instr.src;
+            const Operand dst = instr.dst;
+            if (value == dst) {
+                erase(last.value());
+                erase(prev.value());
+                count(Rule::push_pop, 2);
+                return true;
+            }
+            if (value.kind != Operand::Kind::stack || dst.kind != Operand::Kind::stack) {
+                erase(last.value());
+                prev_instr = { .op = Opcode::mov, .dst = dst, .src = value };
+                count(Rule::push_pop, 1);
+                return true;
+            }
+        }
+        if (prev_instr.op == Opcode::push && instr.op == Opcode::add && instr.dst.is_reg(Reg::rsp) && instr.src.kind == Operand::Kind::imm && instr.src.value >= 8) {
+            instr.src.value -= 8;
+            erase(prev.value());
+            count(Rule::push_pop, 1);
+            return true;
+        }
+
+        if (instr.src.kind == Operand::Kind::stack && forward(last.value())) {
+            return true;
+        }
+
+        return prev_instr.op == Opcode::mov && prev_instr.dst.kind == Operand::Kind::reg && copy(prev.value(), last.value(), code, next);
+    }
+
+    // The load at index reads a slot that an earlier instruction of the same
+    // run stored from a register still holding the value: read the register
+    bool forward(const size_t index) {
+        Instr& load = m_out[index];
+        const Operand slot = load.src;
+        std::uint32_t clobbered = 0; // registers written since the store
+        std::optional<size_t> pos = index;
+        for (size_t steps = 0; steps < forward_window; steps++) {
+            pos = previous(pos.value());
+            if (!pos.has_value()) {
+                return false;
+            }
+            const Instr& instr = m_out[pos.value()];
+            std::optional<Reg> stored;
+            if (instr.op == Opcode::mov && instr.dst == slot && instr.src.kind == Operand::Kind::reg) {
+                stored = instr.src.reg;
+            }
+            else if (instr.op == Opcode::push && slot == Operand::make_stack(0) && instr.src.kind == Operand::Kind::reg) {
+                stored = instr.src.reg;
+            }
+            if (stored.has_value()) {
+                const Reg reg = stored.value();
+                if (clobbered & bit(reg) || (reads_rdx_rax(load) && (reg == Reg::rax || reg == Reg::rdx))) {
+                    return false;
+                }
+                if (load.op == Opcode::mov && load.dst.is_reg(reg)) {
+                    erase(index);
+                }
+                else {
+                    load.src = Operand::make_reg(reg);
+                }
+                count(Rule::forward, 1);
+                return true;
+            }
+            if (is_barrier(instr) || instr.op == Opcode::push || instr.op == Opcode::pop || instr.dst.kind == Operand::Kind::stack
+                || writes(instr, Reg::rsp) || writes(instr, slot.reg)) {
+                return false;
+            }
+            clobbered |= defs(instr);
+        }
+        return false;
+    }
+
+    // mov T, X directly followed by an instruction reading T as its source
+    // (or test T, T): read X there instead when T is dead afterwards and the
+    // instruction has a form taking X
+    bool copy(const size_t mov_index, const size_t use_index, const std::pmr::vector<Instr>& code, const size_t next) {
+        const Instr mov = m_out[mov_index];
+        Instr& use = m_out[use_index];
+        const Reg temp = mov.dst.reg;
+        const Operand value = mov.src;
+        if (use.op == Opcode::test && use.dst.is_reg(temp) && use.src.is_reg(temp) && value.kind == Operand::Kind::reg) {
+            if (!dead_after(temp, code, next)) {
+                return false;
+            }
+            use.dst = value;
+            use.src = value;
+            erase(mov_index);
+            count(Rule::copy, 1);
+            return true;
+        }
+        if (temp == Reg::rsp || !use.src.is_reg(temp) || use.dst.is_reg(temp) || use.is_jump() || use.op == Opcode::test) {
+            return false;
+        }
+        if (reads_rdx_rax(use) && (temp == Reg::rax || temp == Reg::rdx)) {
+            return false; // read again as the dividend or multiplicand
+        }
+        switch (value.kind) {
+            case Operand::Kind::reg:
+                if (reads_rdx_rax(use) && (value.reg == Reg::rax || value.reg == Reg::rdx)) {
+                    return false;
+                }
+                break;
+            case Operand::Kind::stack:
+                if (use.dst.kind == Operand::Kind::stack) {
+                    return false;
+                }
+                break;
+            case Operand::Kind::imm:
+                if (reads_rdx_rax(use) || (!value.is_imm32() && !(use.op == Opcode::mov && use.dst.kind == Operand::Kind::reg))) {
+                    return false;
+                }
+                break;
+            case Operand::Kind::none:
+            case Operand::Kind::label:
+            case Operand::Kind::scaled:
+                return false;
+        }
+        if (!dead_after(temp, code, next)) {
+            return false;
+        }
+        if (use.op == Opcode::mov && use.dst == value) {
+            erase(use_index);
+            erase(mov_index);
+            count(Rule::copy, 2);
+            return true;
+        }
+        use.src = value;
+        erase(mov_index);
+        count(Rule::copy, 1);
+        return true;
+    }
+
+    // Whether reg is overwritten before it is read on every path from pos
+    // in the input, following jumps. Gives up after liveness_window
+    // instructions.
+    [[nodiscard]] bool dead_after(const Reg reg, const std::pmr::vector<Instr>& code, const size_t pos) {
+        m_paths.clear();
+        m_paths.push_back(pos);
+        size_t steps = 0;
+        while (!m_paths.empty()) {
+            size_t i = m_paths.back();
+            m_paths.pop_back();
+            while (i < code.size()) {
+                if (++steps > liveness_window) {
+                    return false;
+                }
+                const Instr& instr = code[i];
+                if (uses(instr) & bit(reg)) {
+                    return false;
+                }
+                if (defs(instr) & bit(reg)) {
+                    break;
+                }
+                if (instr.op == Opcode::jz) {
+                    m_paths.push_back(m_label_pos[instr.dst.value]);
+                }
+                i = instr.op == Opcode::jmp ? m_label_pos[instr.dst.value] : i + 1;
+            }
+        }
+        return true;
+    }
+
+    void index_labels(const std::pmr::vector<Instr>& code) {
+        m_label_pos.clear();
+        for (size_t i = 0; i < code.size(); i++) {
+            if (code[i].op == Opcode::label) {
+                const auto label = static_cast<size_t>(code[i].dst.value);
+                if (label >= m_label_pos.size()) {
+                    m_label_pos.resize(label + 1, no_label);
+                }
+                m_label_pos[label] = i;
+            }
+        }
+    }
+
+    // Retargets every jump to the label its chain of jumps ends at, drops
+    // jumps that only fall through to their label and then labels nothing
+    // jumps to. Each step is one pass over the list, however long the
+    // chains: a label's final target is found once and remembered, and
+    // jumps that fall through are found walking backward.
+    void thread_jumps(std::pmr::vector<Instr>& code) {
+        index_labels(code);
+        resolve_targets(code);
+        for (Instr& instr : code) {
+            if (instr.is_jump() && m_final[instr.dst.value] != static_cast<size_t>(instr.dst.value)) {
+                instr.dst = Operand::make_label(m_final[instr.dst.value]);
+                count(Rule::jump, 1);
+            }
+        }
+
+        // Walking backward, region counts the instructions passed; a jmp is
+        // dropped when its label was seen with nothing executed in between
+        m_label_region.assign(m_label_pos.size(), no_region);
+        m_keep.assign(code.size(), true);
+        size_t region = 0;
+        for (size_t i = code.size(); i-- > 0;) {
+            const Instr& instr = code[i];
+            if (instr.op == Opcode::label) {
+                m_label_region[instr.dst.value] = region;
+            }
+            else if (instr.op == Opcode::jmp && m_label_region[instr.dst.value] == region) {
+                m_keep[i] = false;
+                count(Rule::jump, 1);
+            }
+            else if (instr.op != Opcode::comment) {
+                region++;
+            }
+        }
+
+        m_out.clear();
+        m_label_uses.assign(m_label_pos.size(), 0);
+        for (size_t i = 0; i < code.size(); i++) {
+            if (!m_keep[i]) {
+                continue;
+            }
+            if (code[i].is_jump()) {
+                m_label_uses[code[i].dst.value]++;
+            }
+            m_out.push_back(code[i]);
+        }
+        code.clear();
+        for (const Instr& instr : m_out) {
+            if (instr.op != Opcode::label || m_label_uses[instr.dst.value] != 0) {
+                code.push_back(instr);
+            }
+        }
+    }
+
+    // m_final[label]: the label reached from label by following the jumps
+    // found right after it. Each chain is walked once and every label on
+    // it remembers where it ends; one that loops back on itself ends at the
+    // label closing the loop, which jumping to is just as good.
+    void resolve_targets(const std::pmr::vector<Instr>& code) {
+        m_next.resize(code.size() + 1);
+        m_next[code.size()] = code.size();
+        for (size_t i = code.size(); i-- > 0;) {
+            m_next[i] = code[i].op == Opcode::label || code[i].op == Opcode::comment ? m_next[i + 1] : i;
+        }
+
+        m_final.assign(m_label_pos.size(), unresolved);
+        for (size_t label = 0; label < m_label_pos.size(); label++) {
+            if (m_label_pos[label] == no_label) {
+                m_final[label] = label;
+            }
+        }
+        for (size_t label = 0; label < m_label_pos.size(); label++) {
+            if (m_final[label] != unresolved) {
+                continue;
+            }
+            m_chain.clear();
+            size_t at = label;
+            size_t end;
+            while (true) {
+                m_final[at] = in_chain;
+                m_chain.push_back(at);
+                const size_t next = m_next[m_label_pos[at]];
+                if (next == code.size() || code[next].op != Opcode::jmp) {
+                    end = at;
+                    break;
+                }
+                const auto to = static_cast<size_t>(code[next].dst.value);
+                if (m_final[to] == in_chain) {
+                    end = to;
+                    break;
+                }
+                if (m_final[to] != unresolved) {
+                    end = m_final[to];
+                    break;
+                }
+                at = to;
+            }
+            for (const size_t l : m_chain) {
+                m_final[l] = end;
+            }
+        }
+    }
+
+    // Last instruction of m_out before pos that isn't a comment
+    [[nodiscard]] std::optional<size_t> previous(size_t pos) const {
+        while (pos-- > 0) {
+            if (m_out[pos].op != Opcode::comment) {
+                return pos;
+            }
+        }
+        return {};
+    }
+
+    void erase(const size_t index) {
+        m_out.erase(m_out.begin() + static_cast<std::ptrdiff_t>(index));
+    }
+
+    void count(const Rule rule, const size_t n) {
+        m_counts[static_cast<size_t>(rule)] += n;
+    }
+
+    [[nodiscard]] size_t total() const {
+        size_t sum = 0;
+        for (const size_t n : m_counts) {
+            sum += n;
+        }
+        return sum;
+    }
+
+    static constexpr std::uint32_t bit(const Reg reg) {
+        return 1u << static_cast<unsigned>(reg);
+    }
+
+    // mul and div, which have no immediate form and read rax (and rdx)
+    // besides their operand
+    [[nodiscard]] static bool reads_rdx_rax(const Instr& instr) {
+        return instr.op == Opcode::mul || instr.op == Opcode::div;
+    }
+
+    // Instructions no rule looks across
+    [[nodiscard]] static bool is_barrier(const Instr& instr) {
+        return instr.op == Opcode::label || instr.is_jump() || instr.op == Opcode::syscall || instr.op == Opcode::ret;
+    }
+
+    [[nodiscard]] static std::uint32_t reg_bit(const Operand& operand) {
+        return operand.kind == Operand::Kind::reg ? bit(operand.reg) : 0;
+    }
+
+    // Base register of a stack slot operand, which addressing it reads
+    [[nodiscard]] static std::uint32_t base_bit(const Operand& operand) {
+        return operand.kind == Operand::Kind::stack ? bit(operand.reg) : 0;
+    }
+
+    // Registers an instruction reads
+    [[nodiscard]] static std::uint32_t uses(const Instr& instr) {
+        return base_bit(instr.dst) | base_bit(instr.src) | value_uses(instr);
+    }
+
+    // Registers whose values an instruction reads
+    [[nodiscard]] static std::uint32_t value_uses(const Instr& instr) {
+        switch (instr.op) {
+            case Opcode::mov:
+            case Opcode::push:
+                return reg_bit(instr.src);
+            case Opcode::add:
+            case Opcode::sub:
+            case Opcode::imul:
+            case Opcode::test:
+                return reg_bit(instr.dst) | reg_bit(instr.src);
+            case Opcode::shl:
+            case Opcode::shr:
+                return reg_bit(instr.dst);
+            case Opcode::lea:
+                return bit(instr.src.reg);
+            case Opcode::mul:
+                return bit(Reg::rax) | reg_bit(instr.src);
+            case Opcode::div:
+                return bit(Reg::rax) | bit(Reg::rdx) | reg_bit(instr.src);
+            case Opcode::syscall:
+                return bit(Reg::rax) | bit(Reg::rdi) | bit(Reg::rsi) | bit(Reg::rdx) | bit(Reg::r10) | bit(Reg::r8) | bit(Reg::r9);
+            case Opcode::ret:
+                // The result and the registers restored for the caller
+                return bit(Reg::rax) | bit(Reg::rbx) | bit(Reg::rsp) | bit(Reg::rbp) | bit(Reg::r12) | bit(Reg::r13) | bit(Reg::r14) | bit(Reg::r15);
+            case Opcode::clear:
+            case Opcode::pop:
+            case Opcode::jmp:
+            case Opcode::jz:
+            case Opcode::label:
+            case Opcode::comment:
+                return 0;
+        }
+        return 0;
+    }
+
+    // Registers an instruction writes
+    [[nodiscard]] static std::uint32_t defs(const Instr& instr) {
+        switch (instr.op) {
+            case Opcode::mov:
+            case Opcode::add:
+            case Opcode::sub:
+            case Opcode::imul:
+            case Opcode::clear:
+            case Opcode::pop:
+            case Opcode::shl:
+            case Opcode::shr:
+            case Opcode::lea:
+                return reg_bit(instr.dst);
+            case Opcode::mul:
+            case Opcode::div:
+                return bit(Reg::rax) | bit(Reg::rdx);
+            case Opcode::syscall:
+                return bit(Reg::rax) | bit(Reg::rcx) | bit(Reg::r11);
+            case Opcode::test:
+            case Opcode::push:
+            case Opcode::ret:
+            case Opcode::jmp:
+            case Opcode::jz:
+            case Opcode::label:
+            case Opcode::comment:
+                return 0;
+        }
+        return 0;
+    }
+
+    [[nodiscard]] static bool writes(const Instr& instr, const Reg reg) {
+        return (defs(instr) & bit(reg)) != 0;
+    }
+
+    static constexpr size_t forward_window = 8;
+    static constexpr size_t liveness_window = 32;
+    static constexpr size_t no_label = SIZE_MAX;
+    static constexpr size_t no_region = SIZE_MAX;
+    static constexpr size_t unresolved = SIZE_MAX;
+    static constexpr size_t in_chain = SIZE_MAX - 1;
+
+    std::pmr::vector<Instr> m_out;
+    std::pmr::vector<size_t> m_label_pos; // by label number
+    std::pmr::vector<std::uint32_t> m_label_uses; // by label number
+    std::pmr::vector<size_t> m_final; // by label number: where its chain of jumps ends
+    std::pmr::vector<size_t> m_chain; // labels of the chain being resolved
+    std::pmr::vector<size_t> m_next; // by position: the first instruction there or after, labels and comments aside
+    std::pmr::vector<size_t> m_label_region; // by label number, for finding jumps that fall through
+    std::pmr::vector<bool> m_keep; // by position
+    std::pmr::vector<size_t> m_paths; // dead_after worklist
+    std::array<size_t, rule_count> m_counts {};
+};
@@ -0,0 +1,231 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory_resource>
+#include <optional>
+
+#include "instruction.hpp"
+#include "ir.hpp"
+
+// Linear-scan register allocation (Poletto & Sarkar) over the values of the
+// IR, shared by the backends: each passes the size of its register pool and
+// maps the indices it gets back to its own registers.
+//
+// Blocks are stored in a topological order, so a value is live from its
+// definition to its last use in that order, and the interval is exact
+// enough: nothing can flow back into it. A phi argument is used at the end
+// of its predecessor. Intervals are assigned registers in order of their
+// start; when none is free the one reaching furthest is spilled. Spilled
+// intervals get stack slots by a second scan of the same kind, so values
+// that are never live at once share one and the frame is only as big as the
+// most of them live at a time. Constants get neither; the backends use them
+// as immediates.
+class RegisterAllocator {
+public:
+    RegisterAllocator(const IrProg& ir, const size_t reg_count, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : m_ir(ir), m_reg_count(reg_count), m_ends(ir.values.size(), resource), m_regs(ir.values.size(), resource),
+          m_slots(ir.values.size(), no_slot, resource), m_active(resource), m_free(resource), m_free_slots(resource) {
+    }
+
+    void allocate() {
+        compute_intervals();
+        scan();
+        assign_slots();
+    }
+
+    // Index into the backend's pool of the register holding v, or nothing if
+    // it lives in a stack slot or is a constant
+    [[nodiscard]] std::optional<std::uint8_t> reg(const ValueId v) const {
+        return m_regs[v];
+    }
+
+    [[nodiscard]] std::uint32_t slot(const ValueId v) const {
+        return m_slots[v];
+    }
+
+    [[nodiscard]] std::uint32_t slot_count() const {
+        return m_slot_count;
+    }
+
+private:
+    static constexpr std::uint32_t no_slot = UINT32_MAX;
+
+    // Positions: value v is defined at 2v and a block's terminator, which
+    // also reads the phi arguments for its successor, comes just before the
+    // next block's first definition. A phi can then take the register of an
+    // argument whose last use is that terminator.
+    static std::uint32_t def_pos(const ValueId v) {
+        return 2 * v;
+    }
+
+    static std::uint32_t term_pos(const IrBlock& block) {
+        return 2 * block.end() - 1;
+    }
+
+    [[nodiscard]] ValueId last_phi(const IrBlock& block) const {
+        ValueId v = block.first;
+        while (v + 1 < block.end() && m_ir.values[v + 1].op == IrOp::phi) {
+            v++;
+        }
+        return v;
+    }
+
+    void use(const ValueId v, const std::uint32_t pos) {
+        m_ends[v] = std::max(m_ends[v], pos);
+    }
+
+    void compute_intervals() {
+        for (ValueId v = 0; v < m_ir.values.size(); v++) {
+            m_ends[v] = def_pos(v);
+        }
+        for (BlockId b = 0; b < m_ir.blocks.size(); b++) {
+            const IrBlock& block = m_ir.blocks[b];
+            for (ValueId v = block.first; v < block.end(); v++) {
+                const IrValue& value = m_ir.values[v];
+                if (value.is_bin()) {
+                    use(value.a, def_pos(v));
+                    use(value.b, def_pos(v));
+                }
+                else if (value.op == IrOp::phi) {
+                    // The phis of a block are all written by the same copies
+                    // at the end of each predecessor, so they are live together
+                    use(v, def_pos(last_phi(block)));
+                    for (std::uint32_t i = 0; i < block.pred_count; i++) {
+                        use(m_ir.phi_args[value.a + i], term_pos(m_ir.blocks[m_ir.preds[block.first_pred + i]]));
+                    }
+                }
+            }
+            if (block.term.kind != TermKind::jump) {
+                use(block.term.value, term_pos(block));
+            }
+        }
+    }
+
+    void scan() {
+        m_free.clear();
+        for (size_t r = m_reg_count; r-- > 0;) {
+            m_free.push_back(static_cast<std::uint8_t>(r));
+        }
+        for (ValueId v = 0; v < m_ir.values.size(); v++) {
+            if (m_ir.values[v].op == IrOp::const_) {
+                continue;
+            }
+
+            // Expire intervals that ended before this one starts
+            for (size_t a = 0; a < m_active.size();) {
+                if (m_ends[m_active[a]] < def_pos(v)) {
+                    m_free.push_back(m_regs[m_active[a]].value());
+                    m_active[a] = m_active.back();
+                    m_active.pop_back();
+                }
+                else {
+                    a++;
+                }
+            }
+
+            if (!m_free.empty()) {
+                m_regs[v] = m_free.back();
+                m_free.pop_back();
+                m_active.push_back(v);
+                continue;
+            }
+            if (m_active.empty()) {
+                continue; // an empty pool
+            }
+
+            // Spill whichever of the active intervals and this one ends last
+            size_t furthest = 0;
+            for (size_t a = 1; a < m_active.size(); a++) {
+                if (m_ends[m_active[a]] > m_ends[m_active[furthest]]) {
+                    furthest = a;
+                }
+            }
+            const ValueId victim = m_active[furthest];
+            if (m_ends[victim] > m_ends[v]) {
+                m_regs[v] = m_regs[victim];
+                m_regs[victim].reset();
+                m_active[furthest] = v;
+            }
+        }
+    }
+
+    // Linear scan again over the spilled intervals, with an unbounded pool
+    // of slots
+    void assign_slots() {
+        m_active.clear();
+        m_free_slots.clear();
+        for (ValueId v = 0; v < m_ir.values.size(); v++) {
+            if (m_ir.values[v].op == IrOp::const_ || m_regs[v].has_value()) {
+                continue;
+            }
+            for (size_t a = 0; a < m_active.size();) {
+                if (m_ends[m_active[a]] < def_pos(v)) {
+                    m_free_slots.push_back(m_slots[m_active[a]]);
+                    m_active[a] = m_active.back();
+                    m_active.pop_back();
+                }
+                else {
+                    a++;
+                }
+            }
+            if (m_free_slots.empty()) {
+                m_slots[v] = m_slot_count++;
+            }
+            else {
+                m_slots[v] = m_free_slots.back();
+                m_free_slots.pop_back();
+            }
+            m_active.push_back(v);
+        }
+    }
+
+    const IrProg& m_ir;
+    const size_t m_reg_count;
+    std::pmr::vector<std::uint32_t> m_ends; // interval end, by value
+    std::pmr::vector<std::optional<std::uint8_t>> m_regs; // by value
+    std::pmr::vector<std::uint32_t> m_slots; // by value
+    std::uint32_t m_slot_count = 0;
+    std::pmr::vector<ValueId> m_active; // values holding a register, then a slot
+    std::pmr::vector<std::uint8_t> m_free;
+    std::pmr::vector<std::uint32_t> m_free_slots;
+};
+
+// One copy of a parallel assignment, such as the phi copies on an edge
+struct Move {
+    Operand dst;
+    Operand src;
+};
+
+// Orders the copies of a parallel assignment so that none overwrites a
+// location that another still has to read, calling emit(dst, src) for each.
+// A cycle is broken by first copying one of its locations to temp, which no
+// copy may read or write.
+template <typename Emit>
+void sequentialize(std::pmr::vector<Move>& moves, const Operand& temp, Emit emit) {
+    std::erase_if(moves, [](const Move& move) { return move.dst == move.src; });
+    while (!moves.empty()) {
+        bool progress = false;
+        for (size_t i = 0; i < moves.size(); i++) {
+            const Operand dst = moves[i].dst;
+            const bool read = std::any_of(moves.begin(), moves.end(), [&](const Move& move) { return move.src == dst; });
+            if (!read) {
+                emit(dst, moves[i].src);
+                moves.erase(moves.begin() + static_cast<std::ptrdiff_t>(i));
+                progress = true;
+                break;
+            }
+        }
+        if (progress) {
+            continue;
+        }
+        // Only cycles are left: save one location so it can be overwritten
+        const Operand saved = moves.front().dst;
+        emit(temp, saved);
+        for (Move& move : moves) {
+            if (move.src == saved) {
+                move.src = temp;
+            }
+        }
+    }
+}
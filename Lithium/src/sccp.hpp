@@ -0,0 +1,240 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <memory_resource>
+#include <ostream>
+#include <string_view>
+
+#include "ir.hpp"
+
+// Sparse conditional constant propagation (Wegman & Zadeck) over the IR.
+// Each value is unknown (not reached yet), a constant, or varying, and only
+// edges that can be taken are followed: a branch on a constant reaches one
+// arm, and a phi only meets the arguments of edges taken. A variable that
+// gets the same constant in every arm taken, or is computed from such
+// variables, is then known, where folding the AST alone can't see it.
+//
+// The language only branches forward, so there are no back edges to
+// revisit: one pass over the blocks in their topological order sees every
+// value after its operands and every phi after its predecessors, and gives
+// the same result as the worklists of the general algorithm.
+//
+// The result is a copy of the program with known values turned into
+// constants and branches on them into jumps. Blocks that can't be reached
+// stay, without predecessors, for DeadCodeEliminator to remove with
+// whatever else is no longer used. Divisions by zero are left to trap.
+class ConstantPropagator {
+public:
+    enum class Stat : std::uint8_t {
+        values, // values found constant
+        branches // branches found to go one way
+    };
+
+    static constexpr size_t stat_count = 2;
+
+    // The new program is allocated from resource
+    explicit ConstantPropagator(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : m_resource(resource), m_cells(resource), m_terms(resource), m_reachable(resource), m_map(resource) {
+    }
+
+    [[nodiscard]] IrProg run(const IrProg& ir) {
+        propagate(ir);
+        return rewrite(ir);
+    }
+
+    [[nodiscard]] size_t found(const Stat stat) const {
+        return m_counts[static_cast<size_t>(stat)];
+    }
+
+    void report(std::ostream& out) const {
+        static constexpr std::array<std::string_view, stat_count> names {
+            "constant values", "one-way branches",
+        };
+        out << "constant propagation:\n";
+        for (size_t i = 0; i < stat_count; i++) {
+            out << "  " << names[i] << ": " << m_counts[i] << "\n";
+        }
+    }
+
+private:
+    // A value's place in the lattice: unknown above every constant, varying
+    // below them
+    struct Cell {
+        enum class Kind : std::uint8_t {
+            unknown,
+            constant,
+            varying
+        };
+
+        Kind kind = Kind::unknown;
+        std::uint64_t value = 0;
+
+        static Cell make_const(const std::uint64_t value) {
+            return { .kind = Kind::constant, .value = value };
+        }
+
+        static Cell make_varying() {
+            return { .kind = Kind::varying, .value = 0 };
+        }
+
+        [[nodiscard]] bool is_const() const {
+            return kind == Kind::constant;
+        }
+
+        friend Cell meet(const Cell& a, const Cell& b) {
+            if (a.kind == Kind::unknown) {
+                return b;
+            }
+            if (b.kind == Kind::unknown) {
+                return a;
+            }
+            if (a.is_const() && b.is_const() && a.value == b.value) {
+                return a;
+            }
+            return make_varying();
+        }
+    };
+
+    void propagate(const IrProg& ir) {
+        m_cells.assign(ir.values.size(), Cell {});
+        m_terms.clear();
+        m_reachable.assign(ir.blocks.size(), false);
+        m_reachable[0] = true;
+        for (BlockId b = 0; b < ir.blocks.size(); b++) {
+            const IrBlock& block = ir.blocks[b];
+            IrTerm term = block.term;
+            if (!m_reachable[b]) {
+                m_terms.push_back(term);
+                continue;
+            }
+            for (ValueId v = block.first; v < block.end(); v++) {
+                m_cells[v] = evaluate(ir, b, ir.values[v]);
+            }
+            if (term.kind == TermKind::branch && m_cells[term.value].is_const()) {
+                term = { .kind = TermKind::jump, .value = 0, .target = m_cells[term.value].value != 0 ? term.target : term.alt, .alt = 0 };
+            }
+            if (term.kind != TermKind::exit) {
+                m_reachable[term.target] = true;
+            }
+            if (term.kind == TermKind::branch) {
+                m_reachable[term.alt] = true;
+            }
+            m_terms.push_back(term);
+        }
+    }
+
+    [[nodiscard]] Cell evaluate(const IrProg& ir, const BlockId b, const IrValue& value) const {
+        switch (value.op) {
+            case IrOp::const_:
+                return Cell::make_const(value.constant());
+            case IrOp::phi: {
+                const IrBlock& block = ir.blocks[b];
+                Cell cell;
+                for (std::uint32_t i = 0; i < block.pred_count; i++) {
+                    if (has_edge(ir.preds[block.first_pred + i], b)) {
+                        cell = meet(cell, m_cells[ir.phi_args[value.a + i]]);
+                    }
+                }
+                return cell;
+            }
+            default:
+                break;
+        }
+        const Cell& lhs = m_cells[value.a];
+        const Cell& rhs = m_cells[value.b];
+        // x * 0 is 0 whatever x is
+        if (value.op == IrOp::mul && ((lhs.is_const() && lhs.value == 0) || (rhs.is_const() && rhs.value == 0))) {
+            return Cell::make_const(0);
+        }
+        if (!lhs.is_const() || !rhs.is_const() || (value.op == IrOp::div && rhs.value == 0)) {
+            return Cell::make_varying();
+        }
+        switch (value.op) {
+            case IrOp::add:
+                return Cell::make_const(lhs.value + rhs.value);
+            case IrOp::sub:
+                return Cell::make_const(lhs.value - rhs.value);
+            case IrOp::mul:
+                return Cell::make_const(lhs.value * rhs.value);
+            case IrOp::div:
+                return Cell::make_const(lhs.value / rhs.value);
+            default:
+                return Cell::make_varying();
+        }
+    }
+
+    // Whether the edge from pred to block can be taken, as far as known
+    [[nodiscard]] bool has_edge(const BlockId pred, const BlockId block) const {
+        if (!m_reachable[pred]) {
+            return false;
+        }
+        const IrTerm& term = m_terms[pred];
+        return term.kind != TermKind::exit && (term.target == block || (term.kind == TermKind::branch && term.alt == block));
+    }
+
+    // Copies the program with the constants in. A phi found constant
+    // becomes a constant after the block's remaining phis, which have to
+    // stay first, so values are renumbered within their blocks.
+    IrProg rewrite(const IrProg& ir) {
+        m_map.resize(ir.values.size());
+        for (const IrBlock& block : ir.blocks) {
+            ValueId next = block.first;
+            for (int pass = 0; pass < 2; pass++) {
+                for (ValueId v = block.first; v < block.end(); v++) {
+                    const bool phi = ir.values[v].op == IrOp::phi && !m_cells[v].is_const();
+                    if (phi == (pass == 0)) {
+                        m_map[v] = next++;
+                    }
+                }
+            }
+        }
+
+        IrProg out(m_resource);
+        out.values.resize(ir.values.size());
+        out.blocks.assign(ir.blocks.begin(), ir.blocks.end());
+        out.preds.assign(ir.preds.begin(), ir.preds.end());
+        out.phi_args.reserve(ir.phi_args.size());
+        for (const ValueId arg : ir.phi_args) {
+            out.phi_args.push_back(m_map[arg]);
+        }
+        for (ValueId v = 0; v < ir.values.size(); v++) {
+            IrValue value = ir.values[v];
+            if (m_cells[v].is_const() && value.op != IrOp::const_) {
+                value = IrValue::make_const(m_cells[v].value);
+                count(Stat::values, 1);
+            }
+            else if (value.is_bin()) {
+                value.a = m_map[value.a];
+                value.b = m_map[value.b];
+            }
+            out.values[m_map[v]] = value;
+        }
+
+        for (BlockId b = 0; b < ir.blocks.size(); b++) {
+            const IrTerm& before = ir.blocks[b].term;
+            IrTerm term = m_terms[b];
+            if (before.kind == TermKind::branch && term.kind == TermKind::jump) {
+                // The arm not taken has no other predecessor
+                out.blocks[term.target == before.target ? before.alt : before.target].pred_count = 0;
+                count(Stat::branches, 1);
+            }
+            if (term.kind != TermKind::jump) {
+                term.value = m_map[term.value];
+            }
+            out.blocks[b].term = term;
+        }
+        return out;
+    }
+
+    void count(const Stat stat, const size_t n) {
+        m_counts[static_cast<size_t>(stat)] += n;
+    }
+
+    std::pmr::memory_resource* m_resource;
+    std::pmr::vector<Cell> m_cells; // by value
+    std::pmr::vector<IrTerm> m_terms; // by block, with the branches found one way as jumps
+    std::pmr::vector<bool> m_reachable; // by block
+    std::pmr::vector<ValueId> m_map; // old value to new
+    std::array<size_t, stat_count> m_counts {};
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <cassert>
+#include <memory_resource>
+#include <optional>
+
+#include "interner.hpp"
+
+// Maps the Symbols in scope to a T, with nested scopes. Symbols are dense
+// ids, so the table is a vector indexed by Symbol and every lookup is one
+// load, with no hashing or string compares. Declarations go to an undo log;
+// end_scope unbinds the ones made since the matching begin_scope, in time
+// proportional to their number.
+template <typename T>
+class ScopedTable {
+public:
+    explicit ScopedTable(const size_t symbol_count, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : m_values(symbol_count, std::nullopt, resource), m_declared(resource), m_scopes(resource) {
+    }
+
+    [[nodiscard]] bool contains(const Symbol symbol) const {
+        return m_values[symbol].has_value();
+    }
+
+    [[nodiscard]] const std::optional<T>& find(const Symbol symbol) const {
+        return m_values[symbol];
+    }
+
+    // Binds symbol, which must be unbound, until the innermost scope ends
+    void declare(const Symbol symbol, const T& value) {
+        assert(!contains(symbol));
+        m_values[symbol] = value;
+        m_declared.push_back(symbol);
+    }
+
+    // Changes what symbol is bound to, or unbinds it, without touching the
+    // scope it belongs to; for callers rolling back their own changes
+    void assign(const Symbol symbol, const std::optional<T>& value) {
+        m_values[symbol] = value;
+    }
+
+    void begin_scope() {
+        m_scopes.push_back(m_declared.size());
+    }
+
+    void end_scope() {
+        while (m_declared.size() > m_scopes.back()) {
+            m_values[m_declared.back()].reset();
+            m_declared.pop_back();
+        }
+        m_scopes.pop_back();
+    }
+
+private:
+    std::pmr::vector<std::optional<T>> m_values; // by Symbol
+    std::pmr::vector<Symbol> m_declared; // declaration order, for end_scope
+    std::pmr::vector<size_t> m_scopes; // size of m_declared when each open scope began
+};
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <array>
+#include <bit>
+#include <cassert>
+#include <cstdint>
+#include <optional>
+
+// Constants for lowering multiplication and division by a constant to
+// cheaper instructions, shared by the x86 backends
+
+// Unsigned division by d as a multiplication by a scaled
+// reciprocal (Granlund & Montgomery, "Division by Invariant Integers using
+// Multiplication"). With mulhi the high 64 bits of the 128-bit product, for
+// every 64-bit x:
+//
+//     x / d == mulhi(x >> pre_shift, multiplier) >> post_shift
+//
+// or, when add is set because the reciprocal needs 65 bits and d is odd,
+//
+//     q = mulhi(x, multiplier)
+//     x / d == (((x - q) >> 1) + q) >> post_shift
+struct DivMagic {
+    std::uint64_t multiplier;
+    std::uint8_t pre_shift;
+    std::uint8_t post_shift;
+    bool add;
+};
+
+// (hi * 2^64 + lo) / d by shift and subtract, for hi < d
+inline std::uint64_t div_wide(std::uint64_t hi, std::uint64_t lo, const std::uint64_t d, std::uint64_t& rem) {
+    assert(hi < d);
+    std::uint64_t q = 0;
+    for (int i = 0; i < 64; i++) {
+        const bool carry = (hi >> 63) != 0; // the shifted remainder is past 2^64, so above d
+        hi = hi << 1 | lo >> 63;
+        lo <<= 1;
+        q <<= 1;
+        if (carry || hi >= d) {
+            hi -= d;
+            q |= 1;
+        }
+    }
+    rem = hi;
+    return q;
+}
+
+// d must be neither 0 nor a power of two, which are a trap and a shift.
+//
+// With l = floor(log2 d), m = ceil(2^(64+l) / d) fits 64 bits and
+// floor(x * m / 2^(64+l)) == x / d whenever x * (m * d - 2^(64+l)) < 2^(64+l),
+// which holds for all 64-bit x if that error is at most 2^l. Otherwise an
+// even d is split into 2^p * d': x >> p has only 64-p bits, for which the
+// reciprocal of d' always is exact. An odd d gets the 65-bit reciprocal
+// 2^64 + multiplier with one more bit of precision, whose top bit the add
+// form applies.
+inline DivMagic div_magic(const std::uint64_t d) {
+    assert(d != 0 && !std::has_single_bit(d));
+    const auto l = static_cast<std::uint8_t>(std::bit_width(d) - 1);
+    std::uint64_t rem;
+    const std::uint64_t m = div_wide(std::uint64_t { 1 } << l, 0, d, rem);
+    if (d - rem <= std::uint64_t { 1 } << l) {
+        return { .multiplier = m + 1, .pre_shift = 0, .post_shift = l, .add = false };
+    }
+    if (d % 2 == 0) {
+        const auto p = static_cast<std::uint8_t>(std::countr_zero(d));
+        const std::uint64_t odd = d >> p;
+        const auto odd_l = static_cast<std::uint8_t>(std::bit_width(odd) - 1);
+        const std::uint64_t odd_m = div_wide(std::uint64_t { 1 } << odd_l, 0, odd, rem);
+        return { .multiplier = odd_m + 1, .pre_shift = p, .post_shift = odd_l, .add = false };
+    }
+    // floor(2^(65+l) / d), less 2^64, from the quotient and remainder above
+    const std::uint64_t twice_rem = rem + rem;
+    const bool carry = twice_rem >= d || twice_rem < rem;
+    return { .multiplier = m + m + (carry ? 1 : 0) + 1, .pre_shift = 0, .post_shift = l, .add = true };
+}
+
+// Shift and lea steps multiplying by c: c == odd * 2^shift, where odd is
+// the product of factors, each 3, 5 or 9 (lea r, [r+r*2], [r+r*4],
+// [r+r*8]) or 1 when unused
+struct MulSteps {
+    std::array<std::uint8_t, 2> factors;
+    std::uint8_t shift;
+};
+
+// The steps for c, if it has that form. c must not be 0.
+inline std::optional<MulSteps> mul_steps(const std::uint64_t c) {
+    assert(c != 0);
+    const auto shift = static_cast<std::uint8_t>(std::countr_zero(c));
+    const std::uint64_t odd = c >> shift;
+    static constexpr std::array<std::uint8_t, 4> leas { 1, 3, 5, 9 };
+    for (const std::uint8_t a : leas) {
+        for (const std::uint8_t b : leas) {
+            if (a <= b && std::uint64_t { a } * b == odd) {
+                return MulSteps { .factors = { a, b }, .shift = shift };
+            }
+        }
+    }
+    return {};
+}
@@ -1,11 +1,25 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory_resource>
 #include <string>
+#include <string_view>
 #include <vector>
 #include <optional>
 #include <iostream>
+#include <thread>
 
-enum class TokenType {
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "interner.hpp"
+
+enum class TokenType : std::uint8_t {
     _exit,
     int_lit,
     semi,
@@ -43,179 +57,563 @@ inline std::optional<int> bin_prec(const TokenType type) {
 
 struct Token {
     TokenType type;
-    int line;
-    int col;
-    std::optional<std::string> value {};
+    std::uint32_t pos; // source offset of the first character
+    std::uint64_t value = 0; // int_lit: the parsed literal, ident: its Symbol
+
+    [[nodiscard]] Symbol symbol() const {
+        return static_cast<Symbol>(value);
+    }
+};
+
+static_assert(sizeof(Token) == 16);
+
+// Structure-of-arrays token storage for when the whole stream is kept:
+// one byte of kind and four bytes of offset per token, with the payloads
+// of idents and int_lits in side tables read back in token order.
+struct TokenBuffer {
+    explicit TokenBuffer(std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : kinds(resource), offsets(resource), symbols(resource), literals(resource)
+    {
+    }
+
+    std::pmr::vector<TokenType> kinds;
+    std::pmr::vector<std::uint32_t> offsets;
+    std::pmr::vector<Symbol> symbols;
+    std::pmr::vector<std::uint64_t> literals;
+
+    void push(const Token& token) {
+        kinds.push_back(token.type);
+        offsets.push_back(token.pos);
+        if (token.type == TokenType::ident) {
+            symbols.push_back(token.symbol());
+        }
+        else if (token.type == TokenType::int_lit) {
+            literals.push_back(token.value);
+        }
+    }
+
+    [[nodiscard]] size_t size() const {
+        return kinds.size();
+    }
+};
+
+// Maps source offsets to line/column. The newline table is only built the
+// first time a diagnostic asks for a location.
+class LineIndex {
+public:
+    struct Location {
+        size_t line;
+        size_t col;
+    };
+
+    explicit LineIndex(std::string_view src, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : m_src(src), m_line_starts(resource)
+    {
+    }
+
+    [[nodiscard]] std::string_view source() const {
+        return m_src;
+    }
+
+    [[nodiscard]] Location locate(const size_t pos) const {
+        if (m_line_starts.empty()) {
+            m_line_starts.push_back(0);
+            const char* const begin = m_src.data();
+            const char* it = begin;
+            const char* const end = begin + m_src.size();
+            while ((it = static_cast<const char*>(std::memchr(it, '\n', end - it))) != nullptr) {
+                m_line_starts.push_back(static_cast<size_t>(++it - begin));
+            }
+        }
+        const auto line = std::upper_bound(m_line_starts.begin(), m_line_starts.end(), pos);
+        return { .line = static_cast<size_t>(line - m_line_starts.begin()), .col = pos - *(line - 1) + 1 };
+    }
+
+private:
+    std::string_view m_src;
+    mutable std::pmr::vector<size_t> m_line_starts;
+};
+
+enum CharClass : std::uint8_t {
+    cc_alpha = 1 << 0,
+    cc_digit = 1 << 1,
+    cc_space = 1 << 2,
+    cc_punct = 1 << 3,
+};
+
+// Classification of every byte, so the lexer's main loop is one table load
+// instead of a chain of <cctype> calls. Bytes >= 0x80 stay unclassified.
+inline constexpr std::array<std::uint8_t, 256> char_classes = [] {
+    std::array<std::uint8_t, 256> table {};
+    for (int c = 'a'; c <= 'z'; c++) {
+        table[c] |= cc_alpha;
+        table[c - 'a' + 'A'] |= cc_alpha;
+    }
+    for (int c = '0'; c <= '9'; c++) {
+        table[c] |= cc_digit;
+    }
+    for (const char c : { ' ', '\t', '\n', '\v', '\f', '\r' }) {
+        table[static_cast<unsigned char>(c)] |= cc_space;
+    }
+    for (const char c : { '(', ')', ';', '=', '+', '*', '-', '/', '{', '}' }) {
+        table[static_cast<unsigned char>(c)] |= cc_punct;
+    }
+    return table;
+}();
+
+struct PunctToken {
+    TokenType type;
+    // Set for operators that have a compound assignment form ('+' -> "+=")
+    std::optional<TokenType> with_eq {};
 };
 
+inline constexpr std::array<std::optional<PunctToken>, 256> punct_tokens = [] {
+    std::array<std::optional<PunctToken>, 256> table {};
+    table['('] = PunctToken { .type = TokenType::open_paren };
+    table[')'] = PunctToken { .type = TokenType::close_paren };
+    table[';'] = PunctToken { .type = TokenType::semi };
+    table['='] = PunctToken { .type = TokenType::eq };
+    table['{'] = PunctToken { .type = TokenType::open_curly };
+    table['}'] = PunctToken { .type = TokenType::close_curly };
+    table['+'] = PunctToken { .type = TokenType::plus, .with_eq = TokenType::pluseq };
+    table['*'] = PunctToken { .type = TokenType::star, .with_eq = TokenType::stareq };
+    table['-'] = PunctToken { .type = TokenType::minus, .with_eq = TokenType::minuseq };
+    table['/'] = PunctToken { .type = TokenType::fslash, .with_eq = TokenType::fslasheq };
+    return table;
+}();
+
+struct Keyword {
+    std::string_view text;
+    TokenType type;
+};
+
+// Perfect hash over the keyword set: (first + last + length) & 7 gives every
+// keyword its own slot, so a lookup is one probe and one compare.
+constexpr std::size_t keyword_hash(const std::string_view word) {
+    return (static_cast<unsigned char>(word.front()) + static_cast<unsigned char>(word.back()) + word.size()) & 7;
+}
+
+inline constexpr std::array<std::optional<Keyword>, 8> keywords = [] {
+    std::array<std::optional<Keyword>, 8> table {};
+    for (const Keyword keyword : {
+             Keyword { "exit", TokenType::_exit },
+             Keyword { "let", TokenType::let },
+             Keyword { "if", TokenType::if_ },
+             Keyword { "else", TokenType::else_ },
+         }) {
+        if (table[keyword_hash(keyword.text)].has_value()) {
+            throw "keyword_hash collision"; // not a constant expression: fails the build
+        }
+        table[keyword_hash(keyword.text)] = keyword;
+    }
+    return table;
+}();
+
+inline std::optional<TokenType> lookup_keyword(const std::string_view word) {
+    const std::optional<Keyword>& keyword = keywords[keyword_hash(word)];
+    if (keyword.has_value() && keyword->text == word) {
+        return keyword->type;
+    }
+    return {};
+}
+
 class Tokenizer {
 public:
-    explicit Tokenizer(std::string src, std::string srcName)
-        : m_src(std::move(src)), m_srcName(srcName)
+    // The line index, interner and tokenize() buffers allocate from resource.
+    explicit Tokenizer(std::string_view src, std::string srcName, std::pmr::memory_resource* resource = std::pmr::get_default_resource())
+        : m_src(src), m_srcName(std::move(srcName)), m_resource(resource), m_lines(src, resource), m_symbols(resource), m_end(src.size())
     {
+        // Token offsets are 32 bits wide
+        if (m_src.size() > UINT32_MAX) {
+            std::cerr << m_srcName << ": lex_error: Source files are limited to 4 GiB" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
 
+    // Lexes only [begin, end) of src. Used for the chunks of tokenize_parallel,
+    // whose errors are held back because the chunk may turn out to start
+    // inside a block comment. Chunks are lexed on worker threads, so they
+    // allocate from the (synchronized) default resource.
+    Tokenizer(std::string_view src, std::string srcName, size_t begin, size_t end)
+        : m_src(src), m_srcName(std::move(srcName)), m_resource(std::pmr::get_default_resource()), m_lines(src, m_resource), m_symbols(m_resource), m_index(begin), m_end(end), m_defer_errors(true)
+    {
     }
 
-    std::vector<Token> tokenize() {
-        std::vector<Token> tokens;
-        std::string buf;
-        int line_count = 1;
-        int col_count = 1;
+    // Lexes the next token on demand, so the parser can pull tokens without
+    // the whole stream ever being materialized. Returns nothing at the end.
+    std::optional<Token> next() {
+        while (m_index < m_end) {
+            const char c = m_src[m_index];
+            const std::uint8_t char_class = char_classes[static_cast<unsigned char>(c)];
+            const size_t start = m_index;
 
-        while (peek().has_value()) {
-            if (std::isalpha(peek().value())) {
-                buf.push_back(consume());
-                while (peek().has_value() && std::isalnum(peek().value())) {
-                    buf.push_back(consume());
-                    col_count++;
-                }
-                if (buf == "exit") {
-                    tokens.push_back({ .type = TokenType::_exit, .line = line_count, .col = col_count });
-                    buf.clear();
-                }
-                else if (buf == "let") {
-                    tokens.push_back({ .type = TokenType::let, .line = line_count, .col = col_count });
-                    buf.clear();
-                }
-                else if (buf == "if") {
-                    tokens.push_back({ .type = TokenType::if_, .line = line_count, .col = col_count });
-                    buf.clear();
-                }
-                else if (buf == "else") {
-                    tokens.push_back({ .type = TokenType::else_, .line = line_count, .col = col_count });
-                    buf.clear();
-                }
-                else {
-                    tokens.push_back({ .type = TokenType::ident, .line = line_count, .col = col_count, .value = buf });
-                    buf.clear();
+            if (char_class & cc_alpha) {
+                m_index = scan_ident(m_index + 1);
+                const std::string_view word = m_src.substr(start, m_index - start);
+                if (const auto keyword = lookup_keyword(word)) {
+                    return make_token(keyword.value(), start);
                 }
+                return make_token(TokenType::ident, start, m_symbols.intern(word));
             }
-            else if (std::isdigit(peek().value())) {
-                buf.push_back(consume());
-                while (peek().has_value() && std::isdigit(peek().value())) {
-                    buf.push_back(consume());
-                }
-                tokens.push_back({ .type = TokenType::int_lit, .line = line_count, .col = col_count, .value = buf });
-                buf.clear();
-            }
-            else if (peek().value() == '/' && peek(1).has_value() && peek(1).value() == '/') {
-                consume();
-                consume();
-                while(peek().has_value() && peek().value() != '\n') {
-                    consume();
-                }
+            if (char_class & cc_digit) {
+                m_index = scan_digits(m_index + 1);
+                return make_token(TokenType::int_lit, start, parse_int_lit(start));
             }
-            else if (peek().value() == '/' && peek(1).has_value() && peek(1).value() == '*') {
-                consume();
-                consume();
-                while(peek().has_value()) {
-                    if (peek().value() == '*' && peek(1).has_value() && peek(1).value() == '/') {
-                        break;
-                    }
-                    consume();
-                }
-                if (peek().has_value()) {
-                    consume();
-                }
-                if (peek().has_value()) {
-                    consume();
-                }
+            if (char_class & cc_space) {
+                skip_space();
             }
-            else if (peek().value() == '(') {
-                consume();
-                tokens.push_back({ .type = TokenType::open_paren, .line = line_count, .col = col_count });
+            else if (c == '/' && peek(1) == '/') {
+                m_index = find_newline(m_index + 2);
             }
-            else if (peek().value() == ')') {
-                consume();
-                tokens.push_back({ .type = TokenType::close_paren, .line = line_count, .col = col_count });
+            else if (c == '/' && peek(1) == '*') {
+                skip_block_comment();
             }
-            else if (peek().value() == ';') {
-                consume();
-                tokens.push_back({ .type = TokenType::semi, .line = line_count, .col = col_count });
+            else if (char_class & cc_punct) {
+                const PunctToken punct = punct_tokens[static_cast<unsigned char>(c)].value();
+                m_index++;
+                if (punct.with_eq.has_value() && peek() == '=') {
+                    m_index++;
+                    return make_token(punct.with_eq.value(), start);
+                }
+                return make_token(punct.type, start);
             }
-            else if (peek().value() == '=') {
-                consume();
-                tokens.push_back({ .type = TokenType::eq, .line = line_count, .col = col_count });
+            else {
+                error(start, std::string("Unexpected character '") + c + "'");
+                return {};
             }
-            else if (peek().value() == '+') {
-                if (peek(1).has_value() && peek(1).value() == '=') {
-                    consume();
-                    consume();
-                    tokens.push_back({ .type = TokenType::pluseq, .line = line_count, .col = col_count });
-                    continue;
-                }
-                consume();
-                tokens.push_back({ .type = TokenType::plus, .line = line_count, .col = col_count });
-            }
-            else if (peek().value() == '*') {
-                if (peek(1).has_value() && peek(1).value() == '=') {
-                    consume();
-                    consume();
-                    tokens.push_back({ .type = TokenType::stareq, .line = line_count, .col = col_count });
-                    continue;
-                }
-                consume();
-                tokens.push_back({ .type = TokenType::star, .line = line_count, .col = col_count });
-            }
-            else if (peek().value() == '-') {
-                if (peek(1).has_value() && peek(1).value() == '=') {
-                    consume();
-                    consume();
-                    tokens.push_back({ .type = TokenType::minuseq, .line = line_count, .col = col_count });
-                    continue;
-                }
-                consume();
-                tokens.push_back({ .type = TokenType::minus, .line = line_count, .col = col_count });
-            }
-            else if (peek().value() == '/') {
-                if (peek(1).has_value() && peek(1).value() == '=') {
-                    consume();
-                    consume();
-                    tokens.push_back({ .type = TokenType::fslasheq, .line = line_count, .col = col_count });
-                    continue;
-                }
-                consume();
-                tokens.push_back({ .type = TokenType::fslash, .line = line_count, .col = col_count });
+        }
+        return {};
+    }
+
+    [[nodiscard]] const Interner& symbols() const {
+        return m_symbols;
+    }
+
+    [[nodiscard]] const LineIndex& lines() const {
+        return m_lines;
+    }
+
+    TokenBuffer tokenize() {
+        TokenBuffer tokens(m_resource);
+        while (const auto token = next()) {
+            tokens.push(token.value());
+        }
+        return tokens;
+    }
+
+    // Produces exactly the buffer tokenize() would, lexing on `threads` threads.
+    // The source is cut at line starts into chunks that worker threads lex
+    // speculatively with their own interners. The merge then walks the chunks
+    // in order: a chunk that begins inside a block comment left open by its
+    // predecessor is re-lexed from the end of that comment, held-back errors
+    // are reported for the chunks that are kept, and chunk-local symbols are
+    // re-interned in order so ids match the serial lexer's.
+    TokenBuffer tokenize_parallel(const unsigned threads) {
+        struct Chunk {
+            size_t begin;
+            size_t end;
+            std::optional<Tokenizer> tokenizer {};
+            TokenBuffer tokens {};
+        };
+
+        std::vector<Chunk> chunks;
+        const size_t target_size = std::max<size_t>(m_end / (threads * 4), 1);
+        for (size_t begin = m_index; begin < m_end;) {
+            size_t end = std::min(begin + target_size, m_end);
+            if (end < m_end) {
+                const size_t newline = m_src.find('\n', end);
+                end = newline == std::string_view::npos ? m_end : std::min(newline + 1, m_end);
             }
-            else if (peek().value() == '{') {
-                consume();
-                tokens.push_back({ .type = TokenType::open_curly, .line = line_count, .col = col_count });
+            chunks.push_back({ .begin = begin, .end = end });
+            begin = end;
+        }
+
+        std::atomic<size_t> next_chunk = 0;
+        const auto lex_chunks = [&] {
+            for (size_t i = next_chunk++; i < chunks.size(); i = next_chunk++) {
+                Chunk& chunk = chunks[i];
+                chunk.tokenizer.emplace(m_src, m_srcName, chunk.begin, chunk.end);
+                chunk.tokens = chunk.tokenizer->tokenize();
             }
-            else if (peek().value() == '}') {
-                consume();
-                tokens.push_back({ .type = TokenType::close_curly, .line = line_count, .col = col_count });
+        };
+        std::vector<std::thread> workers;
+        for (unsigned i = 1; i < threads; i++) {
+            workers.emplace_back(lex_chunks);
+        }
+        lex_chunks();
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+
+        TokenBuffer tokens(m_resource);
+        bool in_comment = false;
+        for (Chunk& chunk : chunks) {
+            if (in_comment) {
+                const size_t close = m_src.substr(0, chunk.end).find("*/", chunk.begin);
+                if (close == std::string_view::npos) {
+                    continue; // the whole chunk is comment
+                }
+                chunk.tokenizer.emplace(m_src, m_srcName, close + 2, chunk.end);
+                chunk.tokens = chunk.tokenizer->tokenize();
             }
-            else if (peek().value() == '\n') {
-                consume();
-                line_count++;
-                col_count = 0;
+            if (chunk.tokenizer->m_deferred_error.has_value()) {
+                error(chunk.tokenizer->m_deferred_error->pos, chunk.tokenizer->m_deferred_error->msg);
             }
-            else if (std::isspace(peek().value())) {
-                consume();
+            std::pmr::vector<Symbol> global_symbols(chunk.tokenizer->m_symbols.size(), m_resource);
+            for (Symbol symbol = 0; symbol < global_symbols.size(); symbol++) {
+                global_symbols[symbol] = m_symbols.intern(chunk.tokenizer->m_symbols.name(symbol));
             }
-            else {
-                std::cerr << m_srcName << ":" << line_count << ":" << col_count << ": lex_error: Unexpected character '" << consume() << "'" << std::endl;
-                exit(EXIT_FAILURE);
+            tokens.kinds.insert(tokens.kinds.end(), chunk.tokens.kinds.begin(), chunk.tokens.kinds.end());
+            tokens.offsets.insert(tokens.offsets.end(), chunk.tokens.offsets.begin(), chunk.tokens.offsets.end());
+            tokens.literals.insert(tokens.literals.end(), chunk.tokens.literals.begin(), chunk.tokens.literals.end());
+            for (const Symbol symbol : chunk.tokens.symbols) {
+                tokens.symbols.push_back(global_symbols[symbol]);
             }
-            col_count++;
+            in_comment = chunk.tokenizer->m_ends_in_comment;
+            chunk.tokens = TokenBuffer {};
         }
-        m_index = 0;
+        m_index = m_end;
         return tokens;
     }
 private:
 
-    [[nodiscard]] std::optional<char> peek(size_t offset = 0) const {
-        if (m_index + offset >= m_src.length()) {
-            return {};
+    struct LexError {
+        size_t pos;
+        std::string msg;
+    };
+
+    void error(const size_t pos, const std::string& msg) {
+        if (m_defer_errors) {
+            m_deferred_error = LexError { .pos = pos, .msg = msg };
+            m_index = m_end;
+            return;
+        }
+        const LineIndex::Location loc = m_lines.locate(pos);
+        std::cerr << m_srcName << ":" << loc.line << ":" << loc.col << ": lex_error: " << msg << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    [[nodiscard]] char peek(size_t offset = 0) const {
+        if (m_index + offset >= m_end) {
+            return '\0';
+        }
+        return m_src[m_index + offset];
+    }
+
+    [[nodiscard]] static Token make_token(const TokenType type, const size_t start, const std::uint64_t value = 0) {
+        return { .type = type, .pos = static_cast<std::uint32_t>(start), .value = value };
+    }
+
+    // Parses the digit run [start, m_index) so later stages never see literal
+    // text. Values are unsigned 64-bit, so anything up to UINT64_MAX is fine.
+    [[nodiscard]] std::uint64_t parse_int_lit(const size_t start) {
+        std::uint64_t value = 0;
+        for (size_t i = start; i < m_index; i++) {
+            if (__builtin_mul_overflow(value, 10u, &value) || __builtin_add_overflow(value, static_cast<unsigned>(m_src[i] - '0'), &value)) {
+                error(start, "Integer literal out of range '" + std::string(m_src.substr(start, m_index - start)) + "'");
+                return 0;
+            }
+        }
+        return value;
+    }
+
+#if defined(__SSE2__)
+    [[nodiscard]] __m128i load16(const size_t index) const {
+        return _mm_loadu_si128(reinterpret_cast<const __m128i*>(m_src.data() + index));
+    }
+
+    static __m128i in_range(const __m128i chars, const char lo, const char hi) {
+        return _mm_and_si128(
+            _mm_cmpgt_epi8(chars, _mm_set1_epi8(static_cast<char>(lo - 1))),
+            _mm_cmplt_epi8(chars, _mm_set1_epi8(static_cast<char>(hi + 1))));
+    }
+
+    static unsigned mask_of(const __m128i bytes) {
+        return static_cast<unsigned>(_mm_movemask_epi8(bytes));
+    }
+#endif
+
+    // Returns the end of the [A-Za-z0-9]* run starting at index.
+    [[nodiscard]] size_t scan_ident(size_t index) const {
+        // Most identifiers are short, so try a few bytes before paying for a vector load
+        for (const size_t short_end = index + 8; index < short_end && index < m_end; index++) {
+            if (!(char_classes[static_cast<unsigned char>(m_src[index])] & (cc_alpha | cc_digit))) {
+                return index;
+            }
+        }
+#if defined(__SSE2__)
+        while (index + 16 <= m_end) {
+            const __m128i chars = load16(index);
+            const __m128i alpha = in_range(_mm_or_si128(chars, _mm_set1_epi8(0x20)), 'a', 'z');
+            const __m128i digit = in_range(chars, '0', '9');
+            const unsigned stop = ~mask_of(_mm_or_si128(alpha, digit)) & 0xFFFF;
+            if (stop != 0) {
+                return index + __builtin_ctz(stop);
+            }
+            index += 16;
+        }
+#endif
+        while (index < m_end && (char_classes[static_cast<unsigned char>(m_src[index])] & (cc_alpha | cc_digit))) {
+            index++;
         }
-        return m_src.at(m_index + offset);
+        return index;
     }
 
-    char consume() {
-        return m_src.at(m_index++);
+    // Returns the end of the [0-9]* run starting at index.
+    [[nodiscard]] size_t scan_digits(size_t index) const {
+#if defined(__SSE2__)
+        while (index + 16 <= m_end) {
+            const unsigned stop = ~mask_of(in_range(load16(index), '0', '9')) & 0xFFFF;
+            if (stop != 0) {
+                return index + __builtin_ctz(stop);
+            }
+            index += 16;
+        }
+#endif
+        while (index < m_end && (char_classes[static_cast<unsigned char>(m_src[index])] & cc_digit)) {
+            index++;
+        }
+        return index;
     }
 
-    const std::string m_src;
+    // Returns the index of the next '\n' at or after index, or the end of the source.
+    [[nodiscard]] size_t find_newline(size_t index) const {
+#if defined(__SSE2__)
+        while (index + 16 <= m_end) {
+            const unsigned newline = mask_of(_mm_cmpeq_epi8(load16(index), _mm_set1_epi8('\n')));
+            if (newline != 0) {
+                return index + __builtin_ctz(newline);
+            }
+            index += 16;
+        }
+#endif
+        while (index < m_end && m_src[index] != '\n') {
+            index++;
+        }
+        return index;
+    }
+
+    void skip_space() {
+        // Single separators are the common case; long runs (indentation) go wide
+        for (const size_t short_end = m_index + 4; m_index < short_end && m_index < m_end; m_index++) {
+            if (!(char_classes[static_cast<unsigned char>(m_src[m_index])] & cc_space)) {
+                return;
+            }
+        }
+#if defined(__SSE2__)
+        while (m_index + 16 <= m_end) {
+            const __m128i chars = load16(m_index);
+            const __m128i space = _mm_or_si128(in_range(chars, '\t', '\r'), _mm_cmpeq_epi8(chars, _mm_set1_epi8(' ')));
+            const unsigned stop = ~mask_of(space) & 0xFFFF;
+            if (stop != 0) {
+                m_index += __builtin_ctz(stop);
+                return;
+            }
+            m_index += 16;
+        }
+#endif
+        while (m_index < m_end && (char_classes[static_cast<unsigned char>(m_src[m_index])] & cc_space)) {
+            m_index++;
+        }
+    }
+
+    // Skips a /* */ comment starting at m_index. An unterminated comment runs
+    // to the end of the source.
+    void skip_block_comment() {
+        m_index += 2;
+#if defined(__SSE2__)
+        while (m_index + 17 <= m_end) {
+            const unsigned ends = mask_of(_mm_cmpeq_epi8(load16(m_index), _mm_set1_epi8('*')))
+                & mask_of(_mm_cmpeq_epi8(load16(m_index + 1), _mm_set1_epi8('/')));
+            if (ends != 0) {
+                m_index += __builtin_ctz(ends) + 2;
+                return;
+            }
+            m_index += 16;
+        }
+#endif
+        while (m_index < m_end) {
+            if (m_src[m_index] == '*' && peek(1) == '/') {
+                m_index += 2;
+                return;
+            }
+            m_index++;
+        }
+        m_ends_in_comment = true;
+    }
+
+    const std::string_view m_src;
     const std::string m_srcName;
+    std::pmr::memory_resource* m_resource;
+    const LineIndex m_lines;
+    Interner m_symbols;
+    size_t m_index = 0;
+    size_t m_end;
+    bool m_defer_errors = false;
+    std::optional<LexError> m_deferred_error {};
+    bool m_ends_in_comment = false;
+};
+
+// Source offset just past the token, where "expected ..." diagnostics point.
+inline size_t token_end(const std::string_view src, const Token& token) {
+    size_t end = token.pos + 1;
+    switch (token.type) {
+        case TokenType::pluseq:
+        case TokenType::stareq:
+        case TokenType::minuseq:
+        case TokenType::fslasheq:
+            return end + 1;
+        case TokenType::int_lit:
+        case TokenType::ident:
+        case TokenType::_exit:
+        case TokenType::let:
+        case TokenType::if_:
+        case TokenType::else_:
+            while (end < src.size() && (char_classes[static_cast<unsigned char>(src[end])] & (cc_alpha | cc_digit))) {
+                end++;
+            }
+            return end;
+        default:
+            return end;
+    }
+}
+
+// Where the parser pulls its tokens from: straight from a Tokenizer, or from
+// a TokenBuffer that was lexed up front.
+class TokenStream {
+public:
+    explicit TokenStream(Tokenizer& tokenizer)
+        : m_tokenizer(&tokenizer)
+    {
+    }
+
+    explicit TokenStream(const TokenBuffer& buffer)
+        : m_buffer(&buffer)
+    {
+    }
+
+    std::optional<Token> next() {
+        if (m_tokenizer != nullptr) {
+            return m_tokenizer->next();
+        }
+        if (m_index == m_buffer->size()) {
+            return {};
+        }
+        Token token { .type = m_buffer->kinds[m_index], .pos = m_buffer->offsets[m_index] };
+        if (token.type == TokenType::ident) {
+            token.value = m_buffer->symbols[m_symbol_index++];
+        }
+        else if (token.type == TokenType::int_lit) {
+            token.value = m_buffer->literals[m_literal_index++];
+        }
+        m_index++;
+        return token;
+    }
+
+private:
+    Tokenizer* m_tokenizer = nullptr;
+    const TokenBuffer* m_buffer = nullptr;
     size_t m_index = 0;
+    size_t m_symbol_index = 0;
+    size_t m_literal_index = 0;
 };
\ No newline at end of file
@@ -0,0 +1,160 @@
+// Counts the heap allocations of whole compiles of growing programs and
+// checks that the count doesn't grow with them: tokens, symbols, the AST, the
+// IR and the generated code all come from the arena, so a bigger program
+// only means bigger arena chunks, which come from mmap past the first. That
+// first chunk is the only heap allocation.
+//
+// malloc and friends are replaced with counting wrappers around glibc's own,
+// which every operator new ends up in: the aligned forms, which the default
+// memory resource allocates through, in aligned_alloc or posix_memalign.
+
+#include <bit>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory_resource>
+#include <string>
+
+#include "arena.hpp"
+#include "bench.hpp"
+#include "dead_code.hpp"
+#include "encoder.hpp"
+#include "folding.hpp"
+#include "generation.hpp"
+#include "generationLith.hpp"
+#include "ir.hpp"
+#include "lith.hpp"
+#include "parser.hpp"
+#include "sccp.hpp"
+#include "tokenization.hpp"
+
+extern "C" {
+void* __libc_malloc(size_t size);
+void* __libc_calloc(size_t count, size_t size);
+void* __libc_realloc(void* ptr, size_t size);
+void* __libc_memalign(size_t alignment, size_t size);
+void __libc_free(void* ptr);
+}
+
+namespace {
+bool counting = false;
+size_t allocations = 0;
+}
+
+extern "C" {
+void* malloc(const size_t size) {
+    allocations += counting;
+    return __libc_malloc(size);
+}
+
+void* calloc(const size_t count, const size_t size) {
+    allocations += counting;
+    return __libc_calloc(count, size);
+}
+
+void* realloc(void* ptr, const size_t size) {
+    allocations += counting;
+    return __libc_realloc(ptr, size);
+}
+
+void* memalign(const size_t alignment, const size_t size) {
+    allocations += counting;
+    return __libc_memalign(alignment, size);
+}
+
+void* aligned_alloc(const size_t alignment, const size_t size) {
+    allocations += counting;
+    return __libc_memalign(alignment, size);
+}
+
+int posix_memalign(void** ptr, const size_t alignment, const size_t size) {
+    if (alignment % sizeof(void*) != 0 || !std::has_single_bit(alignment)) {
+        return EINVAL;
+    }
+    allocations += counting;
+    void* result = __libc_memalign(alignment, size);
+    if (result == nullptr) {
+        return ENOMEM;
+    }
+    *ptr = result;
+    return 0;
+}
+
+void free(void* ptr) {
+    __libc_free(ptr);
+}
+}
+
+// Everything main does between mapping the source and writing the output,
+// for the linux and lith backends
+static size_t code_size(const std::string& src) {
+    ArenaAllocator arena(1024 * 1024);
+    Tokenizer tokenizer(src, "alloc.l", &arena);
+    Parser parser(TokenStream(tokenizer), tokenizer.lines(), "alloc.l", &arena);
+    std::optional<NodeProg> prog = parser.parse_prog();
+    Folder folder(prog.value(), tokenizer.symbols().size(), &arena);
+    folder.fold_prog();
+    IrBuilder builder(prog.value(), tokenizer.symbols(), "alloc.l", &arena);
+    ConstantPropagator propagator(&arena);
+    DeadCodeEliminator eliminator(&arena);
+    const IrProg ir = eliminator.run(propagator.run(builder.build()));
+    Generator generator(ir, false, Generator::ExitMode::syscall, &arena);
+    Encoder encoder(&arena);
+    const size_t size = encoder.encode(generator.gen_prog()).size();
+    GeneratorLith lith(ir, &arena);
+    LithAssembler assembler(&arena);
+    static_cast<void>(assembler.assemble(lith.gen_prog(), lith.stack_size()));
+    return size;
+}
+
+int main() {
+    // The count would pass vacuously if operator new, plain or aligned,
+    // didn't come through here
+    counting = true;
+    ::operator delete(::operator new(64));
+    counting = false;
+    if (allocations != 1) {
+        std::cerr << "Error: operator new doesn't call the counting malloc" << std::endl;
+        return EXIT_FAILURE;
+    }
+    allocations = 0;
+    counting = true;
+    for (const size_t alignment : { alignof(std::max_align_t), size_t { 64 } }) {
+        std::pmr::memory_resource* resource = std::pmr::get_default_resource();
+        resource->deallocate(resource->allocate(64, alignment), 64, alignment);
+    }
+    counting = false;
+    if (allocations != 2) {
+        std::cerr << "Error: the default memory resource doesn't call the counting allocator" << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Once uncounted, for whatever the library sets up on first use
+    code_size(make_chunks(10));
+
+    size_t baseline = 0;
+    for (size_t n = 10; n <= 100000; n *= 10) {
+        const std::string src = make_chunks(n);
+        allocations = 0;
+        counting = true;
+        const size_t size = code_size(src);
+        counting = false;
+        std::cout << n << " chunks (" << src.size() << " bytes, " << size << " bytes of code): " << allocations << " allocations" << std::endl;
+        if (n == 10) {
+            // The arena's first chunk; anything more is a container left on
+            // the heap, even if its allocations don't grow with the program
+            if (allocations != 1) {
+                std::cerr << "Error: " << allocations << " allocations for " << n << " chunks, not just the arena's first chunk" << std::endl;
+                return EXIT_FAILURE;
+            }
+            baseline = allocations;
+        }
+        else if (allocations != baseline) {
+            std::cerr << "Error: " << allocations << " allocations for " << n << " chunks, " << baseline << " for 10" << std::endl;
+            return EXIT_FAILURE;
+        }
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,321 @@
+// Checks the encoder against NASM, which the listing of -d is written for.
+// Random programs are compiled to instructions, which are both encoded and
+// written as a listing for NASM to assemble, and the .text of its object
+// must be the encoder's bytes. Where NASM picks another encoding, both are
+// run, as executables or, for code that returns, through run_jit in a child
+// process, and must end the same way.
+//
+//     test_nasm <nasm>
+//
+// Constant propagation is left out, so the programs keep their arithmetic
+// instead of folding to an exit.
+
+#include <array>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <optional>
+#include <random>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#include "arena.hpp"
+#include "dead_code.hpp"
+#include "elf.hpp"
+#include "encoder.hpp"
+#include "folding.hpp"
+#include "generation.hpp"
+#include "ir.hpp"
+#include "jit.hpp"
+#include "output_buffer.hpp"
+#include "parser.hpp"
+#include "tokenization.hpp"
+
+class ProgramGenerator {
+public:
+    explicit ProgramGenerator(const std::uint64_t seed) : m_rng(seed) {
+    }
+
+    std::string program() {
+        m_src.clear();
+        m_count = 0;
+        m_max_stmts = chance(0.2) ? 40 : 8;
+        std::vector<std::string> vars;
+        block(vars, 3, "");
+        std::string result = "0";
+        for (const std::string& var : vars) {
+            result = "(" + result + " + " + var + ")";
+        }
+        m_src += "exit(" + result + ");\n";
+        return m_src;
+    }
+
+private:
+    bool chance(const double p) {
+        return std::uniform_real_distribution<double>(0, 1)(m_rng) < p;
+    }
+
+    size_t below(const size_t n) {
+        return m_rng() % n;
+    }
+
+    std::string literal() {
+        static constexpr std::array<std::uint64_t, 14> common {
+            0, 1, 2, 3, 5, 7, 8, 9, 10, 16, 100, 255, 1000, 4294967295
+        };
+        switch (below(4)) {
+            case 0:
+                return std::to_string(m_rng() >> below(64));
+            case 1:
+                return std::to_string(below(128));
+            default:
+                return std::to_string(common[below(common.size())]);
+        }
+    }
+
+    std::string expr(const std::vector<std::string>& vars, const int depth) {
+        if (depth <= 0 || chance(0.3)) {
+            if (!vars.empty() && chance(0.6)) {
+                return vars[below(vars.size())];
+            }
+            return literal();
+        }
+        static constexpr std::array<const char*, 4> ops { " + ", " - ", " * ", " / " };
+        const char* op = ops[below(ops.size())];
+        const std::string lhs = expr(vars, depth - 1);
+        return "(" + lhs + op + (op == ops[3] ? divisor(vars, depth - 1) : expr(vars, depth - 1)) + ")";
+    }
+
+    // Odd, so never zero and the programs rarely trap
+    std::string divisor(const std::vector<std::string>& vars, const int depth) {
+        if (chance(0.5)) {
+            const std::string value = literal();
+            return value != "0" ? value : "1";
+        }
+        return "(" + expr(vars, depth) + " * 2 + 1)";
+    }
+
+    void block(std::vector<std::string>& vars, const int depth, const std::string& indent) {
+        const size_t scope_vars = vars.size();
+        const size_t stmts = below(m_max_stmts) + 1;
+        for (size_t i = 0; i < stmts; i++) {
+            const double k = std::uniform_real_distribution<double>(0, 1)(m_rng);
+            if (k < 0.4 || vars.empty()) {
+                const std::string name = "v" + std::to_string(++m_count);
+                m_src += indent + "let " + name + " = " + expr(vars, 3) + ";\n";
+                vars.push_back(name);
+            }
+            else if (k < 0.7) {
+                static constexpr std::array<const char*, 5> ops { " = ", " += ", " -= ", " *= ", " /= " };
+                const char* op = ops[below(ops.size())];
+                m_src += indent + vars[below(vars.size())] + op + (op == ops[4] ? divisor(vars, 3) : expr(vars, 3)) + ";\n";
+            }
+            else if (k < 0.8 && depth > 0) {
+                m_src += indent + "{\n";
+                block(vars, depth - 1, indent + "    ");
+                m_src += indent + "}\n";
+            }
+            else if (depth > 0) {
+                m_src += indent + "if (" + expr(vars, 2) + ") {\n";
+                block(vars, depth - 1, indent + "    ");
+                while (chance(0.4)) {
+                    m_src += indent + "} else if (" + expr(vars, 2) + ") {\n";
+                    block(vars, depth - 1, indent + "    ");
+                }
+                if (chance(0.5)) {
+                    m_src += indent + "} else {\n";
+                    block(vars, depth - 1, indent + "    ");
+                }
+                m_src += indent + "}\n";
+            }
+            else if (chance(0.3)) {
+                m_src += indent + "exit(" + expr(vars, 2) + ");\n";
+            }
+        }
+        if (depth < 3) {
+            vars.resize(scope_vars);
+        }
+    }
+
+    std::mt19937_64 m_rng;
+    std::string m_src;
+    size_t m_count = 0;
+    size_t m_max_stmts = 8;
+};
+
+static int failures = 0;
+
+static std::string read_file(const std::filesystem::path& path) {
+    std::ifstream file(path, std::ios::binary);
+    return { std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>() };
+}
+
+template <typename T>
+static T read_at(const std::string& bytes, const size_t offset) {
+    T value {};
+    if (offset + sizeof(T) <= bytes.size()) {
+        std::memcpy(&value, bytes.data() + offset, sizeof(T));
+    }
+    return value;
+}
+
+// The contents of the .text section of an ELF64 object
+static std::optional<std::string> text_section(const std::string& object) {
+    if (object.size() < 64 || object.compare(0, 4, "\x7f" "ELF") != 0) {
+        return {};
+    }
+    const auto shoff = read_at<std::uint64_t>(object, 0x28);
+    const auto shentsize = read_at<std::uint16_t>(object, 0x3a);
+    const auto shnum = read_at<std::uint16_t>(object, 0x3c);
+    const auto shstrndx = read_at<std::uint16_t>(object, 0x3e);
+    const auto section = [&](const size_t i) { return shoff + i * shentsize; };
+    const auto names = read_at<std::uint64_t>(object, section(shstrndx) + 0x18);
+    for (size_t i = 0; i < shnum; i++) {
+        const auto name = read_at<std::uint32_t>(object, section(i));
+        if (std::strcmp(object.c_str() + std::min<size_t>(names + name, object.size()), ".text") == 0) {
+            const auto offset = read_at<std::uint64_t>(object, section(i) + 0x18);
+            const auto size = read_at<std::uint64_t>(object, section(i) + 0x20);
+            if (offset + size > object.size()) {
+                return {};
+            }
+            return object.substr(offset, size);
+        }
+    }
+    return {};
+}
+
+// Runs a program without a shell, returning its wait status
+static int run(const std::vector<std::string>& args) {
+    std::vector<char*> argv;
+    for (const std::string& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+    }
+    argv.push_back(nullptr);
+    const pid_t pid = ::fork();
+    if (pid == 0) {
+        ::execv(argv[0], argv.data());
+        ::_exit(127);
+    }
+    int status = -1;
+    if (pid > 0) {
+        ::waitpid(pid, &status, 0);
+    }
+    return status;
+}
+
+// Runs code in the way its exit mode needs, returning the wait status of the
+// process it ran in: as an executable for the exit system call, and through
+// run_jit in a child for a return, whose value becomes the child's exit status
+static int run_code(const std::filesystem::path& path, const std::pmr::vector<std::uint8_t>& code, const Generator::ExitMode exit_mode) {
+    if (exit_mode == Generator::ExitMode::ret) {
+        const pid_t pid = ::fork();
+        if (pid == 0) {
+            ::_exit(static_cast<int>(run_jit(code) & 0xFF));
+        }
+        int status = -1;
+        if (pid > 0) {
+            ::waitpid(pid, &status, 0);
+        }
+        return status;
+    }
+    ::unlink(path.c_str());
+    {
+        std::optional<OutputBuffer> out = OutputBuffer::create(path.string(), OutputBuffer::default_capacity, std::pmr::get_default_resource(), 0755);
+        write_elf(out.value(), code);
+    }
+    return run({ path.string() });
+}
+
+struct Counts {
+    size_t programs = 0;
+    size_t identical = 0;
+    size_t ran = 0; // differed, so were run
+    size_t exited = 0; // of those, ended by their exit rather than a signal
+    std::array<bool, static_cast<size_t>(Opcode::comment) + 1> seen {};
+};
+
+static void check(const std::string& src, const std::string& nasm, const std::filesystem::path& dir, const bool verbose, const Generator::ExitMode exit_mode,
+                  Counts& counts) {
+    ArenaAllocator arena(1024 * 1024);
+    Tokenizer tokenizer(src, "nasm.l", &arena);
+    Parser parser(TokenStream(tokenizer), tokenizer.lines(), "nasm.l", &arena);
+    std::optional<NodeProg> prog = parser.parse_prog();
+    Folder folder(prog.value(), tokenizer.symbols().size(), &arena);
+    folder.fold_prog();
+    IrBuilder builder(prog.value(), tokenizer.symbols(), "nasm.l", &arena);
+    DeadCodeEliminator eliminator(&arena);
+    const IrProg ir = eliminator.run(builder.build());
+    Generator generator(ir, verbose, exit_mode, &arena);
+    const std::pmr::vector<Instr>& code = generator.gen_prog();
+    for (const Instr& instr : code) {
+        counts.seen[static_cast<size_t>(instr.op)] = true;
+    }
+    Encoder encoder(&arena);
+    const std::pmr::vector<std::uint8_t>& bytes = encoder.encode(code);
+    counts.programs++;
+
+    {
+        std::optional<OutputBuffer> listing = OutputBuffer::create((dir / "out.asm").string(), OutputBuffer::default_capacity, &arena);
+        generator.write_asm(listing.value());
+    }
+    std::filesystem::remove(dir / "out.o");
+    const int assembled = run({ nasm, "-f", "elf64", "-o", (dir / "out.o").string(), (dir / "out.asm").string() });
+    const std::optional<std::string> text = text_section(assembled == 0 ? read_file(dir / "out.o") : std::string());
+    if (!text.has_value()) {
+        if (failures++ < 10) {
+            std::cerr << "Error: NASM could not assemble the listing of\n" << src << std::endl;
+        }
+        return;
+    }
+    if (text->size() == bytes.size() && std::memcmp(text->data(), bytes.data(), bytes.size()) == 0) {
+        counts.identical++;
+        return;
+    }
+
+    const std::pmr::vector<std::uint8_t> nasm_bytes(text->begin(), text->end());
+    const int expected = run_code(dir / "nasm", nasm_bytes, exit_mode);
+    const int status = run_code(dir / "encoded", bytes, exit_mode);
+    counts.ran++;
+    counts.exited += WIFEXITED(expected);
+    // A trap on division is the only way these programs may end early
+    if (WIFSIGNALED(expected) && WTERMSIG(expected) != SIGFPE && failures++ < 10) {
+        std::cerr << "Error: NASM's build was killed by signal " << WTERMSIG(expected) << ":\n" << src << std::endl;
+    }
+    if (status != expected && failures++ < 10) {
+        std::cerr << "Error: the encoded program ended with status " << status << ", NASM's with " << expected << ":\n" << src << std::endl;
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc != 2) {
+        std::cerr << "Usage: test_nasm <nasm>" << std::endl;
+        return EXIT_FAILURE;
+    }
+    const std::string nasm = argv[1];
+    const std::filesystem::path dir = std::filesystem::temp_directory_path() / ("lithium_nasm_" + std::to_string(::getpid()));
+    std::filesystem::create_directories(dir);
+
+    Counts counts;
+    ProgramGenerator programs(1);
+    for (int i = 0; i < 400; i++) {
+        const std::string src = programs.program();
+        check(src, nasm, dir, i % 8 == 0, i % 4 == 1 ? Generator::ExitMode::ret : Generator::ExitMode::syscall, counts);
+    }
+    std::filesystem::remove_all(dir);
+
+    std::cout << counts.programs << " programs, " << counts.identical << " assembled by NASM to the same bytes, " << counts.ran << " run, " << counts.exited
+              << " of those to their exit" << std::endl;
+    for (size_t op = 0; op < counts.seen.size(); op++) {
+        if (!counts.seen[op]) {
+            std::cout << "Opcode " << op << " was never generated" << std::endl;
+        }
+    }
+    return failures > 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -0,0 +1,144 @@
+// Checks the constants the x86 backends lower multiplication and division
+// by a constant with. Division: x / d computed from div_magic(d) the way
+// DivMagic documents, against the hardware's, exhaustively over small
+// divisors and numerators, at the numerators where the quotient steps
+// near 2^64, and on random 64-bit pairs. Multiplication: the shift and lea
+// steps of mul_steps(c) evaluated as the instructions would, against x * c,
+// and that every constant of that form gets steps.
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+
+#include "strength.hpp"
+
+static std::uint64_t mulhi(const std::uint64_t a, const std::uint64_t b) {
+    return static_cast<std::uint64_t>((static_cast<unsigned __int128>(a) * b) >> 64);
+}
+
+static std::uint64_t divide(const DivMagic& magic, const std::uint64_t x) {
+    if (magic.add) {
+        const std::uint64_t q = mulhi(x, magic.multiplier);
+        return (((x - q) >> 1) + q) >> magic.post_shift;
+    }
+    return mulhi(x >> magic.pre_shift, magic.multiplier) >> magic.post_shift;
+}
+
+// lea r, [r+r*(f-1)] for each factor, then shl r, shift
+static std::uint64_t multiply(const MulSteps& steps, std::uint64_t x) {
+    for (const std::uint8_t factor : steps.factors) {
+        if (factor != 1) {
+            x = x + x * (factor - 1u);
+        }
+    }
+    return x << steps.shift;
+}
+
+static int failures = 0;
+
+static void check_div(const std::uint64_t d, const DivMagic& magic, const std::uint64_t x) {
+    if (divide(magic, x) != x / d && failures++ < 10) {
+        std::cerr << "Error: " << x << " / " << d << " gave " << divide(magic, x) << ", not " << x / d << std::endl;
+    }
+}
+
+static void check_divisor(const std::uint64_t d, const std::uint64_t exhaustive, std::mt19937_64& rng) {
+    if (std::has_single_bit(d)) {
+        return;
+    }
+    const DivMagic magic = div_magic(d);
+    for (std::uint64_t x = 0; x < exhaustive; x++) {
+        check_div(d, magic, x);
+    }
+    // Around the largest multiples of d, where the error of the reciprocal
+    // is biggest
+    const std::uint64_t top = UINT64_MAX / d * d;
+    for (std::uint64_t k = 0; k < 4 && k * d <= top; k++) {
+        const std::uint64_t multiple = top - k * d;
+        check_div(d, magic, multiple - 1);
+        check_div(d, magic, multiple);
+        if (multiple != UINT64_MAX) {
+            check_div(d, magic, multiple + 1);
+        }
+    }
+    check_div(d, magic, UINT64_MAX);
+    check_div(d, magic, d - 1);
+    check_div(d, magic, d);
+    for (int i = 0; i < 16; i++) {
+        check_div(d, magic, rng());
+    }
+}
+
+// A random value whose width is random too, so small ones come up as often
+// as large ones
+static std::uint64_t random_width(std::mt19937_64& rng) {
+    const int width = static_cast<int>(rng() % 64) + 1;
+    const std::uint64_t value = rng() >> (64 - width);
+    return value != 0 ? value : 1;
+}
+
+int main() {
+    std::mt19937_64 rng(2024);
+
+    for (std::uint64_t d = 3; d < 1024; d++) {
+        check_divisor(d, 1 << 16, rng);
+    }
+    for (std::uint64_t d = 1024; d < 1 << 16; d++) {
+        check_divisor(d, 256, rng);
+    }
+    for (int i = 0; i < 200000; i++) {
+        check_divisor(random_width(rng), 4, rng);
+    }
+    for (int shift = 1; shift < 64; shift++) {
+        const std::uint64_t power = std::uint64_t { 1 } << shift;
+        check_divisor(power - 1, 4, rng);
+        check_divisor(power + 1, 4, rng);
+    }
+    check_divisor(UINT64_MAX, 4, rng);
+    check_divisor(UINT64_MAX - 1, 4, rng);
+
+    const auto check_mul = [&](const std::uint64_t c) {
+        const std::optional<MulSteps> steps = mul_steps(c);
+        const std::uint64_t odd = c >> std::countr_zero(c);
+        bool lea_form = false;
+        for (const std::uint64_t a : { 1, 3, 5, 9 }) {
+            for (const std::uint64_t b : { 1, 3, 5, 9 }) {
+                lea_form |= a * b == odd;
+            }
+        }
+        if (steps.has_value() != lea_form) {
+            if (failures++ < 10) {
+                std::cerr << "Error: mul_steps(" << c << ") " << (lea_form ? "missed" : "gave steps for") << " it" << std::endl;
+            }
+            return;
+        }
+        if (!steps.has_value()) {
+            return;
+        }
+        for (const std::uint64_t x : { std::uint64_t { 0 }, std::uint64_t { 1 }, std::uint64_t { 7 }, UINT64_MAX, rng(), rng() }) {
+            if (multiply(steps.value(), x) != x * c && failures++ < 10) {
+                std::cerr << "Error: the steps for " << x << " * " << c << " gave " << multiply(steps.value(), x) << std::endl;
+            }
+        }
+    };
+    for (std::uint64_t c = 1; c < 1 << 16; c++) {
+        check_mul(c);
+    }
+    for (int shift = 0; shift < 64; shift++) {
+        for (const std::uint64_t odd : { 1, 3, 5, 9, 15, 25, 27, 45, 81, 7, 11, 243 }) {
+            if (odd << shift >> shift == odd) {
+                check_mul(odd << shift);
+            }
+        }
+    }
+    for (int i = 0; i < 100000; i++) {
+        check_mul(random_width(rng));
+    }
+
+    if (failures != 0) {
+        std::cerr << failures << " failures" << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,141 @@
+// Differential test of Tokenizer::tokenize_parallel against tokenize(): on
+// random sources and on hand-written edge cases, for thread counts from 1
+// to well past the number of lines, the buffers must be identical token for
+// token, with the same symbol ids for the same names. The sources are full
+// of block comments spanning many lines, and so many chunk boundaries, with
+// text inside that would be a lex error or a token outside one.
+
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include "tokenization.hpp"
+
+static int failures = 0;
+
+static void fail(const std::string& what, const std::string& src, const unsigned threads) {
+    if (failures++ < 10) {
+        std::cerr << "Error: " << what << " with " << threads << " threads, source:\n" << src << "\n----" << std::endl;
+    }
+}
+
+static void check(const std::string& src, const unsigned threads) {
+    Tokenizer serial(src, "serial.l");
+    const TokenBuffer expected = serial.tokenize();
+    Tokenizer parallel(src, "parallel.l");
+    const TokenBuffer actual = parallel.tokenize_parallel(threads);
+
+    if (actual.kinds != expected.kinds) {
+        fail("token kinds differ", src, threads);
+    }
+    else if (actual.offsets != expected.offsets) {
+        fail("token offsets differ", src, threads);
+    }
+    else if (actual.literals != expected.literals) {
+        fail("literals differ", src, threads);
+    }
+    else if (actual.symbols != expected.symbols || parallel.symbols().size() != serial.symbols().size()) {
+        fail("symbol ids differ", src, threads);
+    }
+    else {
+        for (Symbol symbol = 0; symbol < serial.symbols().size(); symbol++) {
+            if (parallel.symbols().name(symbol) != serial.symbols().name(symbol)) {
+                fail("symbol names differ", src, threads);
+                break;
+            }
+        }
+    }
+}
+
+// Text that is only harmless inside a comment
+static std::string comment_text(std::mt19937_64& rng) {
+    static const std::vector<std::string> pieces {
+        "@", "#", "\"", "99999999999999999999", "/", "*", "/*", "**", "* /", "let x = 1;", "exit(", "\n", "\n", "\n\n", " ", "//",
+    };
+    std::string text;
+    for (size_t n = rng() % 12; n > 0; n--) {
+        text += pieces[rng() % pieces.size()];
+    }
+    // The pieces mustn't close the comment early
+    for (size_t end = text.find("*/"); end != std::string::npos; end = text.find("*/")) {
+        text.insert(end + 1, " ");
+    }
+    return text;
+}
+
+static std::string random_source(std::mt19937_64& rng, const size_t length) {
+    static const std::vector<std::string> tokens {
+        "let", "exit", "if", "else", "(", ")", "{", "}", ";", "=", "+", "-", "*", "/", "+=", "-=", "*=", "/=",
+        "x", "y", "letter", "exitcode", "a1", "b22", "0", "7", "42", "18446744073709551615", "9223372036854775808",
+    };
+    std::string src;
+    while (src.size() < length) {
+        switch (rng() % 8) {
+            case 0:
+                src += "/*" + comment_text(rng) + "*/";
+                break;
+            case 1:
+                src += "// /* not a comment start @\n";
+                break;
+            case 2:
+                src += rng() % 2 == 0 ? "\n" : "\r\n\t";
+                break;
+            case 3:
+                src += "v" + std::to_string(rng() % 50);
+                src += ' ';
+                break;
+            default:
+                src += tokens[rng() % tokens.size()];
+                src += rng() % 3 == 0 ? "\n" : " ";
+                break;
+        }
+    }
+    return src;
+}
+
+int main() {
+    static const std::vector<std::string> cases {
+        "",
+        "\n\n\n",
+        "let x = 1;",
+        "let x = 1;\nexit(x);",
+        "/* one\ncomment\nover\nevery\nline\nof\nthe\nsource */",
+        "/* never\nclosed\nlet x = @;\n",
+        "let a = 1;\n/*\n@\n*/\nlet b = 2;\n/*\n#\n*/ exit(a + b);\n",
+        "/*\n*/\n/*\n*/\n/*\n*/\n/*\n*/\nx\n",
+        "// /* not a comment\nlet x = 1;\n// */\nexit(x);\n",
+        "/*/ still a comment\n*/ let x = 1;\n",
+        "/**/x/***/y/****/z\n/*\n**/\nw\n",
+        "let x = 18446744073709551615;\n/*\n18446744073709551616\n*/\nexit(x);\n",
+        "x x x x x x x x x x x x x x x x x x x x x x x x x x x x x x x x x x x x x x x x",
+    };
+    for (const std::string& src : cases) {
+        for (unsigned threads = 1; threads <= 40; threads++) {
+            check(src, threads);
+        }
+    }
+
+    std::mt19937_64 rng(6);
+    for (int i = 0; i < 300; i++) {
+        const std::string src = random_source(rng, 1 + rng() % 4000);
+        for (const unsigned threads : { 1u, 2u, 3u, 4u, 7u, 8u, 16u, 64u, 257u }) {
+            check(src, threads);
+        }
+    }
+    // Long enough for every thread to get several chunks
+    for (int i = 0; i < 4; i++) {
+        const std::string src = random_source(rng, 1 << 20);
+        for (const unsigned threads : { 2u, 5u, 16u }) {
+            check(src, threads);
+        }
+    }
+
+    if (failures != 0) {
+        std::cerr << failures << " failures" << std::endl;
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}